@@ -5,8 +5,6 @@ local disable_gc = true
 local type = type
 local tconcat = table.concat
 
-local URL = require('lhttp_url')
-
 if arg[1] == '-gc' then
   disable_gc = false
   table.remove(arg, 1)
@@ -139,11 +137,9 @@ local function init_parser(reqs)
     cur = { headers = {} }
   end
 
-  function cb.onUrl(value)
-    cur.url = value
-    local parsed = URL.parse(cur.url)
-    if not parsed then return nil end
-    cur.path, cur.query, cur.hash = parsed.pathname, parsed.query, parsed.hash
+  -- split in C by the parse_url option
+  function cb.onUrl(value, path, query, hash)
+    cur.url, cur.path, cur.query, cur.hash = value, path, query, hash
   end
 
   function cb.onBody(value)
@@ -173,7 +169,7 @@ local function init_parser(reqs)
     cur = nil
   end
 
-  parser = lhp.new('request', cb)
+  parser = lhp.new('request', cb, { parse_url = true })
   return parser
 end
 
@@ -0,0 +1,224 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "llhttp.h"
+#include "lhttp_ffi.h"
+
+struct lhttp_ffi_parser {
+  llhttp_t parser;
+
+  /* output of the running execute */
+  const char *data;
+  lhttp_event *events;
+  int max_events;
+  int nevents;
+};
+
+/*****************************************************************************/
+/* Record one event, pause llhttp once the array is full so that the caller
+ * can drain it and continue where parsing stopped */
+static int lhttp_ffi_record(llhttp_t *parser, uint32_t kind, const char *at,
+                            size_t length) {
+  lhttp_ffi_parser *p = (lhttp_ffi_parser *)parser;
+  lhttp_event *ev;
+
+  if (p->nevents >= p->max_events) return HPE_PAUSED;
+
+  ev = &p->events[p->nevents++];
+  ev->kind = kind;
+  ev->offset = at ? (uint32_t)(at - p->data) : 0;
+  ev->length = length > UINT32_MAX ? UINT32_MAX : (uint32_t)length;
+
+  return p->nevents == p->max_events ? HPE_PAUSED : 0;
+}
+
+#define LHTTP_FFI_CB(name, kind)                                              \
+  static int lhttp_ffi_##name(llhttp_t *parser) {                             \
+    return lhttp_ffi_record(parser, kind, NULL, 0);                           \
+  }
+#define LHTTP_FFI_SPAN_CB(name, kind)                                         \
+  static int lhttp_ffi_##name(llhttp_t *parser, const char *at,              \
+                              size_t length) {                                \
+    return lhttp_ffi_record(parser, kind, at, length);                        \
+  }
+
+LHTTP_FFI_CB(on_message_begin, LHTTP_EV_MESSAGE_BEGIN)
+LHTTP_FFI_SPAN_CB(on_url, LHTTP_EV_URL)
+LHTTP_FFI_SPAN_CB(on_status, LHTTP_EV_STATUS)
+LHTTP_FFI_SPAN_CB(on_header_field, LHTTP_EV_HEADER_FIELD)
+LHTTP_FFI_SPAN_CB(on_header_value, LHTTP_EV_HEADER_VALUE)
+LHTTP_FFI_CB(on_headers_complete, LHTTP_EV_HEADERS_COMPLETE)
+LHTTP_FFI_SPAN_CB(on_body, LHTTP_EV_BODY)
+LHTTP_FFI_CB(on_message_complete, LHTTP_EV_MESSAGE_COMPLETE)
+LHTTP_FFI_CB(on_chunk_complete, LHTTP_EV_CHUNK_COMPLETE)
+
+#undef LHTTP_FFI_CB
+#undef LHTTP_FFI_SPAN_CB
+
+static int lhttp_ffi_on_chunk_header(llhttp_t *parser) {
+  return lhttp_ffi_record(parser, LHTTP_EV_CHUNK_HEADER, NULL,
+                          (size_t)parser->content_length);
+}
+
+static const llhttp_settings_t lhttp_ffi_settings = {
+    .on_message_begin = lhttp_ffi_on_message_begin,
+    .on_url = lhttp_ffi_on_url,
+    .on_status = lhttp_ffi_on_status,
+    .on_header_field = lhttp_ffi_on_header_field,
+    .on_header_value = lhttp_ffi_on_header_value,
+    .on_headers_complete = lhttp_ffi_on_headers_complete,
+    .on_body = lhttp_ffi_on_body,
+    .on_message_complete = lhttp_ffi_on_message_complete,
+    .on_chunk_header = lhttp_ffi_on_chunk_header,
+    .on_chunk_complete = lhttp_ffi_on_chunk_complete,
+};
+
+/*****************************************************************************/
+lhttp_ffi_parser *lhttp_ffi_new(int type) {
+  lhttp_ffi_parser *p;
+
+  if (type != HTTP_BOTH && type != HTTP_REQUEST && type != HTTP_RESPONSE)
+    return NULL;
+
+  p = calloc(1, sizeof(*p));
+  if (p == NULL) return NULL;
+
+  llhttp_init(&p->parser, (llhttp_type_t)type, &lhttp_ffi_settings);
+  return p;
+}
+
+void lhttp_ffi_free(lhttp_ffi_parser *p) {
+  free(p);
+}
+
+void lhttp_ffi_reset(lhttp_ffi_parser *p) {
+  llhttp_reset(&p->parser);
+}
+
+int lhttp_ffi_execute(lhttp_ffi_parser *p, const char *data, size_t len,
+                      lhttp_event *events, int max_events, int *nevents,
+                      size_t *nparsed) {
+  llhttp_errno_t err;
+
+  if (len > UINT32_MAX) len = UINT32_MAX;
+
+  p->data = data;
+  p->events = events;
+  p->max_events = max_events;
+  p->nevents = 0;
+
+  /* no room for a single event, nothing can be parsed */
+  if (max_events <= 0) {
+    *nevents = 0;
+    *nparsed = 0;
+    return LHTTP_FFI_EVENTS_FULL;
+  }
+
+  err = llhttp_execute(&p->parser, data, len);
+  *nevents = p->nevents;
+
+  if (err == HPE_OK) {
+    *nparsed = len;
+    return HPE_OK;
+  }
+
+  *nparsed = (size_t)(llhttp_get_error_pos(&p->parser) - data);
+  if (err == HPE_PAUSED && p->nevents == p->max_events) {
+    llhttp_resume(&p->parser);
+    /* Even with all data consumed, llhttp may have more events to emit
+     * without input, e.g. message complete after the body. Only a span
+     * still open at the end of the data is known to be the last one */
+    if (*nparsed == len && p->parser._span_pos0 != NULL) return HPE_OK;
+    return LHTTP_FFI_EVENTS_FULL;
+  }
+  return err;
+}
+
+int lhttp_ffi_finish(lhttp_ffi_parser *p, lhttp_event *events, int max_events,
+                     int *nevents) {
+  llhttp_errno_t err;
+
+  p->data = NULL;
+  p->events = events;
+  p->max_events = max_events > 0 ? max_events : 0;
+  p->nevents = 0;
+
+  err = llhttp_finish(&p->parser);
+  if (err == HPE_PAUSED && p->nevents == p->max_events) {
+    llhttp_resume(&p->parser);
+    err = HPE_OK;
+  }
+  *nevents = p->nevents;
+  return err;
+}
+
+/*****************************************************************************/
+int lhttp_ffi_method(const lhttp_ffi_parser *p) {
+  return p->parser.method;
+}
+
+int lhttp_ffi_status_code(const lhttp_ffi_parser *p) {
+  return p->parser.status_code;
+}
+
+int lhttp_ffi_http_major(const lhttp_ffi_parser *p) {
+  return p->parser.http_major;
+}
+
+int lhttp_ffi_http_minor(const lhttp_ffi_parser *p) {
+  return p->parser.http_minor;
+}
+
+int lhttp_ffi_flags(const lhttp_ffi_parser *p) {
+  return p->parser.flags;
+}
+
+int lhttp_ffi_upgrade(const lhttp_ffi_parser *p) {
+  return p->parser.upgrade;
+}
+
+int lhttp_ffi_should_keep_alive(const lhttp_ffi_parser *p) {
+  return llhttp_should_keep_alive(&p->parser);
+}
+
+int lhttp_ffi_message_needs_eof(const lhttp_ffi_parser *p) {
+  return llhttp_message_needs_eof(&p->parser);
+}
+
+double lhttp_ffi_content_length(const lhttp_ffi_parser *p) {
+  return (double)p->parser.content_length;
+}
+
+int lhttp_ffi_errno(const lhttp_ffi_parser *p) {
+  return llhttp_get_errno(&p->parser);
+}
+
+const char *lhttp_ffi_error_reason(const lhttp_ffi_parser *p) {
+  return llhttp_get_error_reason(&p->parser);
+}
+
+const char *lhttp_ffi_errno_name(int err) {
+  return llhttp_errno_name((llhttp_errno_t)err);
+}
+
+const char *lhttp_ffi_method_name(int method) {
+  return llhttp_method_name((llhttp_method_t)method);
+}
@@ -0,0 +1,114 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/* Flat C API of the HTTP parser, for LuaJIT FFI and plain C callers.
+ *
+ * This header is written so that LuaJIT can load it unchanged:
+ *
+ *   ffi.cdef(io.open('lhttp_ffi.h'):read('*a'))
+ *
+ * so it holds declarations only: no #include, no #if, and the include guard
+ * is `#pragma once`, which ffi.cdef skips. C callers include <stddef.h> and
+ * <stdint.h> before it.
+ *
+ * The parser runs without any callback: `lhttp_ffi_execute` records what it
+ * sees into an event array given by the caller, spans are offsets into the
+ * data of that call.
+ */
+
+#pragma once
+
+/* Parser types, same values as llhttp_type_t */
+enum {
+  LHTTP_FFI_BOTH     = 0,
+  LHTTP_FFI_REQUEST  = 1,
+  LHTTP_FFI_RESPONSE = 2
+};
+
+/* Event kinds stored in lhttp_event.kind */
+enum {
+  LHTTP_EV_MESSAGE_BEGIN    = 1,
+  LHTTP_EV_URL              = 2,  /* span, may come in several fragments */
+  LHTTP_EV_STATUS           = 3,  /* span */
+  LHTTP_EV_HEADER_FIELD     = 4,  /* span */
+  LHTTP_EV_HEADER_VALUE     = 5,  /* span */
+  LHTTP_EV_HEADERS_COMPLETE = 6,
+  LHTTP_EV_BODY             = 7,  /* span */
+  LHTTP_EV_MESSAGE_COMPLETE = 8,
+  LHTTP_EV_CHUNK_HEADER     = 9,  /* length is the chunk size */
+  LHTTP_EV_CHUNK_COMPLETE   = 10
+};
+
+/* Return value of lhttp_ffi_execute when the event array filled up, call it
+ * again with the data after `nparsed`, which may be empty */
+enum { LHTTP_FFI_EVENTS_FULL = -1 };
+
+typedef struct lhttp_event {
+  uint32_t kind;    /* LHTTP_EV_* */
+  uint32_t offset;  /* span start, relative to the data of the execute call */
+  uint32_t length;  /* span length, 0 for events without a span */
+} lhttp_event;
+
+typedef struct lhttp_ffi_parser lhttp_ffi_parser;
+
+/* Create a parser of type LHTTP_FFI_*, NULL when out of memory.
+ * Release it with lhttp_ffi_free(), e.g. through ffi.gc().
+ */
+lhttp_ffi_parser *lhttp_ffi_new(int type);
+void lhttp_ffi_free(lhttp_ffi_parser *p);
+
+/* Clear any state or error, keeping the parser type */
+void lhttp_ffi_reset(lhttp_ffi_parser *p);
+
+/* Parse data, recording at most `max_events` events into `events`.
+ *
+ * Arguments:
+ *   data, len  - input bytes, at most 4GB are parsed per call
+ *   events     - caller-provided array of `max_events` entries
+ *   nevents    - set to the number of events recorded
+ *   nparsed    - set to the number of bytes consumed
+ *
+ * Returns:
+ *   0 (HPE_OK) when all data was consumed, LHTTP_FFI_EVENTS_FULL when the
+ *   event array filled up first (the parser is ready to continue at
+ *   `nparsed`, even when that is the end of the data), otherwise an llhttp error number such as HPE_PAUSED_UPGRADE.
+ */
+int lhttp_ffi_execute(lhttp_ffi_parser *p, const char *data, size_t len,
+                      lhttp_event *events, int max_events, int *nevents,
+                      size_t *nparsed);
+
+/* Signal end of input, see llhttp_finish(). A message completed by EOF is
+ * recorded as one LHTTP_EV_MESSAGE_COMPLETE event when `max_events` > 0. */
+int lhttp_ffi_finish(lhttp_ffi_parser *p, lhttp_event *events, int max_events,
+                     int *nevents);
+
+/* State of the current message, valid from LHTTP_EV_HEADERS_COMPLETE on */
+int lhttp_ffi_method(const lhttp_ffi_parser *p);
+int lhttp_ffi_status_code(const lhttp_ffi_parser *p);
+int lhttp_ffi_http_major(const lhttp_ffi_parser *p);
+int lhttp_ffi_http_minor(const lhttp_ffi_parser *p);
+int lhttp_ffi_flags(const lhttp_ffi_parser *p);  /* llhttp F_* bits */
+int lhttp_ffi_upgrade(const lhttp_ffi_parser *p);
+int lhttp_ffi_should_keep_alive(const lhttp_ffi_parser *p);
+int lhttp_ffi_message_needs_eof(const lhttp_ffi_parser *p);
+double lhttp_ffi_content_length(const lhttp_ffi_parser *p);
+
+/* Last error number and its reason, names of llhttp constants */
+int lhttp_ffi_errno(const lhttp_ffi_parser *p);
+const char *lhttp_ffi_error_reason(const lhttp_ffi_parser *p);
+const char *lhttp_ffi_errno_name(int err);
+const char *lhttp_ffi_method_name(int method);
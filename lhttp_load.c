@@ -0,0 +1,257 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/* lhttp_load: a small HTTP/1.1 load generator to benchmark lhttp_server on
+ * localhost. Every connection keeps `pipeline` GET requests in flight and
+ * the responses are counted with llhttp.
+ *
+ *   ./lhttp_load -P 8080 -c 64 -n 200000 -p 16 -u /hello
+ *
+ * Exits with 1 when a request failed: a status from 400, a parse error or a
+ * connection closed with requests in flight.
+ */
+
+#include "llhttp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  int fd;
+  llhttp_t parser;
+  int inflight;             /* requests sent or queued, not answered */
+  size_t out_off;           /* bytes of `out` already written */
+  size_t out_len;
+  char *out;
+} load_conn;
+
+typedef struct {
+  const char *host;
+  const char *port;
+  const char *path;
+  int connections;
+  long requests;
+  int pipeline;
+
+  char request[1024];
+  size_t request_len;
+  long issued;
+  long done;
+  long failed;
+} load_state;
+
+static load_state S;
+
+static int load_on_message_complete(llhttp_t *p) {
+  load_conn *c = p->data;
+
+  c->inflight--;
+  S.done++;
+  if (p->status_code >= 400) S.failed++;
+  return 0;
+}
+
+static int load_connect(void) {
+  struct addrinfo hints, *res, *ai;
+  int fd = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(S.host, S.port, &hints, &res)) return -1;
+  for (ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) continue;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+/* Queue requests up to the pipeline depth, then write what the socket takes */
+static int load_send(load_conn *c) {
+  /* `out` holds `pipeline` requests, the unsent tail moves to the front */
+  if (c->out_off) {
+    memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+    c->out_len -= c->out_off;
+    c->out_off = 0;
+  }
+  while (c->inflight < S.pipeline && S.issued < S.requests) {
+    memcpy(c->out + c->out_len, S.request, S.request_len);
+    c->out_len += S.request_len;
+    c->inflight++;
+    S.issued++;
+  }
+  while (c->out_off < c->out_len) {
+    ssize_t n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    c->out_off += (size_t)n;
+  }
+  c->out_off = c->out_len = 0;
+  return 0;
+}
+
+static int load_recv(load_conn *c) {
+  char buf[65536];
+
+  for (;;) {
+    ssize_t n = read(c->fd, buf, sizeof(buf));
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    if (n == 0) return -1;
+    if (llhttp_execute(&c->parser, buf, (size_t)n) != HPE_OK) {
+      fprintf(stderr, "lhttp_load: %s\n", llhttp_errno_name(
+                                              llhttp_get_errno(&c->parser)));
+      return -1;
+    }
+    if ((size_t)n < sizeof(buf)) return 0;
+  }
+}
+
+static void load_close(load_conn *c) {
+  int unsent;
+
+  close(c->fd);
+  c->fd = -1;
+  /* requests never sent are given back, the ones in flight fail */
+  unsent = (int)((c->out_len - c->out_off) / S.request_len);
+  S.issued -= unsent;
+  c->inflight -= unsent;
+  S.failed += c->inflight;
+  S.done += c->inflight;
+  c->inflight = 0;
+  c->out_off = c->out_len = 0;
+}
+
+static void load_usage(void) {
+  fprintf(stderr,
+          "usage: lhttp_load [-H host] [-P port] [-u path] [-c connections]\n"
+          "                  [-n requests] [-p pipeline]\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  llhttp_settings_t settings;
+  struct timespec t0, t1;
+  load_conn *conns;
+  struct pollfd *pfds;
+  double elapsed;
+  int i, opt, open;
+
+  S.host = "127.0.0.1";
+  S.port = "8080";
+  S.path = "/";
+  S.connections = 16;
+  S.requests = 10000;
+  S.pipeline = 1;
+  while ((opt = getopt(argc, argv, "H:P:u:c:n:p:")) != -1) {
+    switch (opt) {
+    case 'H': S.host = optarg; break;
+    case 'P': S.port = optarg; break;
+    case 'u': S.path = optarg; break;
+    case 'c': S.connections = atoi(optarg); break;
+    case 'n': S.requests = atol(optarg); break;
+    case 'p': S.pipeline = atoi(optarg); break;
+    default: load_usage();
+    }
+  }
+  if (S.connections < 1 || S.requests < 1 || S.pipeline < 1) load_usage();
+  S.request_len = (size_t)snprintf(S.request, sizeof(S.request),
+                                   "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                                   S.path, S.host);
+  if (S.request_len >= sizeof(S.request)) load_usage();
+
+  llhttp_settings_init(&settings);
+  settings.on_message_complete = load_on_message_complete;
+  conns = calloc((size_t)S.connections, sizeof(*conns));
+  pfds = calloc((size_t)S.connections, sizeof(*pfds));
+  if (conns == NULL || pfds == NULL) return 1;
+
+  for (i = 0; i < S.connections; i++) {
+    load_conn *c = &conns[i];
+
+    c->fd = load_connect();
+    if (c->fd < 0) {
+      fprintf(stderr, "lhttp_load: cannot connect to %s:%s\n", S.host, S.port);
+      return 1;
+    }
+    c->out = malloc(S.request_len * (size_t)S.pipeline);
+    if (c->out == NULL) return 1;
+    llhttp_init(&c->parser, HTTP_RESPONSE, &settings);
+    c->parser.data = c;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  open = S.connections;
+  while (S.done < S.requests && open > 0) {
+    for (i = 0; i < S.connections; i++) {
+      load_conn *c = &conns[i];
+
+      if (c->fd >= 0 && load_send(c)) {
+        load_close(c);
+        open--;
+      }
+      pfds[i].fd = c->fd;
+      pfds[i].events = POLLIN | (c->out_off < c->out_len ? POLLOUT : 0);
+      pfds[i].revents = 0;
+    }
+    if (open == 0) break;
+    if (poll(pfds, (nfds_t)S.connections, 5000) <= 0) {
+      fprintf(stderr, "lhttp_load: no response\n");
+      break;
+    }
+    for (i = 0; i < S.connections; i++) {
+      load_conn *c = &conns[i];
+
+      if (c->fd < 0 || pfds[i].revents == 0) continue;
+      if (load_recv(c) || (c->inflight && (pfds[i].revents & POLLHUP))) {
+        load_close(c);
+        open--;
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  elapsed = (double)(t1.tv_sec - t0.tv_sec) +
+            (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+  printf("requests: %ld, failed: %ld, time: %.3f s, %.0f req/s\n", S.done,
+         S.failed, elapsed, elapsed > 0 ? (double)S.done / elapsed : 0.0);
+  for (i = 0; i < S.connections; i++) {
+    if (conns[i].fd >= 0) close(conns[i].fd);
+    free(conns[i].out);
+  }
+  free(conns);
+  free(pfds);
+  return S.failed || S.done < S.requests ? 1 : 0;
+}
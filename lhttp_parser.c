@@ -28,9 +28,17 @@
  */
 
 #include "lhttp_parser.h"
+#include "lhttp_probes.h"
 #include "llhttp.h"
+#include "llquery.h"
+#include "llurl.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 typedef llhttp_t http_parser;
 #if LUA_VERSION_NUM < 502
 /* lua_rawlen: Not entirely correct, but should work anyway */
@@ -44,73 +52,1249 @@ typedef llhttp_t http_parser;
 #ifndef luaL_setfuncs
 #define luaL_setfuncs(L, l, n) (assert(n == 0), luaL_register(L, NULL, l))
 #endif
+#ifndef lua_setuservalue
+#define lua_setuservalue lua_setfenv
 #endif
+#endif
+
+/* Event kinds, each one owns a callback slot in parser_ctx */
+enum {
+  LHP_CB_MESSAGE_BEGIN = 0,
+  LHP_CB_URL,
+  LHP_CB_STATUS,
+  LHP_CB_HEADER_FIELD,
+  LHP_CB_HEADER_VALUE,
+  LHP_CB_HEADERS_COMPLETE,
+  LHP_CB_BODY,
+  LHP_CB_MESSAGE_COMPLETE,
+  LHP_CB_CHUNK_HEADER,
+  LHP_CB_CHUNK_COMPLETE,
+  LHP_CB_RESET,
+  LHP_CB_MAX
+};
+
+/* Lua names of the callbacks, indexed by LHP_CB_* */
+static const char *const lhttp_parser_cb_names[LHP_CB_MAX] = {
+    "onMessageBegin", "onUrl",           "onStatus",
+    "onHeaderField",  "onHeaderValue",   "onHeadersComplete",
+    "onBody",         "onMessageComplete", "onChunkHeader",
+    "onChunkComplete", "onReset"};
+
+#define LHP_HAS_CB(ctx, cb) ((ctx)->cb_mask & (1u << (cb)))
+
+/* Parser options, see lhttp_parser_options() */
+#define LHP_F_COLLECT_HEADERS 0x01
+#define LHP_F_COLLECT         0x02
+#define LHP_F_BODY_VIEW       0x04
+#define LHP_F_HEADER_IDS      0x08
+#define LHP_F_YIELDABLE       0x10
+#define LHP_F_CONTEXT         0x20  /* created from lhp.handlers, see ctx_ref */
+#define LHP_F_PARSE_URL       0x40
+#define LHP_F_REQUEST         0x80  /* collect request objects, implies COLLECT */
+
+/* Size of the error counters of parser:stats(), above any llhttp_errno_t */
+#define LHP_ERRNO_MAX 64
+/* Size of the request counters of lhp.metrics(), above any llhttp_method_t */
+#define LHP_METHOD_MAX 64
+/* Buckets of the log2 histograms of lhp.metrics(), the last one is +Inf */
+#define LHP_HIST_BUCKETS 32
+
+/* Metatable of parsers created with `yieldable` */
+#define LHP_YIELDABLE "lhttp_parser.yieldable"
+
+/* Error reported when a callback fails, by LHP_CB_*, as llhttp does for a
+ * callback returning HPE_USER */
+static const llhttp_errno_t lhttp_parser_cb_errno[LHP_CB_MAX] = {
+    HPE_CB_MESSAGE_BEGIN, HPE_USER, HPE_USER, HPE_USER,
+    HPE_USER, HPE_CB_HEADERS_COMPLETE, HPE_USER, HPE_CB_MESSAGE_COMPLETE,
+    HPE_CB_CHUNK_HEADER, HPE_CB_CHUNK_COMPLETE, HPE_CB_RESET};
+
+/* Well-known header names, in lowercase. Their IDs are the position in this
+ * list starting at 1, append new names at the end to keep IDs stable */
+#define LHP_HEADER_MAP(XX)                                                    \
+  XX(ACCEPT, "accept")                                                        \
+  XX(ACCEPT_CHARSET, "accept-charset")                                        \
+  XX(ACCEPT_ENCODING, "accept-encoding")                                      \
+  XX(ACCEPT_LANGUAGE, "accept-language")                                      \
+  XX(ACCEPT_RANGES, "accept-ranges")                                          \
+  XX(ACCESS_CONTROL_ALLOW_ORIGIN, "access-control-allow-origin")              \
+  XX(AGE, "age")                                                              \
+  XX(ALLOW, "allow")                                                          \
+  XX(AUTHORIZATION, "authorization")                                          \
+  XX(CACHE_CONTROL, "cache-control")                                          \
+  XX(CONNECTION, "connection")                                                \
+  XX(CONTENT_DISPOSITION, "content-disposition")                              \
+  XX(CONTENT_ENCODING, "content-encoding")                                    \
+  XX(CONTENT_LANGUAGE, "content-language")                                    \
+  XX(CONTENT_LENGTH, "content-length")                                        \
+  XX(CONTENT_LOCATION, "content-location")                                    \
+  XX(CONTENT_RANGE, "content-range")                                          \
+  XX(CONTENT_TYPE, "content-type")                                            \
+  XX(COOKIE, "cookie")                                                        \
+  XX(DATE, "date")                                                            \
+  XX(ETAG, "etag")                                                            \
+  XX(EXPECT, "expect")                                                        \
+  XX(EXPIRES, "expires")                                                      \
+  XX(FORWARDED, "forwarded")                                                  \
+  XX(HOST, "host")                                                            \
+  XX(IF_MATCH, "if-match")                                                    \
+  XX(IF_MODIFIED_SINCE, "if-modified-since")                                  \
+  XX(IF_NONE_MATCH, "if-none-match")                                          \
+  XX(IF_RANGE, "if-range")                                                    \
+  XX(IF_UNMODIFIED_SINCE, "if-unmodified-since")                              \
+  XX(KEEP_ALIVE, "keep-alive")                                                \
+  XX(LAST_MODIFIED, "last-modified")                                          \
+  XX(LINK, "link")                                                            \
+  XX(LOCATION, "location")                                                    \
+  XX(ORIGIN, "origin")                                                        \
+  XX(PRAGMA, "pragma")                                                        \
+  XX(PROXY_AUTHORIZATION, "proxy-authorization")                              \
+  XX(RANGE, "range")                                                          \
+  XX(REFERER, "referer")                                                      \
+  XX(RETRY_AFTER, "retry-after")                                              \
+  XX(SEC_WEBSOCKET_ACCEPT, "sec-websocket-accept")                            \
+  XX(SEC_WEBSOCKET_KEY, "sec-websocket-key")                                  \
+  XX(SEC_WEBSOCKET_PROTOCOL, "sec-websocket-protocol")                        \
+  XX(SEC_WEBSOCKET_VERSION, "sec-websocket-version")                          \
+  XX(SERVER, "server")                                                        \
+  XX(SET_COOKIE, "set-cookie")                                                \
+  XX(TE, "te")                                                                \
+  XX(TRAILER, "trailer")                                                      \
+  XX(TRANSFER_ENCODING, "transfer-encoding")                                  \
+  XX(UPGRADE, "upgrade")                                                      \
+  XX(USER_AGENT, "user-agent")                                                \
+  XX(VARY, "vary")                                                            \
+  XX(VIA, "via")                                                              \
+  XX(WWW_AUTHENTICATE, "www-authenticate")                                    \
+  XX(X_FORWARDED_FOR, "x-forwarded-for")                                      \
+  XX(X_FORWARDED_PROTO, "x-forwarded-proto")                                  \
+  XX(X_REAL_IP, "x-real-ip")                                                  \
+  XX(X_REQUEST_ID, "x-request-id")
+
+enum {
+  LHP_H_UNKNOWN = 0,
+#define XX(id, name) LHP_H_##id,
+  LHP_HEADER_MAP(XX)
+#undef XX
+  LHP_H_MAX
+};
+
+static const char *const lhttp_parser_header_names[LHP_H_MAX] = {
+    NULL,
+#define XX(id, name) name,
+    LHP_HEADER_MAP(XX)
+#undef XX
+};
+
+static const unsigned char lhttp_parser_header_lens[LHP_H_MAX] = {
+    0,
+#define XX(id, name) sizeof(name) - 1,
+    LHP_HEADER_MAP(XX)
+#undef XX
+};
+
+/* How onHeadersComplete receives the message info, option `info` */
+enum { LHP_INFO_TABLE = 0, LHP_INFO_ARGS, LHP_INFO_REUSE };
+
+static const char *const lhttp_parser_info_modes[] = {"table", "args",
+                                                      "reuse", NULL};
+
+/* llhttp lenient flags, by option name */
+static const struct {
+  const char *name;
+  unsigned flag;
+  void (*set)(llhttp_t *parser, int enabled);
+} lhttp_parser_lenient[] = {
+    {"lenient_headers", LENIENT_HEADERS, llhttp_set_lenient_headers},
+    {"lenient_chunked_length", LENIENT_CHUNKED_LENGTH,
+     llhttp_set_lenient_chunked_length},
+    {"lenient_keep_alive", LENIENT_KEEP_ALIVE, llhttp_set_lenient_keep_alive},
+    {"lenient_transfer_encoding", LENIENT_TRANSFER_ENCODING,
+     llhttp_set_lenient_transfer_encoding},
+    {"lenient_version", LENIENT_VERSION, llhttp_set_lenient_version},
+    {"lenient_data_after_close", LENIENT_DATA_AFTER_CLOSE,
+     llhttp_set_lenient_data_after_close},
+    {"lenient_optional_lf_after_cr", LENIENT_OPTIONAL_LF_AFTER_CR,
+     llhttp_set_lenient_optional_lf_after_cr},
+    {"lenient_optional_cr_before_lf", LENIENT_OPTIONAL_CR_BEFORE_LF,
+     llhttp_set_lenient_optional_cr_before_lf},
+    {"lenient_optional_crlf_after_chunk", LENIENT_OPTIONAL_CRLF_AFTER_CHUNK,
+     llhttp_set_lenient_optional_crlf_after_chunk},
+    {"lenient_spaces_after_chunk_size", LENIENT_SPACES_AFTER_CHUNK_SIZE,
+     llhttp_set_lenient_spaces_after_chunk_size},
+    {"lenient_header_value_relaxed", LENIENT_HEADER_VALUE_RELAXED,
+     llhttp_set_lenient_header_value_relaxed},
+    {NULL, 0, NULL}};
+
+/* Registry key of the array of pre-created header name strings */
+#define LHP_HEADER_NAMES "lhttp_parser.header_names"
+
+/* Growable byte buffer owned by a parser */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t size;
+} lhp_buf;
+
+/* One collected header, name and value are stored back to back in a buffer */
+typedef struct {
+  size_t off;
+  size_t name_len;
+  size_t value_len;
+} lhp_header;
+
+/* Where the header parsing is, a new field starts a new header unless the
+ * previous field span is still open */
+enum { LHP_HS_NONE = 0, LHP_HS_FIELD, LHP_HS_VALUE };
 
 typedef struct {
   void *L;
-  int ref;
+  unsigned cb_mask;       /* bit (1 << LHP_CB_*) set when a callback exists */
+  int cb_ref;             /* registry ref of the callbacks, by LHP_CB_* + 1 */
+  int cb_index;           /* stack index of that array while parsing */
+  llhttp_settings_t settings; /* only the callbacks this parser needs */
+  unsigned flags;         /* LHP_F_* */
+
+  /* header collector, used with LHP_F_COLLECT_HEADERS */
+  lhp_buf head;
+  lhp_header *headers;
+  size_t nheaders;
+  size_t headers_size;
+  int hstate;
+
+  /* message collector, used with LHP_F_COLLECT */
+  lhp_buf line;           /* request URL or response status text */
+  lhp_buf body;
+  size_t ntrailers;       /* headers after this count are trailers */
+  int results;            /* stack index of the completed messages array */
+  int nresults;
+
+  /* input of the running execute, for body views */
+  int input;              /* stack index of the input string, 0 if none */
+  const char *input_base; /* first byte of the input string */
+  const char *input_end;  /* end of the bytes being parsed */
+
+  /* URL of the message, used with LHP_F_PARSE_URL. A URL seen whole is
+   * only pointed to, one split over execute calls is copied */
+  lhp_buf url;
+  const char *url_at;
+  size_t url_at_len;
+
+  /* parser:read_fd() buffer, holds the bytes left unparsed between calls */
+  lhp_buf rbuf;
+  int reading;            /* read_fd is parsing rbuf */
+
+  /* header IDs, used with LHP_F_HEADER_IDS */
+  int names_ref;          /* registry ref of the header name strings */
+
+  unsigned lenient;       /* llhttp LENIENT_* flags */
+  int info_mode;          /* LHP_INFO_* */
+  int info_ref;           /* registry ref of the recycled info table */
+
+  /* per message limits, 0 when unlimited, and what the message used so far */
+  size_t max_url;
+  size_t max_header_bytes;
+  size_t max_headers;
+  size_t max_body;
+  size_t url_len;
+  size_t header_bytes;
+  size_t nfields;
+  size_t body_len;
+
+  /* parser:stats() counters, timing and header blocks only with profile */
+  int profile;
+  struct {
+    uint64_t bytes;
+    uint64_t messages;
+    uint64_t callbacks[LHP_CB_MAX];
+    uint64_t errors[LHP_ERRNO_MAX];
+    uint64_t callback_ns;
+    uint64_t execute_ns;
+    size_t max_header_block;
+  } stats;
+
+  /* time spent parsing the current message, with profile */
+  int in_message;
+  uint64_t message_mark;
+  uint64_t message_ns;
+
+  /* pipelining backpressure, messages completed by the running execute */
+  size_t max_messages;
+  size_t nmessages;
+  int messages_full;      /* execute stopped after max_messages */
+
+  /* context passed first to every callback, with LHP_F_CONTEXT */
+  int ctx_ref;
+
+  /* parser pools, see lhttp_parser_pool() */
+  const void *pool;       /* pool the parser belongs to, NULL if none */
+  int pooled;             /* the parser waits on the free list */
+
+  /* yieldable execute, see lhttp_parser_step() */
+  int pending;            /* LHP_CB_* due to run in the driver, -1 if none */
+  int finishing;          /* the step is a finish, not an execute */
+  size_t y_start;         /* offsets of the parsed range in the input */
+  size_t y_pos;
+  size_t y_end;
 } parser_ctx;
 
+#define LHP_HAS_LIMITS(ctx)                                                   \
+  ((ctx)->max_url || (ctx)->max_header_bytes || (ctx)->max_headers ||         \
+   (ctx)->max_body)
+
 /*****************************************************************************/
-static llhttp_settings_t lhttp_parser_settings;
+static int lhp_buf_reserve(lhp_buf *b, size_t extra) {
+  size_t size;
+  char *data;
+
+  if (b->size - b->len >= extra) return 0;
+
+  size = b->size ? b->size : 256;
+  while (size - b->len < extra) size *= 2;
+  data = realloc(b->data, size);
+  if (data == NULL) return -1;
+
+  b->data = data;
+  b->size = size;
+  return 0;
+}
+
+static int lhp_buf_append(lhp_buf *b, const char *at, size_t length) {
+  if (lhp_buf_reserve(b, length)) return -1;
+  memcpy(b->data + b->len, at, length);
+  b->len += length;
+  return 0;
+}
+
+static void lhp_buf_free(lhp_buf *b) {
+  free(b->data);
+  b->data = NULL;
+  b->len = b->size = 0;
+}
+
+static int lhttp_parser_nomem(http_parser *p) {
+  llhttp_set_error_reason(p, "Out of memory");
+  return HPE_USER;
+}
+
+/* Add to a per message counter, true once it goes past a non-zero max */
+static int lhttp_parser_over(size_t *count, size_t add, size_t max) {
+  *count += add;
+  return max && *count > max;
+}
+
+/* Abort parsing, the reason is the name of the exceeded option */
+static int lhttp_parser_limit_error(http_parser *p, const char *option) {
+  llhttp_set_error_reason(p, option);
+  return HPE_USER;
+}
+
+static void lhttp_parser_clear_headers(parser_ctx *ctx) {
+  ctx->head.len = 0;
+  ctx->nheaders = 0;
+  ctx->hstate = LHP_HS_NONE;
+}
+
+static void lhttp_parser_clear_message(parser_ctx *ctx) {
+  lhttp_parser_clear_headers(ctx);
+  ctx->line.len = 0;
+  ctx->body.len = 0;
+  ctx->ntrailers = 0;
+}
+
+static int lhttp_parser_collect_field(parser_ctx *ctx, const char *at,
+                                      size_t length) {
+  lhp_header *h;
+
+  if (ctx->hstate != LHP_HS_FIELD) {
+    if (ctx->nheaders == ctx->headers_size) {
+      size_t size = ctx->headers_size ? ctx->headers_size * 2 : 16;
+      h = realloc(ctx->headers, size * sizeof(lhp_header));
+      if (h == NULL) return -1;
+      ctx->headers = h;
+      ctx->headers_size = size;
+    }
+    h = &ctx->headers[ctx->nheaders++];
+    h->off = ctx->head.len;
+    h->name_len = h->value_len = 0;
+    ctx->hstate = LHP_HS_FIELD;
+  }
+
+  h = &ctx->headers[ctx->nheaders - 1];
+  h->name_len += length;
+  return lhp_buf_append(&ctx->head, at, length);
+}
+
+static int lhttp_parser_collect_value(parser_ctx *ctx, const char *at,
+                                      size_t length) {
+  lhp_header *h = &ctx->headers[ctx->nheaders - 1];
+
+  h->value_len += length;
+  return lhp_buf_append(&ctx->head, at, length);
+}
+
+/* ID of a well-known header name, compared case-insensitively,
+ * LHP_H_UNKNOWN for any other name. The length, the first and the last
+ * characters tell the names of LHP_HEADER_MAP apart, so a single candidate
+ * is compared; keep the switch in step with the map */
+static int lhttp_parser_header_id(const char *name, size_t len) {
+  const char *known;
+  int id = LHP_H_UNKNOWN;
+  size_t i;
+
+  switch (len) {
+  case 2: id = LHP_H_TE; break;
+  case 3:
+    switch (name[0] | 0x20) {
+    case 'a': id = LHP_H_AGE; break;
+    case 'v': id = LHP_H_VIA; break;
+    }
+    break;
+  case 4:
+    switch (name[0] | 0x20) {
+    case 'd': id = LHP_H_DATE; break;
+    case 'e': id = LHP_H_ETAG; break;
+    case 'h': id = LHP_H_HOST; break;
+    case 'l': id = LHP_H_LINK; break;
+    case 'v': id = LHP_H_VARY; break;
+    }
+    break;
+  case 5:
+    switch (name[0] | 0x20) {
+    case 'a': id = LHP_H_ALLOW; break;
+    case 'r': id = LHP_H_RANGE; break;
+    }
+    break;
+  case 6:
+    switch (name[0] | 0x20) {
+    case 'a': id = LHP_H_ACCEPT; break;
+    case 'c': id = LHP_H_COOKIE; break;
+    case 'e': id = LHP_H_EXPECT; break;
+    case 'o': id = LHP_H_ORIGIN; break;
+    case 'p': id = LHP_H_PRAGMA; break;
+    case 's': id = LHP_H_SERVER; break;
+    }
+    break;
+  case 7:
+    switch (name[0] | 0x20) {
+    case 'e': id = LHP_H_EXPIRES; break;
+    case 'r': id = LHP_H_REFERER; break;
+    case 't': id = LHP_H_TRAILER; break;
+    case 'u': id = LHP_H_UPGRADE; break;
+    }
+    break;
+  case 8:
+    switch (name[0] | 0x20) {
+    case 'i':
+      switch (name[len - 1] | 0x20) {
+      case 'e': id = LHP_H_IF_RANGE; break;
+      case 'h': id = LHP_H_IF_MATCH; break;
+      }
+      break;
+    case 'l': id = LHP_H_LOCATION; break;
+    }
+    break;
+  case 9:
+    switch (name[0] | 0x20) {
+    case 'f': id = LHP_H_FORWARDED; break;
+    case 'x': id = LHP_H_X_REAL_IP; break;
+    }
+    break;
+  case 10:
+    switch (name[0] | 0x20) {
+    case 'c': id = LHP_H_CONNECTION; break;
+    case 'k': id = LHP_H_KEEP_ALIVE; break;
+    case 's': id = LHP_H_SET_COOKIE; break;
+    case 'u': id = LHP_H_USER_AGENT; break;
+    }
+    break;
+  case 11: id = LHP_H_RETRY_AFTER; break;
+  case 12:
+    switch (name[0] | 0x20) {
+    case 'c': id = LHP_H_CONTENT_TYPE; break;
+    case 'x': id = LHP_H_X_REQUEST_ID; break;
+    }
+    break;
+  case 13:
+    switch (name[0] | 0x20) {
+    case 'a':
+      switch (name[len - 1] | 0x20) {
+      case 'n': id = LHP_H_AUTHORIZATION; break;
+      case 's': id = LHP_H_ACCEPT_RANGES; break;
+      }
+      break;
+    case 'c':
+      switch (name[len - 1] | 0x20) {
+      case 'e': id = LHP_H_CONTENT_RANGE; break;
+      case 'l': id = LHP_H_CACHE_CONTROL; break;
+      }
+      break;
+    case 'i': id = LHP_H_IF_NONE_MATCH; break;
+    case 'l': id = LHP_H_LAST_MODIFIED; break;
+    }
+    break;
+  case 14:
+    switch (name[0] | 0x20) {
+    case 'a': id = LHP_H_ACCEPT_CHARSET; break;
+    case 'c': id = LHP_H_CONTENT_LENGTH; break;
+    }
+    break;
+  case 15:
+    switch (name[0] | 0x20) {
+    case 'a':
+      switch (name[len - 1] | 0x20) {
+      case 'e': id = LHP_H_ACCEPT_LANGUAGE; break;
+      case 'g': id = LHP_H_ACCEPT_ENCODING; break;
+      }
+      break;
+    case 'x': id = LHP_H_X_FORWARDED_FOR; break;
+    }
+    break;
+  case 16:
+    switch (name[0] | 0x20) {
+    case 'c':
+      switch (name[len - 1] | 0x20) {
+      case 'e': id = LHP_H_CONTENT_LANGUAGE; break;
+      case 'g': id = LHP_H_CONTENT_ENCODING; break;
+      case 'n': id = LHP_H_CONTENT_LOCATION; break;
+      }
+      break;
+    case 'w': id = LHP_H_WWW_AUTHENTICATE; break;
+    }
+    break;
+  case 17:
+    switch (name[0] | 0x20) {
+    case 'i': id = LHP_H_IF_MODIFIED_SINCE; break;
+    case 's': id = LHP_H_SEC_WEBSOCKET_KEY; break;
+    case 't': id = LHP_H_TRANSFER_ENCODING; break;
+    case 'x': id = LHP_H_X_FORWARDED_PROTO; break;
+    }
+    break;
+  case 19:
+    switch (name[0] | 0x20) {
+    case 'c': id = LHP_H_CONTENT_DISPOSITION; break;
+    case 'i': id = LHP_H_IF_UNMODIFIED_SINCE; break;
+    case 'p': id = LHP_H_PROXY_AUTHORIZATION; break;
+    }
+    break;
+  case 20: id = LHP_H_SEC_WEBSOCKET_ACCEPT; break;
+  case 21: id = LHP_H_SEC_WEBSOCKET_VERSION; break;
+  case 22: id = LHP_H_SEC_WEBSOCKET_PROTOCOL; break;
+  case 27: id = LHP_H_ACCESS_CONTROL_ALLOW_ORIGIN; break;
+  }
+  if (id == LHP_H_UNKNOWN) return id;
+
+  known = lhttp_parser_header_names[id];
+  for (i = 0; i < len; i++) {
+    char c = name[i];
+    if (c >= 'A' && c <= 'Z') c |= 0x20;
+    if (c != known[i]) return LHP_H_UNKNOWN;
+  }
+  return id;
+}
+
+/* Push a header name in lowercase. A well-known name, when it is whole,
+ * is the pre-created string and its ID is returned; other names are
+ * lowercased into a new string and 0 is returned */
+static int lhttp_parser_push_header_name(lua_State *L, parser_ctx *ctx,
+                                         const char *name, size_t len,
+                                         int whole) {
+  int id = whole ? lhttp_parser_header_id(name, len) : LHP_H_UNKNOWN;
+  luaL_Buffer b;
+  size_t i;
+
+  if (id != LHP_H_UNKNOWN) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->names_ref);
+    lua_rawgeti(L, -1, id);
+    lua_remove(L, -2);
+    return id;
+  }
 
-static int lhttp_parser_pcall_callback(http_parser *p,
-                                       const char *func,
+  luaL_buffinit(L, &b);
+  for (i = 0; i < len; i++) {
+    char c = name[i];
+    luaL_addchar(&b, (c >= 'A' && c <= 'Z') ? c | 0x20 : c);
+  }
+  luaL_pushresult(&b);
+  return LHP_H_UNKNOWN;
+}
+
+/* Push the collected headers as a table that lists the names in arrival
+ * order and maps each name to its value, a repeated name maps to an array
+ * of values, like lhttp_url.parse_query() does for repeated keys */
+static void lhttp_parser_push_headers(lua_State *L, parser_ctx *ctx,
+                                      size_t first, size_t last) {
+  size_t i;
+  int n = 0;
+
+  lua_createtable(L, (int)(last - first), (int)(last - first));
+  for (i = first; i < last; i++) {
+    const lhp_header *h = &ctx->headers[i];
+    const char *name = ctx->head.data + h->off;
+    const char *value = name + h->name_len;
+
+    if (ctx->flags & LHP_F_HEADER_IDS)
+      lhttp_parser_push_header_name(L, ctx, name, h->name_len, 1);
+    else
+      lua_pushlstring(L, name, h->name_len);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (lua_isnil(L, -1)) {
+      /* first occurrence */
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, -3, ++n);
+      lua_pushlstring(L, value, h->value_len);
+      lua_rawset(L, -3);
+    } else if (lua_istable(L, -1)) {
+      /* already an array, append */
+      lua_pushlstring(L, value, h->value_len);
+      lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+      lua_pop(L, 2);
+    } else {
+      /* exists as string, convert to array */
+      lua_createtable(L, 2, 0);
+      lua_insert(L, -2);
+      lua_rawseti(L, -2, 1);
+      lua_pushlstring(L, value, h->value_len);
+      lua_rawseti(L, -2, 2);
+      lua_rawset(L, -3);
+    }
+  }
+}
+
+/* Push a field of a parsed URL, nil when the URL has none */
+static void lhttp_parser_push_url_field(lua_State *L, const char *url,
+                                        const struct http_parser_url *u,
+                                        int field) {
+  if (u->field_set & (1 << field))
+    lua_pushlstring(L, url + u->field_data[field].off,
+                    u->field_data[field].len);
+  else
+    lua_pushnil(L);
+}
+
+/* Request object, a message collected with LHP_F_REQUEST packed into one
+ * userdata: the struct, the header index, then the start line, header and
+ * body bytes. Lua strings are made only for the parts a handler reads */
+#define LHP_REQUEST "lhttp_parser.request"
+#define LHP_REQUEST_HEADERS "lhttp_parser.request_headers"
+
+typedef struct {
+  int type;               /* HTTP_REQUEST or HTTP_RESPONSE */
+  int method;
+  int status_code;
+  int http_major;
+  int http_minor;
+  int keep_alive;
+  int upgrade;
+  int url_state;          /* 0 not parsed yet, 1 parsed, -1 invalid */
+  struct http_parser_url u;
+  lhp_header *headers;
+  size_t nheaders;        /* headers after this count are trailers */
+  size_t nfields;         /* headers and trailers */
+  const char *line;       /* URL or status text */
+  size_t line_len;
+  const char *head;       /* header names and values, see lhp_header */
+  const char *body;
+  size_t body_len;
+} lhttp_request_t;
+
+/* Headers or trailers of a request, the request is kept alive by the
+ * table in the uservalue */
+typedef struct {
+  const lhttp_request_t *req;
+  size_t first;
+  size_t last;
+} lhttp_request_headers_t;
+
+static void lhttp_parser_push_request(lua_State *L, http_parser *p,
+                                      parser_ctx *ctx) {
+  size_t nheaders = ctx->ntrailers ? ctx->ntrailers : ctx->nheaders;
+  size_t index = ctx->nheaders * sizeof(lhp_header);
+  lhttp_request_t *req = lua_newuserdata(
+      L, sizeof(*req) + index + ctx->line.len + ctx->head.len + ctx->body.len);
+  char *data = (char *)(req + 1);
+
+  memset(req, 0, sizeof(*req));
+  req->type = p->type;
+  req->method = p->method;
+  req->status_code = p->status_code;
+  req->http_major = p->http_major;
+  req->http_minor = p->http_minor;
+  req->keep_alive = llhttp_should_keep_alive(p);
+  req->upgrade = p->upgrade;
+  req->nheaders = nheaders;
+  req->nfields = ctx->nheaders;
+
+  req->headers = (lhp_header *)data;
+  if (index) memcpy(data, ctx->headers, index);
+  data += index;
+  req->line = data;
+  req->line_len = ctx->line.len;
+  if (ctx->line.len) memcpy(data, ctx->line.data, ctx->line.len);
+  data += ctx->line.len;
+  req->head = data;
+  if (ctx->head.len) memcpy(data, ctx->head.data, ctx->head.len);
+  data += ctx->head.len;
+  req->body = data;
+  req->body_len = ctx->body.len;
+  if (ctx->body.len) memcpy(data, ctx->body.data, ctx->body.len);
+
+  luaL_getmetatable(L, LHP_REQUEST);
+  lua_setmetatable(L, -2);
+}
+
+/* Index of the first header named `name`, compared case-insensitively,
+ * `last` when there is none */
+static size_t lhttp_request_find(const lhttp_request_t *req, size_t first,
+                                 size_t last, const char *name, size_t len) {
+  for (; first < last; first++) {
+    const lhp_header *h = &req->headers[first];
+    const char *field = req->head + h->off;
+    size_t i;
+
+    if (h->name_len != len) continue;
+    for (i = 0; i < len; i++) {
+      char a = field[i], b = name[i];
+      if (a >= 'A' && a <= 'Z') a |= 0x20;
+      if (b >= 'A' && b <= 'Z') b |= 0x20;
+      if (a != b) break;
+    }
+    if (i == len) return first;
+  }
+  return last;
+}
+
+static void lhttp_request_push_value(lua_State *L, const lhttp_request_t *req,
+                                     size_t i) {
+  const lhp_header *h = &req->headers[i];
+
+  lua_pushlstring(L, req->head + h->off + h->name_len, h->value_len);
+}
+
+static void lhttp_request_push_headers(lua_State *L, size_t first,
+                                       size_t last) {
+  const lhttp_request_t *req = lua_touserdata(L, 1);
+  lhttp_request_headers_t *view = lua_newuserdata(L, sizeof(*view));
+
+  view->req = req;
+  view->first = first;
+  view->last = last;
+  luaL_getmetatable(L, LHP_REQUEST_HEADERS);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+}
+
+/* Split the URL with llurl the first time one of its parts is read */
+static int lhttp_request_url(lhttp_request_t *req) {
+  if (req->url_state == 0) {
+    http_parser_url_init(&req->u);
+    req->url_state = req->type == HTTP_REQUEST &&
+                     http_parser_parse_url(req->line, req->line_len,
+                                           req->method == HTTP_CONNECT,
+                                           &req->u) == 0 ? 1 : -1;
+  }
+  return req->url_state == 1;
+}
+
+static int lhttp_request_push_url_field(lua_State *L, lhttp_request_t *req,
+                                        int field) {
+  if (!lhttp_request_url(req)) return 0;
+  lhttp_parser_push_url_field(L, req->line, &req->u, field);
+  return 1;
+}
+
+/* Value of a hex digit, -1 if `c` is not one */
+static int lhttp_request_hex(int c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+/* Whether the encoded query key `key` decodes to `name` */
+static int lhttp_request_key_is(const char *key, size_t klen, const char *name,
+                                size_t nlen) {
+  size_t i = 0, j = 0;
+
+  while (i < klen && j < nlen) {
+    int c = (unsigned char)key[i];
+
+    if (c == '+') {
+      c = ' ';
+    } else if (c == '%' && i + 2 < klen && lhttp_request_hex(key[i + 1]) >= 0 &&
+               lhttp_request_hex(key[i + 2]) >= 0) {
+      c = lhttp_request_hex(key[i + 1]) << 4 | lhttp_request_hex(key[i + 2]);
+      i += 2;
+    }
+    if (c != (unsigned char)name[j]) return 0;
+    i++;
+    j++;
+  }
+  return i == klen && j == nlen;
+}
+
+/***
+ * Read a query parameter of a request object
+ *
+ * The query is not split into a table: the pairs are scanned until `name`
+ * is found and only that value is decoded.
+ *
+ * @function request:query
+ * @tparam string name Decoded parameter name
+ * @treturn string|nil The decoded value of the first parameter called
+ *   `name`, `''` when it has no `=`, nil when there is none
+ * @usage
+ * local id = req:query('id')
+ */
+static int lhttp_request_query(lua_State *L) {
+  lhttp_request_t *req = luaL_checkudata(L, 1, LHP_REQUEST);
+  size_t nlen;
+  const char *name = luaL_checklstring(L, 2, &nlen);
+  const char *q, *end;
+
+  if (!lhttp_request_url(req) || !(req->u.field_set & (1 << UF_QUERY)))
+    return 0;
+  q = req->line + req->u.field_data[UF_QUERY].off;
+  end = q + req->u.field_data[UF_QUERY].len;
+
+  while (q < end) {
+    const char *amp = memchr(q, '&', end - q);
+    const char *pair_end = amp ? amp : end;
+    const char *eq = memchr(q, '=', pair_end - q);
+    const char *key_end = eq ? eq : pair_end;
+
+    if (key_end > q && lhttp_request_key_is(q, key_end - q, name, nlen)) {
+      const char *value = eq ? eq + 1 : pair_end;
+      size_t vlen = pair_end - value, i;
+
+      for (i = 0; i < vlen; i++)
+        if (value[i] == '%' || value[i] == '+') break;
+      if (i == vlen) {
+        lua_pushlstring(L, value, vlen);
+      } else {
+        char *buf = lua_newuserdata(L, vlen + 1);
+
+        vlen = llquery_url_decode(value, vlen, buf, vlen + 1);
+        lua_pushlstring(L, buf, vlen);
+      }
+      return 1;
+    }
+    q = pair_end + 1;
+  }
+  return 0;
+}
+
+/***
+ * Read a header of a request object
+ *
+ * @function request:header
+ * @tparam string name Header name, compared case-insensitively
+ * @treturn string... Every value of that header in arrival order, nothing
+ *   when the message has no such header
+ * @usage
+ * local cookies = { req:header('cookie') }
+ */
+static int lhttp_request_header(lua_State *L) {
+  const lhttp_request_t *req = luaL_checkudata(L, 1, LHP_REQUEST);
+  size_t len, i = 0;
+  const char *name = luaL_checklstring(L, 2, &len);
+  int n = 0;
+
+  while ((i = lhttp_request_find(req, i, req->nheaders, name, len)) <
+         req->nheaders) {
+    luaL_checkstack(L, 1, "too many header values");
+    lhttp_request_push_value(L, req, i++);
+    n++;
+  }
+  return n;
+}
+
+/* Fields of a request object, see lhttp_request_index */
+static const char *const lhttp_request_fields[] = {
+    "method", "url", "path", "querystring", "fragment", "host", "port",
+    "status_code", "status_text", "http_major", "http_minor", "headers",
+    "trailers", "body", "should_keep_alive", "upgrade", NULL};
+
+/* Fields are made on each read, other keys are looked up in the methods
+ * table, the upvalue */
+static int lhttp_request_index(lua_State *L) {
+  lhttp_request_t *req = lua_touserdata(L, 1);
+  const char *key = lua_type(L, 2) == LUA_TSTRING ? lua_tostring(L, 2) : "";
+  int request = req->type == HTTP_REQUEST;
+  int i;
+
+  for (i = 0; lhttp_request_fields[i]; i++)
+    if (strcmp(key, lhttp_request_fields[i]) == 0) break;
+
+  switch (i) {
+  case 0:
+    if (!request) return 0;
+    lua_pushstring(L, llhttp_method_name(req->method));
+    return 1;
+  case 1:
+  case 8:
+    if (request != (i == 1)) return 0;
+    lua_pushlstring(L, req->line, req->line_len);
+    return 1;
+  case 2: return lhttp_request_push_url_field(L, req, UF_PATH);
+  case 3: return lhttp_request_push_url_field(L, req, UF_QUERY);
+  case 4: return lhttp_request_push_url_field(L, req, UF_FRAGMENT);
+  case 5: return lhttp_request_push_url_field(L, req, UF_HOST);
+  case 6:
+    if (!lhttp_request_url(req) || !(req->u.field_set & (1 << UF_PORT)))
+      return 0;
+    lua_pushinteger(L, req->u.port);
+    return 1;
+  case 7:
+    if (request) return 0;
+    lua_pushinteger(L, req->status_code);
+    return 1;
+  case 9: lua_pushinteger(L, req->http_major); return 1;
+  case 10: lua_pushinteger(L, req->http_minor); return 1;
+  case 11:
+    lhttp_request_push_headers(L, 0, req->nheaders);
+    return 1;
+  case 12:
+    if (req->nfields == req->nheaders) return 0;
+    lhttp_request_push_headers(L, req->nheaders, req->nfields);
+    return 1;
+  case 13: lua_pushlstring(L, req->body, req->body_len); return 1;
+  case 14: lua_pushboolean(L, req->keep_alive); return 1;
+  case 15: lua_pushboolean(L, req->upgrade); return 1;
+  default:
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+  }
+}
+
+/* headers[name] is the first value of that header, #headers the count */
+static int lhttp_request_headers_index(lua_State *L) {
+  const lhttp_request_headers_t *view = lua_touserdata(L, 1);
+  size_t len, i;
+  const char *name;
+
+  if (lua_type(L, 2) != LUA_TSTRING) return 0;
+  name = lua_tolstring(L, 2, &len);
+  i = lhttp_request_find(view->req, view->first, view->last, name, len);
+  if (i == view->last) return 0;
+  lhttp_request_push_value(L, view->req, i);
+  return 1;
+}
+
+static int lhttp_request_headers_len(lua_State *L) {
+  const lhttp_request_headers_t *view = lua_touserdata(L, 1);
+
+  lua_pushinteger(L, (lua_Integer)(view->last - view->first));
+  return 1;
+}
+
+/* Turn the collected message into a table and append it to the results
+ * array that lhttp_parser_execute keeps on the stack */
+static void lhttp_parser_push_message(lua_State *L, http_parser *p,
+                                      parser_ctx *ctx) {
+  size_t nheaders = ctx->ntrailers ? ctx->ntrailers : ctx->nheaders;
+
+  if (ctx->flags & LHP_F_REQUEST) {
+    lhttp_parser_push_request(L, p, ctx);
+    lua_rawseti(L, ctx->results, ++ctx->nresults);
+    return;
+  }
+
+  lua_createtable(L, 0, 10);
+  if (p->type == HTTP_REQUEST) {
+    lua_pushstring(L, llhttp_method_name(p->method));
+    lua_setfield(L, -2, "method");
+    lua_pushlstring(L, ctx->line.data, ctx->line.len);
+    lua_setfield(L, -2, "url");
+  } else {
+    lua_pushinteger(L, p->status_code);
+    lua_setfield(L, -2, "status_code");
+    lua_pushlstring(L, ctx->line.data, ctx->line.len);
+    lua_setfield(L, -2, "status_text");
+  }
+
+  lua_pushinteger(L, p->http_major);
+  lua_setfield(L, -2, "http_major");
+  lua_pushinteger(L, p->http_minor);
+  lua_setfield(L, -2, "http_minor");
+
+  lhttp_parser_push_headers(L, ctx, 0, nheaders);
+  lua_setfield(L, -2, "headers");
+  if (ctx->nheaders > nheaders) {
+    lhttp_parser_push_headers(L, ctx, nheaders, ctx->nheaders);
+    lua_setfield(L, -2, "trailers");
+  }
+
+  lua_pushlstring(L, ctx->body.data, ctx->body.len);
+  lua_setfield(L, -2, "body");
+
+  lua_pushboolean(L, llhttp_should_keep_alive(p));
+  lua_setfield(L, -2, "should_keep_alive");
+  lua_pushboolean(L, p->upgrade);
+  lua_setfield(L, -2, "upgrade");
+
+  lua_rawseti(L, ctx->results, ++ctx->nresults);
+}
+
+/*****************************************************************************/
+/* Module metrics, shared by every Lua state of the process that loaded the
+ * module: relaxed atomic increments, read with lhp.metrics() */
+
+#define LHP_METRIC_ADD(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#define LHP_METRIC_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+typedef struct {
+  uint64_t buckets[LHP_HIST_BUCKETS];  /* bucket k counts values <= 2^k */
+  uint64_t sum;
+  uint64_t count;
+} lhttp_parser_hist;
+
+static struct {
+  uint64_t parsers_created;
+  uint64_t parsers_alive;
+  uint64_t requests[LHP_METHOD_MAX];
+  uint64_t responses[6];  /* by status class, 0 for codes out of 1xx-5xx */
+  uint64_t errors[LHP_ERRNO_MAX];
+  lhttp_parser_hist header_block;  /* bytes, parsers with profile */
+  lhttp_parser_hist parse_ns;      /* per message, parsers with profile */
+} lhttp_parser_metrics;
+
+static void lhttp_parser_observe(lhttp_parser_hist *h, uint64_t value) {
+  unsigned k = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+
+  if (k >= LHP_HIST_BUCKETS) k = LHP_HIST_BUCKETS - 1;
+  LHP_METRIC_ADD(h->buckets[k], 1);
+  LHP_METRIC_ADD(h->sum, value);
+  LHP_METRIC_ADD(h->count, 1);
+}
+
+/* Monotonic clock in nanoseconds, for the profile option */
+static uint64_t lhttp_parser_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Errors that stop execute and finish, as opposed to pauses */
+static int lhttp_parser_failed(llhttp_errno_t err) {
+  return err != HPE_OK && err != HPE_PAUSED && err != HPE_PAUSED_UPGRADE &&
+         err != HPE_STRICT;
+}
+
+static void lhttp_parser_count_error(parser_ctx *ctx, llhttp_errno_t err) {
+  if (lhttp_parser_failed(err) && (unsigned)err < LHP_ERRNO_MAX) {
+    ctx->stats.errors[err]++;
+    LHP_METRIC_ADD(lhttp_parser_metrics.errors[err], 1);
+  }
+}
+
+/* llhttp_execute, counting the bytes parsed, the errors and the time spent
+ * in llhttp outside of the callbacks */
+static llhttp_errno_t lhttp_parser_run(http_parser *p, parser_ctx *ctx,
+                                       const char *data, size_t len) {
+  llhttp_errno_t err;
+  uint64_t start = 0, callback_ns = 0;
+
+  if (ctx->profile) {
+    start = lhttp_parser_now();
+    callback_ns = ctx->stats.callback_ns;
+    ctx->message_mark = start;
+  }
+  err = llhttp_execute(p, data, len);
+  if (lhttp_parser_failed(err))
+    LHTTP_PROBE2(parse_error, (int)err, llhttp_get_error_pos(p) - data);
+  if (ctx->profile) {
+    uint64_t end = lhttp_parser_now();
+
+    ctx->stats.execute_ns +=
+        end - start - (ctx->stats.callback_ns - callback_ns);
+    /* the time between two executes is not parsing */
+    if (ctx->in_message) ctx->message_ns += end - ctx->message_mark;
+  }
+
+  if (err == HPE_OK) {
+    ctx->stats.bytes += len;
+  } else {
+    ctx->stats.bytes += llhttp_get_error_pos(p) - data;
+    lhttp_parser_count_error(ctx, err);
+  }
+  return err;
+}
+
+static int lhttp_parser_pcall_callback(http_parser *p, int cb,
                                        int nargs, int nresult) {
   parser_ctx *ctx = p->data;
   lua_State *L = ctx->L;
-  int top;
 
   /* Safety check: ensure L is valid */
   if (L == NULL) {
     return HPE_INTERNAL;
   }
 
-  /* Put the environment of the userdata on the top of the stack */
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->ref);
-  top = lua_gettop(L);
-
-  /* Get the callback and put it on the stack */
-  lua_pushstring(L, func);
-  lua_rawget(L, top);
-
-  /* remove environment of the userdata */
-  lua_remove(L, top);
-
-  /* See if it's a function */
-  if (lua_isnil(L, -1)) {
-    /* no function defined */
-    lua_pop(L, 1 + nargs);
+  /* See if it's defined, callbacks are resolved once in lhttp_parser_new */
+  if (!LHP_HAS_CB(ctx, cb)) {
+    lua_pop(L, nargs);
     return 0;
-  };
+  }
 
+  /* Get the callback and put it below the arguments */
+  lua_rawgeti(L, ctx->cb_index, cb + 1);
   if (nargs > 0) lua_insert(L, lua_gettop(L) - nargs);
+  if (ctx->flags & LHP_F_CONTEXT) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->ctx_ref);
+    if (nargs > 0) lua_insert(L, lua_gettop(L) - nargs);
+    nargs++;
+  }
 
-  if (lua_pcall(L, nargs, nresult, 0) != 0) {
-    fprintf(stderr, "Error while calling %s: %s\n", func, lua_tostring(L, -1));
+  ctx->stats.callbacks[cb]++;
 
-    lua_pop(L, 1);
-    return HPE_USER;
+  /* Leave the call on the stack for the Lua driver, which can yield */
+  if (ctx->flags & LHP_F_YIELDABLE) {
+    ctx->pending = cb;
+    return HPE_PAUSED;
   }
 
+  if (ctx->profile) {
+    uint64_t start = lhttp_parser_now();
+    int status = lua_pcall(L, nargs, nresult, 0);
+
+    ctx->stats.callback_ns += lhttp_parser_now() - start;
+    if (status != 0) goto error;
+  } else if (lua_pcall(L, nargs, nresult, 0) != 0)
+    goto error;
+
   return nresult;
+
+error:
+  fprintf(stderr, "Error while calling %s: %s\n", lhttp_parser_cb_names[cb],
+          lua_tostring(L, -1));
+
+  lua_pop(L, 1);
+  return HPE_USER;
 }
 
 static int lhttp_parser_on_message_begin(http_parser *p) {
-  return lhttp_parser_pcall_callback(p, "onMessageBegin", 0, 0);
+  parser_ctx *ctx = p->data;
+
+  ctx->url_len = ctx->header_bytes = ctx->nfields = ctx->body_len = 0;
+  ctx->url.len = 0;
+  ctx->url_at = NULL;
+  LHTTP_PROBE(message_begin);
+  if (ctx->profile) {
+    ctx->in_message = 1;
+    ctx->message_mark = lhttp_parser_now();
+    ctx->message_ns = 0;
+  }
+
+  if (ctx->flags & LHP_F_COLLECT)
+    lhttp_parser_clear_message(ctx);
+  else if (ctx->flags & LHP_F_COLLECT_HEADERS)
+    lhttp_parser_clear_headers(ctx);
+
+  return lhttp_parser_pcall_callback(p, LHP_CB_MESSAGE_BEGIN, 0, 0);
+}
+
+/* Count a message completed by execute, true once max_messages_per_execute
+ * is reached and execute has to stop */
+static int lhttp_parser_count_message(parser_ctx *ctx) {
+  if (!ctx->max_messages || ++ctx->nmessages < ctx->max_messages) return 0;
+  ctx->messages_full = 1;
+  return 1;
 }
 
 static int lhttp_parser_on_message_complete(http_parser *p) {
-  return lhttp_parser_pcall_callback(p, "onMessageComplete", 0, 0);
+  parser_ctx *ctx = p->data;
+  int ret;
+
+  ctx->stats.messages++;
+  LHTTP_PROBE1(message_complete, ctx->body_len);
+  if (p->type == HTTP_REQUEST) {
+    if (p->method < LHP_METHOD_MAX)
+      LHP_METRIC_ADD(lhttp_parser_metrics.requests[p->method], 1);
+  } else {
+    unsigned cls = p->status_code / 100;
+
+    LHP_METRIC_ADD(lhttp_parser_metrics.responses[cls <= 5 ? cls : 0], 1);
+  }
+  if (ctx->in_message) {
+    ctx->in_message = 0;
+    ctx->message_ns += lhttp_parser_now() - ctx->message_mark;
+    lhttp_parser_observe(&lhttp_parser_metrics.parse_ns, ctx->message_ns);
+  }
+
+  if ((ctx->flags & LHP_F_COLLECT) && ctx->results)
+    lhttp_parser_push_message(ctx->L, p, ctx);
+
+  ret = lhttp_parser_pcall_callback(p, LHP_CB_MESSAGE_COMPLETE, 0, 0);
+  /* finish has no input left to hold back */
+  if (ret == 0 && (ctx->input || ctx->reading) &&
+      lhttp_parser_count_message(ctx))
+    return HPE_PAUSED;
+  return ret;
 }
 
 static int lhttp_parser_on_url(http_parser *p, const char *at, size_t length) {
   parser_ctx *ctx = p->data;
   lua_State *L = ctx->L;
 
+  if (lhttp_parser_over(&ctx->url_len, length, ctx->max_url))
+    return lhttp_parser_limit_error(p, "max_url");
+
+  if ((ctx->flags & LHP_F_COLLECT) && lhp_buf_append(&ctx->line, at, length))
+    return lhttp_parser_nomem(p);
+
+  /* onUrl runs once the URL is complete */
+  if (ctx->flags & LHP_F_PARSE_URL) {
+    if (ctx->url.len == 0 && ctx->url_at == NULL &&
+        at + length < ctx->input_end) {
+      ctx->url_at = at;
+      ctx->url_at_len = length;
+      return 0;
+    }
+    if (ctx->url_at) {
+      if (lhp_buf_append(&ctx->url, ctx->url_at, ctx->url_at_len))
+        return lhttp_parser_nomem(p);
+      ctx->url_at = NULL;
+    }
+    if (lhp_buf_append(&ctx->url, at, length)) return lhttp_parser_nomem(p);
+    return 0;
+  }
+
+  if (!LHP_HAS_CB(ctx, LHP_CB_URL)) return 0;
+
   /* Push the string argument */
   lua_pushlstring(L, at, length);
-  return lhttp_parser_pcall_callback(p, "onUrl", 1, 0);
+  return lhttp_parser_pcall_callback(p, LHP_CB_URL, 1, 0);
+}
+
+/* With LHP_F_PARSE_URL, call onUrl(url, path, query, fragment) on the whole
+ * URL, split by llurl here rather than by lhttp_url from Lua */
+static int lhttp_parser_on_url_complete(http_parser *p) {
+  parser_ctx *ctx = p->data;
+  lua_State *L = ctx->L;
+  struct http_parser_url u;
+  const char *url = ctx->url_at ? ctx->url_at : ctx->url.data;
+  size_t len = ctx->url_at ? ctx->url_at_len : ctx->url.len;
+
+  ctx->url.len = 0;
+  ctx->url_at = NULL;
+  if (url == NULL) url = "";
+
+  lua_pushlstring(L, url, len);
+  http_parser_url_init(&u);
+  if (http_parser_parse_url(url, len, p->method == HTTP_CONNECT, &u) != 0)
+    u.field_set = 0;
+  lhttp_parser_push_url_field(L, url, &u, UF_PATH);
+  lhttp_parser_push_url_field(L, url, &u, UF_QUERY);
+  lhttp_parser_push_url_field(L, url, &u, UF_FRAGMENT);
+  return lhttp_parser_pcall_callback(p, LHP_CB_URL, 4, 0);
 }
 
 static int lhttp_parser_on_status(http_parser *p, const char *at,
@@ -118,22 +1302,56 @@ static int lhttp_parser_on_status(http_parser *p, const char *at,
   parser_ctx *ctx = p->data;
   lua_State *L = ctx->L;
 
+  if ((ctx->flags & LHP_F_COLLECT) && lhp_buf_append(&ctx->line, at, length))
+    return lhttp_parser_nomem(p);
+
+  if (!LHP_HAS_CB(ctx, LHP_CB_STATUS)) return 0;
+
   /* Push the status code and string argument */
   lua_pushinteger(L, p->status_code);
   lua_pushlstring(L, at, length);
 
-  return lhttp_parser_pcall_callback(p, "onStatus", 2, 0);
+  return lhttp_parser_pcall_callback(p, LHP_CB_STATUS, 2, 0);
 }
 
 static int lhttp_parser_on_header_field(http_parser *p, const char *at,
                                         size_t length) {
   parser_ctx *ctx = p->data;
   lua_State *L = ctx->L;
+  /* false for the next fragments of a field split over execute calls */
+  int first = ctx->hstate != LHP_HS_FIELD;
+
+  /* Limits are checked here rather than in the complete callbacks, llhttp
+   * keeps the error reason only for span callbacks */
+  if (first && lhttp_parser_over(&ctx->nfields, 1, ctx->max_headers))
+    return lhttp_parser_limit_error(p, "max_headers");
+  if (lhttp_parser_over(&ctx->header_bytes, length, ctx->max_header_bytes))
+    return lhttp_parser_limit_error(p, "max_header_bytes");
+
+  if ((ctx->flags & LHP_F_COLLECT_HEADERS) &&
+      lhttp_parser_collect_field(ctx, at, length))
+    return lhttp_parser_nomem(p);
+  ctx->hstate = LHP_HS_FIELD;
+
+  if (!LHP_HAS_CB(ctx, LHP_CB_HEADER_FIELD)) return 0;
+
+  /* Push the lowercase name and its ID, a name can only be recognised when
+   * it arrives in one piece, ended by the colon */
+  if (ctx->flags & LHP_F_HEADER_IDS) {
+    int whole = first && at + length < ctx->input_end && at[length] == ':';
+    int id = lhttp_parser_push_header_name(L, ctx, at, length, whole);
+
+    if (id != LHP_H_UNKNOWN)
+      lua_pushinteger(L, id);
+    else
+      lua_pushnil(L);
+    return lhttp_parser_pcall_callback(p, LHP_CB_HEADER_FIELD, 2, 0);
+  }
 
   /* Push the string argument */
   lua_pushlstring(L, at, length);
 
-  return lhttp_parser_pcall_callback(p, "onHeaderField", 1, 0);
+  return lhttp_parser_pcall_callback(p, LHP_CB_HEADER_FIELD, 1, 0);
 }
 
 static int lhttp_parser_on_header_value(http_parser *p, const char *at,
@@ -141,40 +1359,84 @@ static int lhttp_parser_on_header_value(http_parser *p, const char *at,
   parser_ctx *ctx = p->data;
   lua_State *L = ctx->L;
 
+  if (lhttp_parser_over(&ctx->header_bytes, length, ctx->max_header_bytes))
+    return lhttp_parser_limit_error(p, "max_header_bytes");
+
+  if ((ctx->flags & LHP_F_COLLECT_HEADERS) &&
+      lhttp_parser_collect_value(ctx, at, length))
+    return lhttp_parser_nomem(p);
+
+  if (!LHP_HAS_CB(ctx, LHP_CB_HEADER_VALUE)) return 0;
+
   /* Push the string argument */
   lua_pushlstring(L, at, length);
 
-  return lhttp_parser_pcall_callback(p, "onHeaderValue", 1, 0);
+  return lhttp_parser_pcall_callback(p, LHP_CB_HEADER_VALUE, 1, 0);
+}
+
+static int lhttp_parser_on_header_field_complete(http_parser *p) {
+  parser_ctx *ctx = p->data;
+
+  /* the next field span starts a new header, even after an empty value */
+  ctx->hstate = LHP_HS_VALUE;
+  return 0;
 }
 
 static int lhttp_parser_on_body(http_parser *p, const char *at, size_t length) {
   parser_ctx *ctx = p->data;
   lua_State *L = ctx->L;
 
+  if (lhttp_parser_over(&ctx->body_len, length, ctx->max_body))
+    return lhttp_parser_limit_error(p, "max_body");
+
+  if ((ctx->flags & LHP_F_COLLECT) && lhp_buf_append(&ctx->body, at, length))
+    return lhttp_parser_nomem(p);
+
+  if (!LHP_HAS_CB(ctx, LHP_CB_BODY)) return 0;
+
+  /* Borrowed view: pointer, length, input string and position, only valid
+   * while the callback runs */
+  if (ctx->flags & LHP_F_BODY_VIEW) {
+    lua_pushlightuserdata(L, (void *)at);
+    lua_pushinteger(L, length);
+    if (ctx->input) {
+      lua_pushvalue(L, ctx->input);
+      lua_pushinteger(L, at - ctx->input_base + 1);
+    } else {
+      lua_pushnil(L);
+      lua_pushnil(L);
+    }
+    return lhttp_parser_pcall_callback(p, LHP_CB_BODY, 4, 0);
+  }
+
   /* Push the string argument */
   lua_pushlstring(L, at, length);
 
-  return lhttp_parser_pcall_callback(p, "onBody", 1, 0);
+  return lhttp_parser_pcall_callback(p, LHP_CB_BODY, 1, 0);
 }
 
-static int lhttp_parser_on_headers_complete(http_parser *p) {
-  parser_ctx *ctx = p->data;
-  lua_State *L = ctx->L;
-  int ret;
-
-  /* Push a new table as the argument */
-  lua_newtable(L);
+/* Fill the info table at the top of the stack. A recycled table gets every
+ * field assigned, so nothing is left over from the previous message */
+static void lhttp_parser_fill_info(lua_State *L, http_parser *p,
+                                   parser_ctx *ctx) {
+  int reuse = ctx->info_mode == LHP_INFO_REUSE;
 
   /* METHOD */
   if (p->type == HTTP_REQUEST) {
     lua_pushstring(L, llhttp_method_name(p->method));
     lua_setfield(L, -2, "method");
+  } else if (reuse) {
+    lua_pushnil(L);
+    lua_setfield(L, -2, "method");
   }
 
   /* STATUS */
   if (p->type == HTTP_RESPONSE) {
     lua_pushinteger(L, p->status_code);
     lua_setfield(L, -2, "status_code");
+  } else if (reuse) {
+    lua_pushnil(L);
+    lua_setfield(L, -2, "status_code");
   }
 
   /* VERSION */
@@ -219,11 +1481,70 @@ static int lhttp_parser_on_headers_complete(http_parser *p) {
   lua_pushboolean(L, p->flags & F_TRANSFER_ENCODING);
   lua_setfield(L, -2, "TRANSFER_ENCODING");
 
-  ret = lhttp_parser_pcall_callback(p, "onHeadersComplete", 1, 1);
+  if (ctx->flags & LHP_F_COLLECT_HEADERS) {
+    lhttp_parser_push_headers(L, ctx, 0, ctx->nheaders);
+    lua_setfield(L, -2, "headers");
+  }
+}
+
+static int lhttp_parser_on_headers_complete(http_parser *p) {
+  parser_ctx *ctx = p->data;
+  lua_State *L = ctx->L;
+  int nargs = 1;
+  int ret;
+
+  LHTTP_PROBE3(headers_complete, (int)p->method, ctx->url_len, ctx->nfields);
+  if (ctx->profile) {
+    if (ctx->header_bytes > ctx->stats.max_header_block)
+      ctx->stats.max_header_block = ctx->header_bytes;
+    lhttp_parser_observe(&lhttp_parser_metrics.header_block, ctx->header_bytes);
+  }
+
+  /* anything collected after this point is a trailer */
+  if (ctx->flags & LHP_F_COLLECT) {
+    ctx->ntrailers = ctx->nheaders;
+    ctx->hstate = LHP_HS_NONE;
+  }
+
+  /* A missing onHeadersComplete has always been reported as an error,
+   * except for collecting parsers which need no callbacks at all */
+  if (!LHP_HAS_CB(ctx, LHP_CB_HEADERS_COMPLETE))
+    return (ctx->flags & LHP_F_COLLECT) ? 0 : HPE_USER;
+
+  switch (ctx->info_mode) {
+  case LHP_INFO_ARGS:
+    /* method or status, major, minor, flags, keep-alive, upgrade[, headers] */
+    if (p->type == HTTP_REQUEST)
+      lua_pushstring(L, llhttp_method_name(p->method));
+    else
+      lua_pushinteger(L, p->status_code);
+    lua_pushinteger(L, p->http_major);
+    lua_pushinteger(L, p->http_minor);
+    lua_pushinteger(L, p->flags);
+    lua_pushboolean(L, llhttp_should_keep_alive(p));
+    lua_pushboolean(L, p->upgrade);
+    nargs = 6;
+    if (ctx->flags & LHP_F_COLLECT_HEADERS) {
+      lhttp_parser_push_headers(L, ctx, 0, ctx->nheaders);
+      nargs++;
+    }
+    break;
+  case LHP_INFO_REUSE:
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->info_ref);
+    lhttp_parser_fill_info(L, p, ctx);
+    break;
+  default:
+    /* Push a new table as the argument */
+    lua_createtable(L, 0, 16);
+    lhttp_parser_fill_info(L, p, ctx);
+    break;
+  }
+
+  ret = lhttp_parser_pcall_callback(p, LHP_CB_HEADERS_COMPLETE, nargs, 1);
   if(ret==1) {
     ret = luaL_optinteger(L, -1, 0);
     lua_pop(L, 1);
-  } else
+  } else if (ret != HPE_PAUSED)
     ret = HPE_USER;
   return ret;
 }
@@ -232,29 +1553,367 @@ static int lhttp_parser_on_chunk_header(http_parser *p) {
   parser_ctx *ctx = p->data;
   lua_State *L = ctx->L;
 
+  if (!LHP_HAS_CB(ctx, LHP_CB_CHUNK_HEADER)) return 0;
+
   lua_pushinteger(L, p->content_length);
-  return lhttp_parser_pcall_callback(p, "onChunkHeader", 1, 0);
+  return lhttp_parser_pcall_callback(p, LHP_CB_CHUNK_HEADER, 1, 0);
 }
 
 static int lhttp_parser_on_chunk_complete(http_parser *p) {
-  return lhttp_parser_pcall_callback(p, "onChunkComplete", 0, 0);
+  return lhttp_parser_pcall_callback(p, LHP_CB_CHUNK_COMPLETE, 0, 0);
 }
 
 static int lhttp_parser_on_reset(http_parser *p) {
-  return lhttp_parser_pcall_callback(p, "onReset", 0, 0);
+  return lhttp_parser_pcall_callback(p, LHP_CB_RESET, 0, 0);
+}
+
+/******************************************************************************/
+
+static void lhttp_parser_resolve_callbacks(lua_State *L, int idx,
+                                           parser_ctx *ctx) {
+  int i;
+
+  /* one array per parser keeps a single registry slot per parser */
+  ctx->cb_mask = 0;
+  lua_createtable(L, LHP_CB_MAX, 0);
+  for (i = 0; i < LHP_CB_MAX; i++) {
+    lua_pushstring(L, lhttp_parser_cb_names[i]);
+    lua_rawget(L, idx);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      continue;
+    }
+    lua_rawseti(L, -2, i + 1);
+    ctx->cb_mask |= 1u << i;
+  }
+  ctx->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/* Register only the llhttp callbacks that have a Lua handler, so events
+ * nobody listens to never leave the state machine. Message complete is the
+ * exception, it counts the messages of parser:stats() */
+static void lhttp_parser_init_settings(parser_ctx *ctx) {
+  llhttp_settings_t *settings = &ctx->settings;
+
+  llhttp_settings_init(settings);
+#define XX(cb, field, fn) \
+  if (LHP_HAS_CB(ctx, cb)) settings->field = fn;
+  XX(LHP_CB_MESSAGE_BEGIN, on_message_begin, lhttp_parser_on_message_begin);
+  XX(LHP_CB_URL, on_url, lhttp_parser_on_url);
+  XX(LHP_CB_STATUS, on_status, lhttp_parser_on_status);
+  XX(LHP_CB_HEADER_FIELD, on_header_field, lhttp_parser_on_header_field);
+  XX(LHP_CB_HEADER_VALUE, on_header_value, lhttp_parser_on_header_value);
+  XX(LHP_CB_BODY, on_body, lhttp_parser_on_body);
+  XX(LHP_CB_CHUNK_HEADER, on_chunk_header, lhttp_parser_on_chunk_header);
+  XX(LHP_CB_CHUNK_COMPLETE, on_chunk_complete,
+     lhttp_parser_on_chunk_complete);
+  XX(LHP_CB_RESET, on_reset, lhttp_parser_on_reset);
+#undef XX
+  settings->on_message_complete = lhttp_parser_on_message_complete;
+
+  if (ctx->flags & LHP_F_COLLECT) {
+    settings->on_url = lhttp_parser_on_url;
+    settings->on_status = lhttp_parser_on_status;
+    settings->on_body = lhttp_parser_on_body;
+  }
+  if (ctx->flags & (LHP_F_COLLECT | LHP_F_COLLECT_HEADERS)) {
+    settings->on_message_begin = lhttp_parser_on_message_begin;
+    settings->on_header_field = lhttp_parser_on_header_field;
+    settings->on_header_value = lhttp_parser_on_header_value;
+    settings->on_header_field_complete = lhttp_parser_on_header_field_complete;
+  }
+  if ((ctx->flags & LHP_F_HEADER_IDS) && LHP_HAS_CB(ctx, LHP_CB_HEADER_FIELD))
+    settings->on_header_field_complete = lhttp_parser_on_header_field_complete;
+  if ((ctx->flags & LHP_F_PARSE_URL) && LHP_HAS_CB(ctx, LHP_CB_URL)) {
+    settings->on_message_begin = lhttp_parser_on_message_begin;
+    settings->on_url_complete = lhttp_parser_on_url_complete;
+  }
+
+  /* limits are counted per message, in the callbacks that see the bytes,
+   * so are the header block size of the profile and the probe arguments */
+  if (LHP_HAS_LIMITS(ctx) || ctx->profile || LHTTP_USDT_ENABLED)
+    settings->on_message_begin = lhttp_parser_on_message_begin;
+  if (ctx->max_url || LHTTP_USDT_ENABLED)
+    settings->on_url = lhttp_parser_on_url;
+  if (ctx->max_header_bytes || ctx->max_headers || ctx->profile ||
+      LHTTP_USDT_ENABLED) {
+    settings->on_header_field = lhttp_parser_on_header_field;
+    settings->on_header_value = lhttp_parser_on_header_value;
+    settings->on_header_field_complete = lhttp_parser_on_header_field_complete;
+  }
+  if (ctx->max_body || LHTTP_USDT_ENABLED)
+    settings->on_body = lhttp_parser_on_body;
+
+  /* Always registered: a parser without onHeadersComplete reports
+   * HPE_CB_HEADERS_COMPLETE, as it always did */
+  settings->on_headers_complete = lhttp_parser_on_headers_complete;
+}
+
+/* read a boolean field of an options table, default when absent */
+static int opt_bool_field(lua_State *L, int idx, const char *key,
+                          int default_val) {
+  int result = default_val;
+
+  lua_getfield(L, idx, key);
+  if (!lua_isnil(L, -1)) result = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return result;
+}
+
+/* read a non-negative integer field of an options table, default when
+ * absent */
+static size_t opt_size_field(lua_State *L, int idx, const char *key,
+                             size_t default_val) {
+  size_t result = default_val;
+
+  lua_getfield(L, idx, key);
+  if (!lua_isnil(L, -1)) {
+    lua_Number n = lua_tonumber(L, -1);
+    if (!lua_isnumber(L, -1) || n < 0)
+      luaL_error(L, "option '%s' must be a non-negative number", key);
+    result = (size_t)n;
+  }
+  lua_pop(L, 1);
+  return result;
+}
+
+static void lhttp_parser_options(lua_State *L, int idx, parser_ctx *ctx) {
+  if (lua_isnoneornil(L, idx)) return;
+  luaL_checktype(L, idx, LUA_TTABLE);
+
+  if (opt_bool_field(L, idx, "collect_headers",
+                     ctx->flags & LHP_F_COLLECT_HEADERS))
+    ctx->flags |= LHP_F_COLLECT_HEADERS;
+  else
+    ctx->flags &= ~LHP_F_COLLECT_HEADERS;
+
+  /* collecting whole messages implies collecting their headers */
+  if (opt_bool_field(L, idx, "collect", ctx->flags & LHP_F_COLLECT))
+    ctx->flags |= LHP_F_COLLECT | LHP_F_COLLECT_HEADERS;
+  else
+    ctx->flags &= ~LHP_F_COLLECT;
+
+  if (opt_bool_field(L, idx, "request", ctx->flags & LHP_F_REQUEST))
+    ctx->flags |= LHP_F_REQUEST | LHP_F_COLLECT | LHP_F_COLLECT_HEADERS;
+  else
+    ctx->flags &= ~LHP_F_REQUEST;
+
+  if (opt_bool_field(L, idx, "body_view", ctx->flags & LHP_F_BODY_VIEW))
+    ctx->flags |= LHP_F_BODY_VIEW;
+  else
+    ctx->flags &= ~LHP_F_BODY_VIEW;
+
+  if (opt_bool_field(L, idx, "header_ids", ctx->flags & LHP_F_HEADER_IDS))
+    ctx->flags |= LHP_F_HEADER_IDS;
+  else
+    ctx->flags &= ~LHP_F_HEADER_IDS;
+
+  if (opt_bool_field(L, idx, "parse_url", ctx->flags & LHP_F_PARSE_URL))
+    ctx->flags |= LHP_F_PARSE_URL;
+  else
+    ctx->flags &= ~LHP_F_PARSE_URL;
+
+  if (opt_bool_field(L, idx, "yieldable", ctx->flags & LHP_F_YIELDABLE))
+    ctx->flags |= LHP_F_YIELDABLE;
+  else
+    ctx->flags &= ~LHP_F_YIELDABLE;
+  if ((ctx->flags & LHP_F_YIELDABLE) && (ctx->flags & LHP_F_COLLECT))
+    luaL_error(L, "options 'yieldable' and 'collect' can not be combined");
+
+  lua_getfield(L, idx, "info");
+  if (!lua_isnil(L, -1)) {
+    const char *mode = lua_tostring(L, -1);
+    int i;
+
+    for (i = 0; lhttp_parser_info_modes[i]; i++)
+      if (mode && strcmp(mode, lhttp_parser_info_modes[i]) == 0) break;
+    if (lhttp_parser_info_modes[i] == NULL)
+      luaL_error(L, "invalid info '%s', must be 'table', 'args' or 'reuse'",
+                 mode ? mode : luaL_typename(L, -1));
+    ctx->info_mode = i;
+  }
+  lua_pop(L, 1);
+}
+
+/* Options that parser:configure() can change at any time: limits and the
+ * llhttp lenient flags. Applied by lhttp_parser_apply_config() */
+static void lhttp_parser_config(lua_State *L, int idx, parser_ctx *ctx) {
+  int i;
+
+  if (lua_isnoneornil(L, idx)) return;
+  luaL_checktype(L, idx, LUA_TTABLE);
+
+  ctx->max_url = opt_size_field(L, idx, "max_url", ctx->max_url);
+  ctx->max_header_bytes =
+      opt_size_field(L, idx, "max_header_bytes", ctx->max_header_bytes);
+  ctx->max_headers = opt_size_field(L, idx, "max_headers", ctx->max_headers);
+  ctx->max_body = opt_size_field(L, idx, "max_body", ctx->max_body);
+  ctx->max_messages = opt_size_field(L, idx, "max_messages_per_execute",
+                                     ctx->max_messages);
+  ctx->profile = opt_bool_field(L, idx, "profile", ctx->profile);
+
+  for (i = 0; lhttp_parser_lenient[i].name; i++) {
+    unsigned flag = lhttp_parser_lenient[i].flag;
+
+    if (opt_bool_field(L, idx, lhttp_parser_lenient[i].name,
+                       ctx->lenient & flag))
+      ctx->lenient |= flag;
+    else
+      ctx->lenient &= ~flag;
+  }
+}
+
+static void lhttp_parser_apply_config(http_parser *parser, parser_ctx *ctx) {
+  int i;
+
+  /* limits need their callbacks registered */
+  lhttp_parser_init_settings(ctx);
+  for (i = 0; lhttp_parser_lenient[i].name; i++)
+    lhttp_parser_lenient[i].set(parser,
+                                (ctx->lenient & lhttp_parser_lenient[i].flag)
+                                    != 0);
+}
+
+static void lhttp_parser_release_callbacks(lua_State *L, parser_ctx *ctx) {
+  luaL_unref(L, LUA_REGISTRYINDEX, ctx->cb_ref);
+  ctx->cb_ref = LUA_NOREF;
+  ctx->cb_mask = 0;
+  luaL_unref(L, LUA_REGISTRYINDEX, ctx->ctx_ref);
+  ctx->ctx_ref = LUA_NOREF;
 }
 
 /******************************************************************************/
+/* Shared callback sets: the callbacks are resolved once into an array that
+ * every parser created from the set references */
+
+#define LHP_HANDLERS "lhttp_parser.handlers"
+
+typedef struct {
+  int cb_ref;             /* registry ref of the callbacks, by LHP_CB_* + 1 */
+  unsigned cb_mask;
+} lhttp_parser_handlers_t;
+
+/***
+ * Create a shared callback set
+ *
+ * The callbacks are looked up once, parsers created with the set by `new`
+ * share them and pass their context as first argument to each of them, so
+ * connection state needs no closure per connection.
+ *
+ * @function handlers
+ * @tparam table callbacks Table containing callback functions, as for `new`
+ * @treturn userdata Callback set for `new` and `pool`
+ * @usage
+ * local handlers = lhp.handlers({
+ *   onUrl = function(conn, url) conn.url = url end,
+ *   onHeadersComplete = function(conn, info) end
+ * })
+ * local parser = lhp.new('request', handlers, conn)
+ */
+static int lhttp_parser_handlers(lua_State *L) {
+  lhttp_parser_handlers_t *h;
+  parser_ctx tmp;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lhttp_parser_resolve_callbacks(L, 1, &tmp);
+
+  h = lua_newuserdata(L, sizeof(*h));
+  h->cb_ref = tmp.cb_ref;
+  h->cb_mask = tmp.cb_mask;
+  luaL_getmetatable(L, LHP_HANDLERS);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int lhttp_parser_handlers_gc(lua_State *L) {
+  lhttp_parser_handlers_t *h = luaL_checkudata(L, 1, LHP_HANDLERS);
+
+  luaL_unref(L, LUA_REGISTRYINDEX, h->cb_ref);
+  h->cb_ref = LUA_NOREF;
+  return 0;
+}
+
+/* The callback set at idx, NULL if it is not one */
+static lhttp_parser_handlers_t *lhttp_parser_to_handlers(lua_State *L,
+                                                         int idx) {
+  void *h = lua_touserdata(L, idx);
+  int found;
+
+  if (h == NULL || !lua_getmetatable(L, idx)) return NULL;
+  luaL_getmetatable(L, LHP_HANDLERS);
+  found = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  return found ? (lhttp_parser_handlers_t *)h : NULL;
+}
 
 /***
  * Create a new HTTP parser
  *
  * Creates a new parser instance for parsing HTTP requests or responses.
- * The parser uses callbacks to notify about parsing events.
+ * The parser uses callbacks to notify about parsing events. Callbacks are
+ * looked up once here, later changes to the table are not seen by the parser.
  *
  * @function new
  * @tparam string parser_type Type of parser: 'request', 'response', or 'both'
- * @tparam table callbacks Table containing callback functions
+ * @tparam table|userdata callbacks Table containing callback functions, or a
+ * callback set from `handlers`. A callback set is followed by a context
+ * value, passed as first argument to every callback, before `options`
+ * @tparam[opt] table options Options table with optional fields:
+ *
+ *   - **collect_headers** (default `false`): gather header fields and values
+ *     in C and hand them to `onHeadersComplete` as `info.headers`, a table
+ *     listing the names in arrival order and mapping each name to its value
+ *     (an array of values when the name is repeated)
+ *   - **collect** (default `false`): run without callbacks, `callbacks` may be
+ *     nil. Each message is buffered in C and `execute`/`finish` return an
+ *     array of the messages completed during that call as an extra value
+ *   - **request** (default `false`): like `collect`, but each message is a
+ *     request object, one userdata holding the whole message. Its fields
+ *     (`method`, `url`, `path`, `querystring`, `fragment`, `host`, `port`,
+ *     `status_code`, `status_text`, `http_major`, `http_minor`, `headers`,
+ *     `trailers`, `body`, `should_keep_alive`, `upgrade`) are made when read,
+ *     `headers[name]` looks a header up case-insensitively, see also
+ *     `request:header` and `request:query`
+ *   - **body_view** (default `false`): call `onBody(ptr, len, data, i)` with a
+ *     borrowed view of the chunk instead of a new string: a light userdata
+ *     pointing at the first byte (LuaJIT FFI can cast it to `const char *`),
+ *     its length, the string given to `execute` and the 1-based position of
+ *     the chunk in it. The view is only valid during the callback
+ *   - **header_ids** (default `false`): header names are delivered in
+ *     lowercase and `onHeaderField(name, id)` also gets the ID of a well-known
+ *     name (see `HEADERS`), which then comes as a pre-created string. Names
+ *     in `info.headers` and collected messages are lowercased too
+ *   - **parse_url** (default `false`): call `onUrl(url, path, query,
+ *     fragment)` once per message with the whole URL, split by llurl in C.
+ *     Parts the URL does not have are nil, all of them when it does not
+ *     parse. The query comes without `?` and the fragment without `#`
+ *   - **info** (default `'table'`): how `onHeadersComplete` gets the message
+ *     info. `'table'` passes a new table per message, `'reuse'` refills one
+ *     table owned by the parser, `'args'` passes positional arguments
+ *     `(method_or_status, http_major, http_minor, flags, should_keep_alive,
+ *     upgrade[, headers])` where `flags` is the llhttp bitmask, test it with
+ *     the `F_*` constants
+ *   - **max_url**, **max_header_bytes**, **max_headers**, **max_body**
+ *     (default `0`, unlimited): per message limits on the URL length, the
+ *     bytes of all header names and values, the number of headers and the
+ *     body size. Parsing stops with `HPE_USER` as soon as one is crossed,
+ *     `parser:http_errno()` then gives the option name as reason
+ *   - **max_messages_per_execute** (default `0`, unlimited): `execute`
+ *     stops after completing that many messages and returns the bytes
+ *     consumed with the status `'max_messages_per_execute'`, feed the rest
+ *     again later
+ *   - **lenient_headers**, **lenient_chunked_length**, **lenient_keep_alive**,
+ *     **lenient_transfer_encoding**, **lenient_version**,
+ *     **lenient_data_after_close**, **lenient_optional_lf_after_cr**,
+ *     **lenient_optional_cr_before_lf**, **lenient_optional_crlf_after_chunk**,
+ *     **lenient_spaces_after_chunk_size**, **lenient_header_value_relaxed**
+ *     (default `false`): the matching `llhttp_set_lenient_*` flags
+ *   - **profile** (default `false`): also measure for `parser:stats()` the
+ *     time spent in callbacks and in llhttp, and the header block sizes
+ *   - **yieldable** (default `false`): callbacks may yield the coroutine
+ *     running `execute` or `finish`, parsing goes on where it stopped when
+ *     the coroutine is resumed. Can not be combined with `collect`
+ *
  * @treturn userdata New parser object
  * @usage
  * local lhp = require('lhttp_parser')
@@ -271,11 +1930,14 @@ static int lhttp_parser_on_reset(http_parser *p) {
 static int lhttp_parser_new(lua_State *L) {
   int itype;
   const char *type = luaL_optstring(L, 1, "both");
+  lhttp_parser_handlers_t *handlers = lhttp_parser_to_handlers(L, 2);
+  int opts = handlers ? 4 : 3;
   http_parser *parser;
   parser_ctx *ctx;
 
-  luaL_checktype(L, 2, LUA_TTABLE);
-
+  /* the options are read at index 3, or 4 after the context of a
+   * callback set, keep the userdata above them */
+  lua_settop(L, opts);
   parser = (http_parser *)lua_newuserdata(L, sizeof(http_parser) +
                                                  sizeof(parser_ctx));
   ctx = (parser_ctx *)&parser[1];
@@ -289,24 +1951,80 @@ static int lhttp_parser_new(lua_State *L) {
   } else {
     return luaL_argerror(L, 1, "type must be 'request', 'response' or 'both'");
   }
-  llhttp_init(parser, itype, &lhttp_parser_settings);
+
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->cb_ref = LUA_NOREF;
+  ctx->ctx_ref = LUA_NOREF;
+  ctx->names_ref = LUA_NOREF;
+  ctx->info_ref = LUA_NOREF;
+  ctx->pending = -1;
+  lhttp_parser_options(L, opts, ctx);
+  lhttp_parser_config(L, opts, ctx);
+  /* raise before any registry slot is taken, the userdata has no __gc yet
+   * to give them back */
+  if (!handlers && (!(ctx->flags & LHP_F_COLLECT) || !lua_isnoneornil(L, 2)))
+    luaL_checktype(L, 2, LUA_TTABLE);
+  if (ctx->flags & LHP_F_HEADER_IDS) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LHP_HEADER_NAMES);
+    ctx->names_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  if (ctx->info_mode == LHP_INFO_REUSE) {
+    lua_createtable(L, 0, 16);
+    ctx->info_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  /* Resolve the callback table into one registry slot per event kind,
+   * a collecting parser does not need any */
+  if (handlers) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, handlers->cb_ref);
+    ctx->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ctx->cb_mask = handlers->cb_mask;
+    lua_pushvalue(L, 3);
+    ctx->ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ctx->flags |= LHP_F_CONTEXT;
+  } else if (!lua_isnoneornil(L, 2)) {
+    lhttp_parser_resolve_callbacks(L, 2, ctx);
+  }
+  llhttp_init(parser, itype, &ctx->settings);
+  lhttp_parser_apply_config(parser, ctx);
 
   /* Store the current lua state in the parser's data */
   parser->data = ctx;
 
-  /* Set the callback table as the userdata's environment */
-  lua_pushvalue(L, 2);
-  ctx->ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  ctx->L = NULL;
-
   /* Set the type of the userdata as an lhttp_parser instance */
-  luaL_getmetatable(L, "lhttp_parser");
+  luaL_getmetatable(L, (ctx->flags & LHP_F_YIELDABLE) ? LHP_YIELDABLE
+                                                       : "lhttp_parser");
   lua_setmetatable(L, -2);
+  LHP_METRIC_ADD(lhttp_parser_metrics.parsers_created, 1);
+  LHP_METRIC_ADD(lhttp_parser_metrics.parsers_alive, 1);
 
   /* return the userdata */
   return 1;
 }
 
+/* Check that the value at idx is a parser, of either metatable */
+static http_parser *lhttp_parser_check(lua_State *L, int idx) {
+  void *p = lua_touserdata(L, idx);
+
+  if (p != NULL && lua_getmetatable(L, idx)) {
+    int found;
+
+    luaL_getmetatable(L, "lhttp_parser");
+    found = lua_rawequal(L, -1, -2);
+    lua_pop(L, 1);
+    if (!found) {
+      luaL_getmetatable(L, LHP_YIELDABLE);
+      found = lua_rawequal(L, -1, -2);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    if (found) return (http_parser *)p;
+  }
+  luaL_argerror(L, idx, lua_pushfstring(L, "lhttp_parser expected, got %s",
+                                        luaL_typename(L, idx)));
+  return NULL;
+}
+
 /*
 ** translate a relative initial string position
 ** (negative means back from end): clip result to [1, inf).
@@ -343,71 +2061,338 @@ static size_t getendpos(lua_State *L, int arg, lua_Integer def, size_t len) {
     return len + (size_t)pos + 1;
 }
 
+/* Append the completed messages array, when collecting, after the nret
+ * values already pushed */
+static int lhttp_parser_results(lua_State *L, parser_ctx *ctx, int nret) {
+  if (!ctx->results) return nret;
+
+  lua_pushvalue(L, ctx->results);
+  ctx->results = 0;
+  return nret + 1;
+}
+
+/* Status returned by execute, resumes the pause of max_messages_per_execute
+ * so that the rest of the input can be fed later */
+static const char *lhttp_parser_status(http_parser *p, parser_ctx *ctx,
+                                       llhttp_errno_t err, int left) {
+  if (ctx->messages_full) {
+    if (err == HPE_PAUSED) llhttp_resume(p);
+    if (left) return "max_messages_per_execute";
+    err = HPE_OK;
+  }
+  return llhttp_errno_name(err);
+}
+
 /***
  * Execute the parser on input data
  *
  * Feeds data to the parser for parsing. The parser will invoke callbacks
  * as it encounters different parts of the HTTP message.
  *
- * @function parser:execute
- * @tparam string data Input data to parse
- * @tparam[opt=1] number i Starting position (1-based index)
- * @tparam[opt=-1] number j Ending position (negative values count from end)
- * @treturn number Number of bytes parsed
- * @treturn string Error code name (e.g., "HPE_OK")
+ * @function parser:execute
+ * @tparam string data Input data to parse
+ * @tparam[opt=1] number i Starting position (1-based index)
+ * @tparam[opt=-1] number j Ending position (negative values count from end)
+ * @treturn number Number of bytes parsed
+ * @treturn string Error code name (e.g., "HPE_OK")
+ * @treturn[opt] table Completed messages, only for parsers created with
+ * `collect`. Each one has `method` and `url` or `status_code` and
+ * `status_text`, `http_major`, `http_minor`, `headers`, `trailers` when
+ * present, `body`, `should_keep_alive` and `upgrade`
+ * @usage
+ * local nparsed, err = parser:execute(data)
+ * if err ~= "HPE_OK" then
+ *   print("Parse error:", err)
+ * end
+ */
+static int lhttp_parser_execute(lua_State *L) {
+  http_parser *parser = lhttp_parser_check(L, 1);
+  parser_ctx *ctx = parser->data;
+  size_t chunk_len;
+  const char *chunk;
+  size_t offset;
+  size_t length;
+  size_t nparsed;
+  llhttp_errno_t err = HPE_OK;
+
+  luaL_checktype(L, 2, LUA_TSTRING);
+  chunk = lua_tolstring(L, 2, &chunk_len);
+
+  offset = posrelatI(luaL_optinteger(L, 3, 1), chunk_len) - 1;
+  length = getendpos(L, 4, -1, chunk_len);
+
+  luaL_argcheck(L, offset <= chunk_len, 3, "Offset is out of bounds");
+  /* an end before the offset would wrap the unsigned length */
+  luaL_argcheck(L, length >= offset && length <= chunk_len, 4,
+                "Length extends beyond end of chunk");
+  length -= offset;
+
+  ctx->L = L;
+
+  /* keep the input string referenced while callbacks run, with the
+   * callbacks array above it */
+  lua_settop(L, 2);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->cb_ref);
+  ctx->cb_index = 3;
+  ctx->input = 2;
+  ctx->input_base = chunk;
+  ctx->input_end = chunk + offset + length;
+  ctx->nmessages = 0;
+  ctx->messages_full = 0;
+  if (ctx->flags & LHP_F_COLLECT) {
+    lua_newtable(L);
+    ctx->results = lua_gettop(L);
+    ctx->nresults = 0;
+  }
+
+  if (length) {
+    chunk += offset;
+    err = lhttp_parser_run(parser, ctx, chunk, length);
+    if (err != HPE_OK && err != HPE_PAUSED && err != HPE_PAUSED_UPGRADE &&
+        err != HPE_STRICT) {
+      ctx->L = NULL;  /* Reset L after execution */
+      ctx->input = 0;
+      lua_pushnil(L);
+      lua_pushstring(L, llhttp_errno_name(err));
+      return lhttp_parser_results(L, ctx, 2);
+    }
+
+    if (err != HPE_OK) {
+      const char *pos = llhttp_get_error_pos(parser);
+      nparsed = pos - chunk;
+    } else {
+      nparsed = length;
+    }
+  } else
+    nparsed = 0;
+
+  ctx->L = NULL;  /* Reset L after execution */
+  ctx->input = 0;
+  lua_pushnumber(L, nparsed);
+  lua_pushstring(L, lhttp_parser_status(parser, ctx, err, nparsed < length));
+  return lhttp_parser_results(L, ctx, 2);
+}
+
+/***
+ * Execute the parser on a list of input chunks
+ *
+ * Feeds the chunks to the parser in order within one call, as `execute`
+ * would do with their concatenation but without copying them.
+ *
+ * @function parser:executev
+ * @tparam table chunks Array of strings
+ * @treturn number Total number of bytes parsed
+ * @treturn string Error code name (e.g., "HPE_OK")
+ * @treturn number Index of the chunk holding the first byte not parsed,
+ * `#chunks + 1` when all of them were parsed, or of the chunk with the error
+ * @treturn[opt] table Completed messages, only for parsers created with
+ * `collect`, see `parser:execute`
+ * @usage
+ * local nparsed, err, i = parser:executev({ head, body1, body2 })
+ */
+static int lhttp_parser_executev(lua_State *L) {
+  http_parser *parser = lhttp_parser_check(L, 1);
+  parser_ctx *ctx = parser->data;
+  size_t total = 0;
+  size_t chunk_len = 0;
+  size_t nparsed = 0;
+  llhttp_errno_t err = HPE_OK;
+  int i, n;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = (int)lua_rawlen(L, 2);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 2, i);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      return luaL_argerror(L, 2,
+                           lua_pushfstring(L, "chunk %d is not a string", i));
+    lua_pop(L, 1);
+  }
+
+  ctx->L = L;
+
+  /* the callbacks array, then the chunk being parsed at index 4 */
+  lua_settop(L, 2);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->cb_ref);
+  ctx->cb_index = 3;
+  lua_pushnil(L);
+  ctx->input = 4;
+  ctx->nmessages = 0;
+  ctx->messages_full = 0;
+  if (ctx->flags & LHP_F_COLLECT) {
+    lua_newtable(L);
+    ctx->results = lua_gettop(L);
+    ctx->nresults = 0;
+  }
+
+  for (i = 1; i <= n; i++) {
+    const char *chunk;
+
+    lua_rawgeti(L, 2, i);
+    lua_replace(L, 4);
+    chunk = lua_tolstring(L, 4, &chunk_len);
+    if (chunk_len == 0) continue;
+
+    ctx->input_base = chunk;
+    ctx->input_end = chunk + chunk_len;
+    err = lhttp_parser_run(parser, ctx, chunk, chunk_len);
+    if (err == HPE_OK) {
+      total += chunk_len;
+      continue;
+    }
+    if (err != HPE_PAUSED && err != HPE_PAUSED_UPGRADE && err != HPE_STRICT) {
+      ctx->L = NULL;
+      ctx->input = 0;
+      lua_pushnil(L);
+      lua_pushstring(L, llhttp_errno_name(err));
+      lua_pushinteger(L, i);
+      return lhttp_parser_results(L, ctx, 3);
+    }
+    nparsed = llhttp_get_error_pos(parser) - chunk;
+    total += nparsed;
+    if (nparsed == chunk_len) i++;
+    break;
+  }
+
+  ctx->L = NULL;
+  ctx->input = 0;
+  lua_pushnumber(L, total);
+  lua_pushstring(L, lhttp_parser_status(parser, ctx, err, i <= n));
+  lua_pushinteger(L, i);
+  return lhttp_parser_results(L, ctx, 3);
+}
+
+/***
+ * Read from a file descriptor and parse what was read
+ *
+ * Reads at most `maxbytes` into a buffer owned by the parser and parses them
+ * there, without making a Lua string of the input. Bytes left unparsed, after
+ * a pause, an upgrade or `max_messages_per_execute`, stay in the buffer and
+ * are parsed first by the next call; `maxbytes` 0 parses them without
+ * reading. With `body_view`, `onBody` gets nil in place of the input string
+ * and position.
+ *
+ * @function parser:read_fd
+ * @tparam integer fd Descriptor to read, usually a non-blocking socket
+ * @tparam[opt=65536] integer maxbytes Most bytes read by this call
+ * @treturn[1] number Bytes read, 0 at end of file or when nothing is ready
+ * @treturn[1] number Bytes parsed by this call, from the kept ones too
+ * @treturn[1] string Status as for `execute`, `'EOF'` at end of file or
+ * `'EAGAIN'` when the descriptor has nothing to read
+ * @treturn[1] table Completed messages, only for parsers created with
+ * `collect`
+ * @treturn[2] nil On error
+ * @treturn[2] string Error code name of the parser, or the system error
+ * message
+ * @treturn[2] number errno, for system errors
  * @usage
- * local nparsed, err = parser:execute(data)
- * if err ~= "HPE_OK" then
- *   print("Parse error:", err)
- * end
+ * local nread, nparsed, status = parser:read_fd(fd)
+ * if status == 'EOF' then parser:finish() end
  */
-static int lhttp_parser_execute(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+static int lhttp_parser_read_fd(lua_State *L) {
+  http_parser *parser = lhttp_parser_check(L, 1);
   parser_ctx *ctx = parser->data;
-  size_t chunk_len;
-  const char *chunk;
-  size_t offset;
-  size_t length;
-  size_t nparsed;
-  llhttp_errno_t err = HPE_OK;
-
-  luaL_checktype(L, 2, LUA_TSTRING);
-  chunk = lua_tolstring(L, 2, &chunk_len);
-
-  offset = posrelatI(luaL_optinteger(L, 3, 1), chunk_len) - 1;
-  length = getendpos(L, 4, -1, chunk_len) - offset;
-
-  luaL_argcheck(L, offset <= chunk_len, 3, "Offset is out of bounds");
-  luaL_argcheck(L, offset + length <= chunk_len, 4,
-                "Length extends beyond end of chunk");
+  int fd = (int)luaL_checkinteger(L, 2);
+  lua_Integer maxbytes = luaL_optinteger(L, 3, 65536);
+  ssize_t nread = 0;
+  size_t nparsed = 0;
+  llhttp_errno_t err = HPE_OK, paused;
+  const char *status = NULL;
+
+  luaL_argcheck(L, maxbytes >= 0, 3, "must not be negative");
+  luaL_argcheck(L, !(ctx->flags & LHP_F_YIELDABLE), 1,
+                "read_fd is not supported by yieldable parsers");
+  if (ctx->reading) return luaL_error(L, "read_fd called from a callback");
+
+  if (maxbytes > 0) {
+    if (lhp_buf_reserve(&ctx->rbuf, (size_t)maxbytes))
+      return luaL_error(L, "not enough memory");
+    do {
+      nread = read(fd, ctx->rbuf.data + ctx->rbuf.len, (size_t)maxbytes);
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread < 0) {
+      int e = errno;
+
+      if (e != EAGAIN && e != EWOULDBLOCK) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(e));
+        lua_pushinteger(L, e);
+        return 3;
+      }
+      status = "EAGAIN";
+      nread = 0;
+    } else if (nread == 0) {
+      status = "EOF";
+    }
+    ctx->rbuf.len += (size_t)nread;
+  }
 
   ctx->L = L;
+  lua_settop(L, 3);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->cb_ref);
+  ctx->cb_index = 4;
+  ctx->input = 0;
+  ctx->input_base = ctx->rbuf.data;
+  ctx->input_end = ctx->rbuf.data + ctx->rbuf.len;
+  ctx->nmessages = 0;
+  ctx->messages_full = 0;
+  if (ctx->flags & LHP_F_COLLECT) {
+    lua_newtable(L);
+    ctx->results = lua_gettop(L);
+    ctx->nresults = 0;
+  }
 
-  lua_settop(L, 0);
-  if (length) {
-    chunk += offset;
-    err = llhttp_execute(parser, chunk, length);
-    if (err != HPE_OK && err != HPE_PAUSED && err != HPE_PAUSED_UPGRADE &&
-        err != HPE_STRICT) {
-      ctx->L = NULL;  /* Reset L after execution */
+  /* a paused parser returns at once without moving its error position, the
+   * bytes are kept for after the resume */
+  paused = llhttp_get_errno(parser);
+  if (paused == HPE_PAUSED || paused == HPE_PAUSED_UPGRADE) {
+    err = paused;
+  } else if (ctx->rbuf.len && (nread > 0 || maxbytes == 0)) {
+    /* with nothing new, kept bytes are only parsed when asked for */
+    ctx->reading = 1;
+    err = lhttp_parser_run(parser, ctx, ctx->rbuf.data, ctx->rbuf.len);
+    ctx->reading = 0;
+    if (lhttp_parser_failed(err)) {
+      ctx->L = NULL;
+      ctx->rbuf.len = 0;
       lua_pushnil(L);
       lua_pushstring(L, llhttp_errno_name(err));
-      return 2;
+      return lhttp_parser_results(L, ctx, 2);
     }
+    nparsed = err == HPE_OK
+                  ? ctx->rbuf.len
+                  : (size_t)(llhttp_get_error_pos(parser) - ctx->rbuf.data);
+    ctx->rbuf.len -= nparsed;
+    if (ctx->rbuf.len)
+      memmove(ctx->rbuf.data, ctx->rbuf.data + nparsed, ctx->rbuf.len);
+  }
 
-    if (err != HPE_OK) {
-      const char *pos = llhttp_get_error_pos(parser);
-      nparsed = pos - chunk;
-    } else {
-      nparsed = length;
-    }
-  } else
-    nparsed = 0;
+  ctx->L = NULL;
+  lua_pushinteger(L, (lua_Integer)nread);
+  lua_pushinteger(L, (lua_Integer)nparsed);
+  lua_pushstring(L, status ? status
+                           : lhttp_parser_status(parser, ctx, err,
+                                                 ctx->rbuf.len > 0));
+  return lhttp_parser_results(L, ctx, 3);
+}
 
-  ctx->L = NULL;  /* Reset L after execution */
-  lua_pushnumber(L, nparsed);
-  lua_pushstring(L, llhttp_errno_name(err));
-  return 2;
+/***
+ * Take the bytes kept by `read_fd`
+ *
+ * Returns the bytes `read_fd` read but the parser did not consume, such as
+ * the start of the new protocol after an upgrade, and empties its buffer.
+ *
+ * @function parser:buffered
+ * @treturn string The kept bytes, possibly empty
+ */
+static int lhttp_parser_buffered(lua_State *L) {
+  http_parser *parser = lhttp_parser_check(L, 1);
+  parser_ctx *ctx = parser->data;
+
+  lua_pushlstring(L, ctx->rbuf.data ? ctx->rbuf.data : "", ctx->rbuf.len);
+  ctx->rbuf.len = 0;
+  return 1;
 }
 
 /***
@@ -420,6 +2405,8 @@ static int lhttp_parser_execute(lua_State *L) {
  * @treturn[1] number 0 on success
  * @treturn[2] nil On error
  * @treturn[2] string Error code name
+ * @treturn[opt] table Completed messages, only for parsers created with
+ * `collect`, see `parser:execute`
  * @usage
  * local result, err = parser:finish()
  * if not result then
@@ -427,21 +2414,496 @@ static int lhttp_parser_execute(lua_State *L) {
  * end
  */
 static int lhttp_parser_finish(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
   parser_ctx *ctx = parser->data;
   size_t nparsed;
+  llhttp_errno_t err;
 
   ctx->L = L;
-  llhttp_errno_t err = llhttp_finish(parser);
+  lua_settop(L, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->cb_ref);
+  ctx->cb_index = 2;
+  if (ctx->flags & LHP_F_COLLECT) {
+    lua_newtable(L);
+    ctx->results = lua_gettop(L);
+    ctx->nresults = 0;
+  }
+  err = llhttp_finish(parser);
+  if (lhttp_parser_failed(err)) LHTTP_PROBE2(parse_error, (int)err, 0);
+  lhttp_parser_count_error(ctx, err);
   ctx->L = NULL;
 
   if (err != HPE_OK && err != HPE_PAUSED) {
     lua_pushnil(L);
     lua_pushstring(L, llhttp_errno_name(err));
-    return 2;
+    return lhttp_parser_results(L, ctx, 2);
   }
   nparsed = 0;
   lua_pushnumber(L, nparsed);
+  if (ctx->flags & LHP_F_COLLECT) {
+    lua_pushstring(L, llhttp_errno_name(err));
+    return lhttp_parser_results(L, ctx, 2);
+  }
+  return 1;
+}
+
+/******************************************************************************/
+/* Yieldable parsers.
+ *
+ * Lua can not yield across lua_pcall, nor across lua_callk on LuaJIT, so
+ * the callbacks of a yieldable parser are not called from C. Each one
+ * pauses llhttp and is handed to a Lua driver, which calls it, possibly
+ * yielding, then asks lhttp_parser_step() to go on where llhttp stopped.
+ */
+
+/* Apply the outcome of a callback that ran in the driver, as llhttp would
+ * have done with its return value */
+static void lhttp_parser_callback_result(lua_State *L, http_parser *p, int cb,
+                                         int idx, const char *pos) {
+  if (!lua_toboolean(L, idx)) {
+    p->error = lhttp_parser_cb_errno[cb];
+    p->reason = "Callback error";
+    p->error_pos = pos;
+    return;
+  }
+  if (cb != LHP_CB_HEADERS_COMPLETE) return;
+
+  switch (lua_tointeger(L, idx + 1)) {
+  case 0:
+    break;
+  case 2:
+    p->upgrade = 1;
+    /* FALLTHROUGH */
+  case 1:
+    p->flags |= F_SKIPBODY;
+    break;
+  case HPE_PAUSED:
+    llhttp_pause(p);
+    break;
+  default:
+    p->error = HPE_CB_HEADERS_COMPLETE;
+    p->reason = "User callback error";
+    p->error_pos = pos;
+    break;
+  }
+}
+
+/* step(parser, data, i, j, how[, ok, ret])
+ *
+ * how is 0 to start parsing data[i..j], 3 to go on with the next chunk of
+ * executev, 1 to start a finish (data nil) and 2 to continue after the
+ * driver ran the due callback, ok and ret being its pcall results. Returns
+ * true, the callback name, the callback and its arguments when a callback is
+ * due, otherwise false followed by what execute or finish return. */
+static int lhttp_parser_step(lua_State *L) {
+  http_parser *parser = lhttp_parser_check(L, 1);
+  parser_ctx *ctx = parser->data;
+  int how = (int)luaL_checkinteger(L, 5);
+  const char *chunk = NULL;
+  size_t chunk_len = 0;
+  llhttp_errno_t err = HPE_OK;
+  int run = 1;
+
+  if (how == 1) {
+    ctx->finishing = 1;
+  } else if (how == 0 || how == 3) {
+    size_t offset, length;
+
+    /* the previous chunk of executev completed the last message allowed */
+    if (how == 3 && ctx->messages_full) {
+      lua_pushboolean(L, 0);
+      lua_pushinteger(L, 0);
+      lua_pushstring(L, "max_messages_per_execute");
+      return 3;
+    }
+
+    luaL_checktype(L, 2, LUA_TSTRING);
+    chunk = lua_tolstring(L, 2, &chunk_len);
+    offset = posrelatI(luaL_optinteger(L, 3, 1), chunk_len) - 1;
+    length = getendpos(L, 4, -1, chunk_len);
+    length = length > offset ? length - offset : 0;
+    luaL_argcheck(L, offset <= chunk_len, 3, "Offset is out of bounds");
+
+    ctx->finishing = 0;
+    ctx->y_start = ctx->y_pos = offset;
+    ctx->y_end = offset + length;
+    if (how == 0) {
+      ctx->nmessages = 0;
+      ctx->messages_full = 0;
+    }
+    run = length > 0;
+  } else {
+    int cb = ctx->pending;
+
+    if (!ctx->finishing) chunk = lua_tolstring(L, 2, &chunk_len);
+    if (cb < 0 || (chunk == NULL && !ctx->finishing))
+      return luaL_error(L, "no callback pending");
+
+    lhttp_parser_callback_result(L, parser, cb, 6,
+                                 chunk ? chunk + ctx->y_pos : NULL);
+    /* nothing left but a span llhttp would flush again as empty */
+    run = ctx->y_pos < ctx->y_end || parser->_span_pos0 == NULL ||
+          parser->error;
+    if (cb == LHP_CB_MESSAGE_COMPLETE && !ctx->finishing && !parser->error &&
+        lhttp_parser_count_message(ctx))
+      run = 0;
+  }
+  /* a new start drops a call left behind by an abandoned coroutine */
+  ctx->pending = -1;
+
+  lua_settop(L, 2);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->cb_ref);
+  ctx->cb_index = 3;
+  ctx->L = L;
+  ctx->input = ctx->finishing ? 0 : 2;
+  ctx->input_base = chunk;
+  ctx->input_end = chunk ? chunk + ctx->y_end : NULL;
+
+  if (ctx->finishing) {
+    err = how == 1 ? llhttp_finish(parser) : llhttp_get_errno(parser);
+    lhttp_parser_count_error(ctx, err);
+  }
+  else if (run)
+    err = lhttp_parser_run(parser, ctx, chunk + ctx->y_pos,
+                           ctx->y_end - ctx->y_pos);
+
+  ctx->L = NULL;
+  ctx->input = 0;
+
+  /* a callback is due: the stack holds parser, data, callbacks, callback
+   * and its arguments */
+  if (ctx->pending >= 0) {
+    if (!ctx->finishing) {
+      ctx->y_pos = llhttp_get_error_pos(parser) - chunk;
+      llhttp_resume(parser);
+    }
+    lua_pushboolean(L, 1);
+    lua_replace(L, 3);
+    lua_pushstring(L, lhttp_parser_cb_names[ctx->pending]);
+    lua_insert(L, 4);
+    return lua_gettop(L) - 2;
+  }
+
+  lua_pushboolean(L, 0);
+  if (ctx->finishing) {
+    if (err != HPE_OK && err != HPE_PAUSED) {
+      lua_pushnil(L);
+      lua_pushstring(L, llhttp_errno_name(err));
+      return 3;
+    }
+    lua_pushinteger(L, 0);
+    return 2;
+  }
+
+  if (err != HPE_OK && err != HPE_PAUSED && err != HPE_PAUSED_UPGRADE &&
+      err != HPE_STRICT) {
+    lua_pushnil(L);
+    lua_pushstring(L, llhttp_errno_name(err));
+    return 3;
+  }
+  if (err != HPE_OK)
+    ctx->y_pos = llhttp_get_error_pos(parser) - chunk;
+  else if (run)
+    ctx->y_pos = ctx->y_end;
+  lua_pushnumber(L, ctx->y_pos - ctx->y_start);
+  lua_pushstring(L, lhttp_parser_status(parser, ctx, err,
+                                        ctx->y_pos < ctx->y_end));
+  return 3;
+}
+
+/* execute and finish of yieldable parsers, called with lhttp_parser_step */
+static const char lhttp_parser_driver[] =
+    "local step = ...\n"
+    "local pcall, tostring = pcall, tostring\n"
+    "local stderr = io and io.stderr\n"
+    "local drive\n"
+    "local function call(self, data, name, fn, ...)\n"
+    "  local ok, ret = pcall(fn, ...)\n"
+    "  if not ok and stderr then\n"
+    "    stderr:write('Error while calling ', name, ': ', tostring(ret), '\\n')\n"
+    "  end\n"
+    "  return drive(self, data, step(self, data, nil, nil, 2, ok, ret))\n"
+    "end\n"
+    "function drive(self, data, due, ...)\n"
+    "  if due then return call(self, data, ...) end\n"
+    "  return ...\n"
+    "end\n"
+    "local function execute(self, data, i, j)\n"
+    "  return drive(self, data, step(self, data, i, j, 0))\n"
+    "end\n"
+    "local function executev(self, chunks)\n"
+    "  local total, n = 0, #chunks\n"
+    "  for i = 1, n do\n"
+    "    local data = chunks[i]\n"
+    "    local nparsed, err = drive(self, data,\n"
+    "                               step(self, data, 1, -1, i == 1 and 0 or 3))\n"
+    "    if not nparsed then return nil, err, i end\n"
+    "    total = total + nparsed\n"
+    "    if nparsed < #data or err == 'max_messages_per_execute' then\n"
+    "      return total, err, i\n"
+    "    end\n"
+    "    if err ~= 'HPE_OK' then return total, err, i + 1 end\n"
+    "  end\n"
+    "  return total, 'HPE_OK', n + 1\n"
+    "end\n"
+    "local function finish(self)\n"
+    "  return drive(self, nil, step(self, nil, nil, nil, 1))\n"
+    "end\n"
+    "return execute, executev, finish\n";
+
+/***
+ * Get the parser statistics
+ *
+ * Counters since the parser was created, or released to its pool.
+ *
+ * @function parser:stats
+ * @treturn table `bytes` parsed, `messages` completed, `callbacks` mapping
+ * callback names to the number of calls, `errors` mapping error names to
+ * their count. With the `profile` option also `callback_ns` and
+ * `execute_ns`, nanoseconds spent in Lua callbacks and in llhttp, and
+ * `max_header_block`, the largest size of the header names and values of a
+ * message
+ * @usage
+ * local stats = parser:stats()
+ * print(stats.messages, stats.callbacks.onBody, stats.errors.HPE_USER)
+ */
+static int lhttp_parser_stats(lua_State *L) {
+  http_parser *parser = lhttp_parser_check(L, 1);
+  parser_ctx *ctx = parser->data;
+  int i;
+
+  lua_createtable(L, 0, 7);
+  lua_pushnumber(L, (lua_Number)ctx->stats.bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, (lua_Number)ctx->stats.messages);
+  lua_setfield(L, -2, "messages");
+
+  lua_createtable(L, 0, LHP_CB_MAX);
+  for (i = 0; i < LHP_CB_MAX; i++) {
+    if (!ctx->stats.callbacks[i]) continue;
+    lua_pushnumber(L, (lua_Number)ctx->stats.callbacks[i]);
+    lua_setfield(L, -2, lhttp_parser_cb_names[i]);
+  }
+  lua_setfield(L, -2, "callbacks");
+
+  lua_newtable(L);
+  for (i = 0; i < LHP_ERRNO_MAX; i++) {
+    if (!ctx->stats.errors[i]) continue;
+    lua_pushnumber(L, (lua_Number)ctx->stats.errors[i]);
+    lua_setfield(L, -2, llhttp_errno_name((llhttp_errno_t)i));
+  }
+  lua_setfield(L, -2, "errors");
+
+  if (ctx->profile) {
+    lua_pushnumber(L, (lua_Number)ctx->stats.callback_ns);
+    lua_setfield(L, -2, "callback_ns");
+    lua_pushnumber(L, (lua_Number)ctx->stats.execute_ns);
+    lua_setfield(L, -2, "execute_ns");
+    lua_pushnumber(L, (lua_Number)ctx->stats.max_header_block);
+    lua_setfield(L, -2, "max_header_block");
+  }
+  return 1;
+}
+
+/* Histogram as a table: count, sum and buckets, the upper bound of each
+ * bucket mapped to the number of values up to it, without the empty ones */
+static void lhttp_parser_push_hist(lua_State *L, lhttp_parser_hist *h) {
+  uint64_t total = 0;
+  int k;
+
+  lua_createtable(L, 0, 3);
+  lua_pushnumber(L, (lua_Number)LHP_METRIC_GET(h->count));
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, (lua_Number)LHP_METRIC_GET(h->sum));
+  lua_setfield(L, -2, "sum");
+  lua_newtable(L);
+  for (k = 0; k < LHP_HIST_BUCKETS - 1; k++) {
+    uint64_t n = LHP_METRIC_GET(h->buckets[k]);
+
+    if (n == 0) continue;
+    total += n;
+    lua_pushnumber(L, (lua_Number)total);
+    lua_rawseti(L, -2, 1 << k);
+  }
+  lua_setfield(L, -2, "buckets");
+}
+
+static void lhttp_parser_add_hist(luaL_Buffer *b, const char *name,
+                                  lhttp_parser_hist *h) {
+  char line[128];
+  uint64_t total = 0;
+  int k;
+
+  snprintf(line, sizeof(line), "# TYPE %s histogram\n", name);
+  luaL_addstring(b, line);
+  for (k = 0; k < LHP_HIST_BUCKETS - 1; k++) {
+    total += LHP_METRIC_GET(h->buckets[k]);
+    snprintf(line, sizeof(line), "%s_bucket{le=\"%llu\"} %llu\n", name,
+             1ull << k, (unsigned long long)total);
+    luaL_addstring(b, line);
+  }
+  /* one line per snprintf, the longest name only just fits */
+  snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", name,
+           (unsigned long long)LHP_METRIC_GET(h->count));
+  luaL_addstring(b, line);
+  snprintf(line, sizeof(line), "%s_sum %llu\n", name,
+           (unsigned long long)LHP_METRIC_GET(h->sum));
+  luaL_addstring(b, line);
+  snprintf(line, sizeof(line), "%s_count %llu\n", name,
+           (unsigned long long)LHP_METRIC_GET(h->count));
+  luaL_addstring(b, line);
+}
+
+static void lhttp_parser_add_metric(luaL_Buffer *b, const char *name,
+                                    const char *label, const char *value,
+                                    uint64_t n) {
+  char line[160];
+
+  if (label)
+    snprintf(line, sizeof(line), "%s{%s=\"%s\"} %llu\n", name, label, value,
+             (unsigned long long)n);
+  else
+    snprintf(line, sizeof(line), "%s %llu\n", name, (unsigned long long)n);
+  luaL_addstring(b, line);
+}
+
+static const char *const lhttp_parser_status_classes[6] = {
+    "other", "1xx", "2xx", "3xx", "4xx", "5xx"};
+
+/***
+ * Get the module metrics
+ *
+ * Aggregates of every parser of the process, whatever the Lua state they
+ * were created in. The histograms of header block sizes and per message
+ * parse times are fed by parsers with the `profile` option.
+ *
+ * @function metrics
+ * @tparam[opt] string format `'prometheus'` for the text exposition format
+ * @treturn table|string `parsers_created`, `parsers_alive`, `requests` by
+ * method, `responses` by status class, `errors` by error name, and the
+ * histograms `header_block_bytes` and `parse_ns` with `count`, `sum` and
+ * `buckets` (cumulative counts by upper bound); or their Prometheus text
+ * @usage
+ * local m = lhp.metrics()
+ * print(m.requests.GET, m.errors.HPE_INVALID_METHOD)
+ * local text = lhp.metrics('prometheus')
+ */
+static int lhttp_parser_metrics_get(lua_State *L) {
+  const char *format = luaL_optstring(L, 1, "table");
+  int i;
+
+  if (strcmp(format, "prometheus") == 0) {
+    luaL_Buffer b;
+
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, "# TYPE lhttp_parser_parsers_created_total counter\n");
+    lhttp_parser_add_metric(
+        &b, "lhttp_parser_parsers_created_total", NULL, NULL,
+        LHP_METRIC_GET(lhttp_parser_metrics.parsers_created));
+    luaL_addstring(&b, "# TYPE lhttp_parser_parsers_alive gauge\n");
+    lhttp_parser_add_metric(&b, "lhttp_parser_parsers_alive", NULL, NULL,
+                            LHP_METRIC_GET(lhttp_parser_metrics.parsers_alive));
+
+    luaL_addstring(&b, "# TYPE lhttp_parser_requests_total counter\n");
+    for (i = 0; i < LHP_METHOD_MAX; i++) {
+      uint64_t n = LHP_METRIC_GET(lhttp_parser_metrics.requests[i]);
+
+      if (n)
+        lhttp_parser_add_metric(&b, "lhttp_parser_requests_total", "method",
+                                llhttp_method_name((llhttp_method_t)i), n);
+    }
+    luaL_addstring(&b, "# TYPE lhttp_parser_responses_total counter\n");
+    for (i = 0; i < 6; i++) {
+      uint64_t n = LHP_METRIC_GET(lhttp_parser_metrics.responses[i]);
+
+      if (n)
+        lhttp_parser_add_metric(&b, "lhttp_parser_responses_total", "class",
+                                lhttp_parser_status_classes[i], n);
+    }
+    luaL_addstring(&b, "# TYPE lhttp_parser_errors_total counter\n");
+    for (i = 0; i < LHP_ERRNO_MAX; i++) {
+      uint64_t n = LHP_METRIC_GET(lhttp_parser_metrics.errors[i]);
+
+      if (n)
+        lhttp_parser_add_metric(&b, "lhttp_parser_errors_total", "code",
+                                llhttp_errno_name((llhttp_errno_t)i), n);
+    }
+    lhttp_parser_add_hist(&b, "lhttp_parser_header_block_bytes",
+                          &lhttp_parser_metrics.header_block);
+    lhttp_parser_add_hist(&b, "lhttp_parser_parse_nanoseconds",
+                          &lhttp_parser_metrics.parse_ns);
+    luaL_pushresult(&b);
+    return 1;
+  }
+  luaL_argcheck(L, strcmp(format, "table") == 0, 1,
+                "format must be 'table' or 'prometheus'");
+
+  lua_createtable(L, 0, 7);
+  lua_pushnumber(
+      L, (lua_Number)LHP_METRIC_GET(lhttp_parser_metrics.parsers_created));
+  lua_setfield(L, -2, "parsers_created");
+  lua_pushnumber(
+      L, (lua_Number)LHP_METRIC_GET(lhttp_parser_metrics.parsers_alive));
+  lua_setfield(L, -2, "parsers_alive");
+
+  lua_newtable(L);
+  for (i = 0; i < LHP_METHOD_MAX; i++) {
+    uint64_t n = LHP_METRIC_GET(lhttp_parser_metrics.requests[i]);
+
+    if (!n) continue;
+    lua_pushnumber(L, (lua_Number)n);
+    lua_setfield(L, -2, llhttp_method_name((llhttp_method_t)i));
+  }
+  lua_setfield(L, -2, "requests");
+
+  lua_newtable(L);
+  for (i = 0; i < 6; i++) {
+    uint64_t n = LHP_METRIC_GET(lhttp_parser_metrics.responses[i]);
+
+    if (!n) continue;
+    lua_pushnumber(L, (lua_Number)n);
+    lua_setfield(L, -2, lhttp_parser_status_classes[i]);
+  }
+  lua_setfield(L, -2, "responses");
+
+  lua_newtable(L);
+  for (i = 0; i < LHP_ERRNO_MAX; i++) {
+    uint64_t n = LHP_METRIC_GET(lhttp_parser_metrics.errors[i]);
+
+    if (!n) continue;
+    lua_pushnumber(L, (lua_Number)n);
+    lua_setfield(L, -2, llhttp_errno_name((llhttp_errno_t)i));
+  }
+  lua_setfield(L, -2, "errors");
+
+  lhttp_parser_push_hist(L, &lhttp_parser_metrics.header_block);
+  lua_setfield(L, -2, "header_block_bytes");
+  lhttp_parser_push_hist(L, &lhttp_parser_metrics.parse_ns);
+  lua_setfield(L, -2, "parse_ns");
+  return 1;
+}
+
+/***
+ * Change the parser configuration
+ *
+ * Updates the limits, lenient flags and `profile` described in `new`, fields
+ * absent
+ * from the table keep their value. The configuration is kept across
+ * `reset`.
+ *
+ * @function parser:configure
+ * @tparam table config Limits and lenient flags
+ * @treturn userdata The parser
+ * @usage parser:configure({ lenient_headers = true, max_headers = 64 })
+ */
+static int lhttp_parser_configure(lua_State *L) {
+  http_parser *parser = lhttp_parser_check(L, 1);
+  parser_ctx *ctx = parser->data;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lhttp_parser_config(L, 2, ctx);
+  lhttp_parser_apply_config(parser, ctx);
+  lua_pushvalue(L, 1);
   return 1;
 }
 
@@ -454,7 +2916,7 @@ static int lhttp_parser_finish(lua_State *L) {
  * @usage parser:reset()
  */
 static int lhttp_parser_reset(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
 
   llhttp_reset(parser);
   return 1;
@@ -462,26 +2924,26 @@ static int lhttp_parser_reset(lua_State *L) {
 
 /******************************************************************************/
 static int lhttp_parser_http_version(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
   lua_pushinteger(L, parser->http_major);
   lua_pushinteger(L, parser->http_minor);
   return 2;
 }
 
 static int lhttp_parser_status_code(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
   lua_pushinteger(L, parser->status_code);
   return 1;
 }
 
 static int lhttp_parser_method(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
   lua_pushstring(L, llhttp_method_name(parser->method));
   return 1;
 }
 
 static int lhttp_parser_http_errno(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
   llhttp_errno_t http_errno = llhttp_get_errno(parser);
   lua_pushnumber(L, http_errno);
   lua_pushstring(L, llhttp_errno_name(http_errno));
@@ -491,26 +2953,26 @@ static int lhttp_parser_http_errno(lua_State *L) {
 }
 
 static int lhttp_parser_upgrade(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
   lua_pushboolean(L, parser->upgrade);
   return 1;
 }
 
 static int lhttp_parser_should_keep_alive(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
   lua_pushboolean(L, llhttp_should_keep_alive(parser));
   return 1;
 }
 
 static int lhttp_parser_pause(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
   llhttp_pause(parser);
   lua_pushvalue(L, 1);
   return 1;
 }
 
 static int lhttp_parser_resume(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
   llhttp_resume(parser);
   llhttp_set_error_reason(parser, NULL);
   lua_pushvalue(L, 1);
@@ -518,7 +2980,7 @@ static int lhttp_parser_resume(lua_State *L) {
 }
 
 static int lhttp_resume_after_upgrade(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
   llhttp_resume_after_upgrade(parser);
   llhttp_set_error_reason(parser, NULL);
   lua_pushvalue(L, 1);
@@ -526,24 +2988,246 @@ static int lhttp_resume_after_upgrade(lua_State *L) {
 }
 
 static int lhttp_parser_tostring(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
   lua_pushfstring(L, "lhttp_parser %p", parser);
   return 1;
 }
 
 static int lhttp_parser_gc(lua_State *L) {
-  http_parser *parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser *parser = lhttp_parser_check(L, 1);
+  parser_ctx *ctx = parser->data;
+
+  if (ctx) {
+    LHP_METRIC_ADD(lhttp_parser_metrics.parsers_alive, (uint64_t)-1);
+    lhttp_parser_release_callbacks(L, ctx);
+    luaL_unref(L, LUA_REGISTRYINDEX, ctx->names_ref);
+    ctx->names_ref = LUA_NOREF;
+    luaL_unref(L, LUA_REGISTRYINDEX, ctx->info_ref);
+    ctx->info_ref = LUA_NOREF;
+    lhp_buf_free(&ctx->head);
+    lhp_buf_free(&ctx->line);
+    lhp_buf_free(&ctx->body);
+    lhp_buf_free(&ctx->url);
+    lhp_buf_free(&ctx->rbuf);
+    free(ctx->headers);
+    ctx->headers = NULL;
+    ctx->nheaders = ctx->headers_size = 0;
+  }
+
+  return 0;
+}
+
+/******************************************************************************/
+/* Parser pools: parsers released to a pool are reset and handed out again
+ * by acquire, so steady connection churn allocates nothing */
+
+#define LHP_POOL "lhttp_parser.pool"
+
+typedef struct {
+  int args_ref;           /* registry ref of {type, callbacks, options} */
+  int free_ref;           /* registry ref of the free list */
+  int size;               /* free parsers kept at most */
+  int nfree;
+} lhttp_parser_pool_t;
+
+/* Create a parser as lhp.new(type, callbacks, options) would, owned by the
+ * pool at index idx */
+static void lhttp_parser_pool_new(lua_State *L, int idx,
+                                  lhttp_parser_pool_t *pool) {
+  http_parser *parser;
+  int i;
+
+  lua_pushcfunction(L, lhttp_parser_new);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pool->args_ref);
+  for (i = 1; i <= 2; i++) lua_rawgeti(L, -i, i);
+  /* the context of a callback set is given by acquire */
+  if (lhttp_parser_to_handlers(L, -1)) {
+    lua_pushnil(L);
+    lua_rawgeti(L, -4, 3);
+    lua_remove(L, -5);
+    lua_call(L, 4, 1);
+  } else {
+    lua_rawgeti(L, -3, 3);
+    lua_remove(L, -4);
+    lua_call(L, 3, 1);
+  }
+
+  parser = lua_touserdata(L, -1);
+  ((parser_ctx *)parser->data)->pool = lua_topointer(L, idx);
+}
+
+/***
+ * Create a pool of parsers
+ *
+ * Released parsers are reset and kept on a free list, `acquire` hands them
+ * out again before creating new ones, which saves the allocation and the
+ * garbage collection of a parser per connection.
+ *
+ * @function pool
+ * @tparam string type Parser type, as for `new`
+ * @tparam table|userdata callbacks Callbacks of all the parsers, a table or
+ * a callback set from `handlers`
+ * @tparam number size Number of free parsers kept at most
+ * @tparam[opt] table options Options of all the parsers, as for `new`
+ * @treturn userdata New pool object
+ * @usage
+ * local pool = lhp.pool('request', callbacks, 256)
+ * local parser = pool:acquire()
+ * -- serve the connection
+ * pool:release(parser)
+ */
+static int lhttp_parser_pool(lua_State *L) {
+  lhttp_parser_pool_t *pool;
+  int size = (int)luaL_checkinteger(L, 3);
+
+  luaL_argcheck(L, size >= 0, 3, "size must not be negative");
+  lua_settop(L, 4);
+
+  pool = lua_newuserdata(L, sizeof(*pool));
+  pool->args_ref = pool->free_ref = LUA_NOREF;
+  pool->size = size;
+  pool->nfree = 0;
+  luaL_getmetatable(L, LHP_POOL);
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, 3, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, 2);
+  lua_pushvalue(L, 4);
+  lua_rawseti(L, -2, 3);
+  pool->args_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_createtable(L, size, 0);
+  pool->free_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  /* a first parser checks the arguments now rather than at acquire */
+  lhttp_parser_pool_new(L, 5, pool);
+  if (size > 0) {
+    http_parser *parser = lua_touserdata(L, -1);
+
+    ((parser_ctx *)parser->data)->pooled = 1;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pool->free_ref);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, ++pool->nfree);
+  }
+  lua_settop(L, 5);
+  return 1;
+}
+
+/***
+ * Take a parser from the pool
+ *
+ * @function pool:acquire
+ * @param[opt] context Context of the parser, when the pool was created with
+ * a callback set from `handlers`
+ * @treturn userdata A parser ready for a new connection
+ */
+static int lhttp_parser_pool_acquire(lua_State *L) {
+  lhttp_parser_pool_t *pool = luaL_checkudata(L, 1, LHP_POOL);
+  http_parser *parser;
+  parser_ctx *ctx;
+
+  lua_settop(L, 2);
+  if (pool->nfree == 0) {
+    lhttp_parser_pool_new(L, 1, pool);
+  } else {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pool->free_ref);
+    lua_rawgeti(L, -1, pool->nfree);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, pool->nfree--);
+  }
+  parser = lua_touserdata(L, -1);
+  ctx = parser->data;
+  ctx->pooled = 0;
+
+  if (ctx->flags & LHP_F_CONTEXT) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ctx->ctx_ref);
+    lua_pushvalue(L, 2);
+    ctx->ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  return 1;
+}
+
+/***
+ * Give a parser back to the pool
+ *
+ * The parser is reset, with the options of the pool in place of whatever
+ * `parser:configure` changed, and it must not be used after this call. When
+ * the pool already holds `size` free parsers, it is left to the garbage
+ * collector.
+ *
+ * @function pool:release
+ * @tparam userdata parser A parser from `acquire`
+ */
+static int lhttp_parser_pool_release(lua_State *L) {
+  lhttp_parser_pool_t *pool = luaL_checkudata(L, 1, LHP_POOL);
+  http_parser *parser = lhttp_parser_check(L, 2);
   parser_ctx *ctx = parser->data;
 
-  /* Only unref if ref is valid */
-  if (ctx && ctx->ref != LUA_NOREF && ctx->ref != LUA_REFNIL) {
-    luaL_unref(L, LUA_REGISTRYINDEX, ctx->ref);
-    ctx->ref = LUA_NOREF;
+  luaL_argcheck(L, ctx->pool == (const void *)pool, 2,
+                "parser does not belong to this pool");
+  luaL_argcheck(L, !ctx->pooled, 2, "parser already released");
+
+  llhttp_reset(parser);
+  ctx->pending = -1;
+  ctx->rbuf.len = 0;
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  /* undo parser:configure(), llhttp_reset keeps the lenient flags */
+  ctx->max_url = ctx->max_header_bytes = ctx->max_headers = 0;
+  ctx->max_body = ctx->max_messages = 0;
+  ctx->profile = 0;
+  ctx->lenient = 0;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pool->args_ref);
+  lua_rawgeti(L, -1, 3);
+  lhttp_parser_config(L, lua_gettop(L), ctx);
+  lua_pop(L, 2);
+  lhttp_parser_apply_config(parser, ctx);
+  /* and drop what the connection left of its last message */
+  ctx->messages_full = ctx->in_message = 0;
+  ctx->nmessages = 0;
+  ctx->url_len = ctx->header_bytes = ctx->nfields = ctx->body_len = 0;
+  ctx->url.len = 0;
+  ctx->url_at = NULL;
+  lhttp_parser_clear_message(ctx);
+  /* do not keep the connection alive from the free list */
+  if (ctx->flags & LHP_F_CONTEXT) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ctx->ctx_ref);
+    ctx->ctx_ref = LUA_REFNIL;
   }
+  if (pool->nfree < pool->size) {
+    lua_settop(L, 2);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pool->free_ref);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, ++pool->nfree);
+    ctx->pooled = 1;
+  }
+  return 0;
+}
+
+static int lhttp_parser_pool_gc(lua_State *L) {
+  lhttp_parser_pool_t *pool = luaL_checkudata(L, 1, LHP_POOL);
 
+  luaL_unref(L, LUA_REGISTRYINDEX, pool->args_ref);
+  pool->args_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, pool->free_ref);
+  pool->free_ref = LUA_NOREF;
+  pool->nfree = 0;
   return 0;
 }
 
+static const luaL_Reg lhttp_request_m[] = {
+    {"query", lhttp_request_query},
+    {"header", lhttp_request_header},
+
+    {NULL, NULL}};
+
+static const luaL_Reg lhttp_parser_pool_m[] = {
+    {"acquire", lhttp_parser_pool_acquire},
+    {"release", lhttp_parser_pool_release},
+
+    {NULL, NULL}};
+
 /******************************************************************************/
 static const luaL_Reg lhttp_parser_m[] = {
     {"http_version", lhttp_parser_http_version},
@@ -553,60 +3237,27 @@ static const luaL_Reg lhttp_parser_m[] = {
     {"upgrade", lhttp_parser_upgrade},
     {"should_keep_alive", lhttp_parser_should_keep_alive},
     {"execute", lhttp_parser_execute},
+    {"executev", lhttp_parser_executev},
+    {"read_fd", lhttp_parser_read_fd},
+    {"buffered", lhttp_parser_buffered},
     {"finish", lhttp_parser_finish},
     {"pause", lhttp_parser_pause},
     {"resume", lhttp_parser_resume},
     {"resume_after_upgrade", lhttp_resume_after_upgrade},
     {"reset", lhttp_parser_reset},
+    {"configure", lhttp_parser_configure},
+    {"stats", lhttp_parser_stats},
 
     {NULL, NULL}};
 
 static const luaL_Reg lhttp_parser_f[] = {{"new", lhttp_parser_new},
+                                          {"pool", lhttp_parser_pool},
+                                          {"handlers", lhttp_parser_handlers},
+                                          {"metrics", lhttp_parser_metrics_get},
                                           {NULL, NULL}};
 
 LUALIB_API int luaopen_lhttp_parser(lua_State *L) {
 
-  /* This needs to be done sometime? */
-  llhttp_settings_init(&lhttp_parser_settings);
-  lhttp_parser_settings.on_message_begin = lhttp_parser_on_message_begin;
-  lhttp_parser_settings.on_message_complete = lhttp_parser_on_message_complete;
-  lhttp_parser_settings.on_url = lhttp_parser_on_url;
-  lhttp_parser_settings.on_status = lhttp_parser_on_status;
-  lhttp_parser_settings.on_header_field = lhttp_parser_on_header_field;
-  lhttp_parser_settings.on_header_value = lhttp_parser_on_header_value;
-  lhttp_parser_settings.on_headers_complete = lhttp_parser_on_headers_complete;
-  lhttp_parser_settings.on_body = lhttp_parser_on_body;
-  lhttp_parser_settings.on_chunk_header = lhttp_parser_on_chunk_header;
-  lhttp_parser_settings.on_chunk_complete = lhttp_parser_on_chunk_complete;
-
-  lhttp_parser_settings.on_reset = lhttp_parser_on_reset;
-
-  /*
-  lhttp_parser_settings.on_url_complete = lhttp_parser_on_url_complete;
-  lhttp_parser_settings.on_method_complete = lhttp_parser_on_method_complete;
-  lhttp_parser_settings.on_status_complete = lhttp_parser_on_status_complete;
-  lhttp_parser_settings.on_version_complete = lhttp_parser_on_version_complete;
-
-  lhttp_parser_settings.on_header_field_complete =
-  lhttp_parser_on_header_field_complete;
-  lhttp_parser_settings.on_header_value_complete =
-  lhttp_parser_on_header_value_complete;
-
-  lhttp_parser_settings.on_chunk_header = lhttp_parser_on_chunk_header;
-  lhttp_parser_settings.on_chunk_extension_name_complete =
-  lhttp_parser_on_chunk_extension_name_complete;
-  lhttp_parser_settings.on_chunk_extension_value_complete =
-  lhttp_parser_on_chunk_extension_value_complete;
-
-  lhttp_parser_settings.on_chunk_extension_name =
-  lhttp_parser_on_chunk_extension_name;
-  lhttp_parser_settings.on_chunk_extension_value =
-  lhttp_parser_on_chunk_extension_value;
-
-  lhttp_parser_settings.on_method = lhttp_parser_on_method;
-  lhttp_parser_settings.on_version = lhttp_parser_on_version;
-  */
-
   /* Create a metatable for the lhttp_parser userdata type */
   luaL_newmetatable(L, "lhttp_parser");
   lua_pushcfunction(L, lhttp_parser_tostring);
@@ -618,7 +3269,54 @@ LUALIB_API int luaopen_lhttp_parser(lua_State *L) {
   lua_setfield(L, -2, "__index");
   lua_pop(L, 1);
 
-  /* Put our one function on it */
+  /* Yieldable parsers have the same methods, but execute and finish are
+   * the Lua driver */
+  luaL_newmetatable(L, LHP_YIELDABLE);
+  lua_pushcfunction(L, lhttp_parser_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, lhttp_parser_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_newtable(L);
+  luaL_setfuncs(L, lhttp_parser_m, 0);
+  if (luaL_loadbuffer(L, lhttp_parser_driver, sizeof(lhttp_parser_driver) - 1,
+                      "=lhttp_parser") != 0)
+    return lua_error(L);
+  lua_pushcfunction(L, lhttp_parser_step);
+  lua_call(L, 1, 3);
+  lua_setfield(L, -4, "finish");
+  lua_setfield(L, -3, "executev");
+  lua_setfield(L, -2, "execute");
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LHP_HANDLERS);
+  lua_pushcfunction(L, lhttp_parser_handlers_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LHP_REQUEST);
+  lua_newtable(L);
+  luaL_setfuncs(L, lhttp_request_m, 0);
+  lua_pushcclosure(L, lhttp_request_index, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LHP_REQUEST_HEADERS);
+  lua_pushcfunction(L, lhttp_request_headers_index);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, lhttp_request_headers_len);
+  lua_setfield(L, -2, "__len");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LHP_POOL);
+  lua_pushcfunction(L, lhttp_parser_pool_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_newtable(L);
+  luaL_setfuncs(L, lhttp_parser_pool_m, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  /* Put our functions on it */
   luaL_newlib(L, lhttp_parser_f);
 
   #define XX(x) lua_pushliteral(L, #x); lua_pushinteger(L, HPE_##x); lua_rawset(L, -3);
@@ -660,6 +3358,19 @@ LUALIB_API int luaopen_lhttp_parser(lua_State *L) {
   XX(CB_RESET);
   #undef XX
 
+  /* Bits of the flags given to onHeadersComplete with info = 'args' */
+  #define XX(x) lua_pushliteral(L, "F_" #x); lua_pushinteger(L, F_##x); lua_rawset(L, -3);
+  XX(CONNECTION_KEEP_ALIVE);
+  XX(CONNECTION_CLOSE);
+  XX(CONNECTION_UPGRADE);
+  XX(CHUNKED);
+  XX(UPGRADE);
+  XX(CONTENT_LENGTH);
+  XX(SKIPBODY);
+  XX(TRAILING);
+  XX(TRANSFER_ENCODING);
+  #undef XX
+
   /* Stick version info on the http_parser table */
   lua_pushnumber(L, LLHTTP_VERSION_MAJOR);
   lua_setfield(L, -2, "VERSION_MAJOR");
@@ -670,6 +3381,26 @@ LUALIB_API int luaopen_lhttp_parser(lua_State *L) {
   lua_pushboolean(L, 1);
   lua_setfield(L, -2, "llhttp");
 
+  /* Well-known header names: the pre-created strings handed to parsers
+   * with header_ids, and HEADERS mapping name -> ID and ID -> name */
+  lua_createtable(L, LHP_H_MAX - 1, 0);
+  lua_createtable(L, LHP_H_MAX - 1, LHP_H_MAX - 1);
+  {
+    int id;
+    for (id = 1; id < LHP_H_MAX; id++) {
+      lua_pushlstring(L, lhttp_parser_header_names[id],
+                      lhttp_parser_header_lens[id]);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, -4, id);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, -3, id);
+      lua_pushinteger(L, id);
+      lua_rawset(L, -3);
+    }
+  }
+  lua_setfield(L, -3, "HEADERS");
+  lua_setfield(L, LUA_REGISTRYINDEX, LHP_HEADER_NAMES);
+
   /* Return the new module */
   return 1;
 }
@@ -25,5 +25,7 @@
 
 LUALIB_API int luaopen_lhttp_parser (lua_State *L);
 LUALIB_API int luaopen_lhttp_url (lua_State *L);
+LUALIB_API int luaopen_lhttp_writer (lua_State *L);
+LUALIB_API int luaopen_lhttp_server (lua_State *L);
 
 #endif
@@ -0,0 +1,54 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/* USDT probes of provider `lhttp_parser`, compiled in with `make USDT=1`
+ * (needs <sys/sdt.h>, e.g. from systemtap-sdt-dev). Without it they expand
+ * to nothing. When built in, a probe nobody traces costs a nop.
+ *
+ *   message_begin
+ *   headers_complete   method, URL length, header count
+ *   message_complete   body bytes
+ *   parse_error        llhttp errno, offset in the data of the execute call
+ *   parse_url_entry    buffer, length
+ *   parse_url_return   result, 0 on success
+ *   query_parse_entry  query, length
+ *   query_parse_return result, LQE_OK on success
+ *
+ * e.g. bpftrace -e 'usdt:./lhttp_parser.so:lhttp_parser:parse_error
+ *                   { @[arg0] = count(); }'
+ */
+
+#ifndef LHTTP_PROBES_H
+#define LHTTP_PROBES_H
+
+#ifdef LHTTP_USDT
+#include <sys/sdt.h>
+
+#define LHTTP_USDT_ENABLED 1
+#define LHTTP_PROBE(name) DTRACE_PROBE(lhttp_parser, name)
+#define LHTTP_PROBE1(name, a) DTRACE_PROBE1(lhttp_parser, name, a)
+#define LHTTP_PROBE2(name, a, b) DTRACE_PROBE2(lhttp_parser, name, a, b)
+#define LHTTP_PROBE3(name, a, b, c) DTRACE_PROBE3(lhttp_parser, name, a, b, c)
+#else
+#define LHTTP_USDT_ENABLED 0
+#define LHTTP_PROBE(name) ((void)0)
+#define LHTTP_PROBE1(name, a) ((void)0)
+#define LHTTP_PROBE2(name, a, b) ((void)0)
+#define LHTTP_PROBE3(name, a, b, c) ((void)0)
+#endif
+
+#endif /* LHTTP_PROBES_H */
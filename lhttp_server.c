@@ -0,0 +1,1583 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/***
+ * Native HTTP/1.1 server core
+ *
+ * An epoll edge-triggered loop in C accepts connections, reads them with
+ * `parser:read_fd` into parsers from a pool and sends the responses with
+ * vectored writes. Lua runs once per request: the handler gets the request
+ * object of the `request` parser option and returns the response, which is
+ * serialized by lhttp_writer. Linux only.
+ *
+ * @module lhttp_server
+ * @license Apache License 2.0
+ * @copyright 2012 The Luvit Authors
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* accept4, pthread_setaffinity_np */
+#endif
+
+#include "lhttp_parser.h"
+#include "lhttp_writer.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <lualib.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#if LUA_VERSION_NUM < 502
+#ifndef lua_rawlen
+#define lua_rawlen lua_objlen
+#endif
+#ifndef luaL_newlib
+#define luaL_newlib(L, l) (lua_newtable(L), luaL_register(L, NULL, l))
+#endif
+#ifndef luaL_setfuncs
+#define luaL_setfuncs(L, l, n) (assert(n == 0), luaL_register(L, NULL, l))
+#endif
+#endif
+
+#ifdef __linux__
+
+#define LHTTP_SERVER "lhttp_server"
+
+#define LHTTP_SERVER_EVENTS 256           /* epoll events per step */
+#define LHTTP_SERVER_IOV 64               /* iovec entries per sendmsg */
+#define LHTTP_SERVER_READ 65536           /* bytes per read_fd */
+#define LHTTP_SERVER_PIN 16384            /* bodies from this size are not copied */
+#define LHTTP_SERVER_HIGH_WATER (1 << 20) /* no reading above this output */
+
+/* Answers of the server itself, the connection closes after them */
+#define LHTTP_SERVER_400                                                      \
+  "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define LHTTP_SERVER_500                                                      \
+  "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n"               \
+  "Connection: close\r\n\r\n"
+
+/* A piece of output: `len` bytes of the connection buffer from `off`, or of
+ * a body string kept alive by `ref` */
+typedef struct {
+  const char *data;       /* NULL for bytes of the buffer */
+  size_t off;
+  size_t len;
+  int ref;
+} lhttp_server_seg;
+
+typedef struct {
+  int fd;
+  int parser_ref;
+  lhttp_wbuf out;         /* heads and small bodies */
+  lhttp_server_seg *segs; /* output in order, from `head` to `nsegs` */
+  int nsegs;
+  int segs_size;
+  int head;
+  size_t head_sent;       /* bytes of segs[head] already sent */
+  size_t pending;         /* bytes queued and not sent */
+  unsigned close_after:1; /* close once the output is sent */
+  unsigned blocked:1;     /* reading stopped above LHTTP_SERVER_HIGH_WATER */
+  unsigned kept:1;        /* the parser holds requests not parsed yet */
+  unsigned hup:1;         /* the peer shut down its side */
+} lhttp_server_conn;
+
+typedef struct {
+  lua_Integer accepted;
+  lua_Integer active;
+  lua_Integer requests;
+  lua_Integer bytes_in;
+  lua_Integer bytes_out;
+  lua_Integer errors;
+} lhttp_server_stats;
+
+typedef struct {
+  int lfd;
+  int epfd;
+  int port;
+  int handler_ref;
+  int error_ref;
+  int respond_ref;
+  int pool_ref;
+  int acquire_ref;
+  int release_ref;
+  int read_ref;
+  lhttp_server_conn **conns; /* by descriptor */
+  int nconns;
+  int stepping;              /* handling events, handlers may run */
+  int stopped;               /* run() returns after this step */
+  lhttp_server_stats stats;
+  struct epoll_event events[LHTTP_SERVER_EVENTS];
+} lhttp_server_t;
+
+/*****************************************************************************/
+/* Listening socket of `host` and `port`, -1 with `*err` set on failure */
+static int lhttp_server_listen(const char *host, int port, int backlog,
+                               int reuseport, const char **err) {
+  struct addrinfo hints, *res, *ai;
+  char service[8];
+  int fd = -1, rc, one = 1, e = 0;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+  snprintf(service, sizeof(service), "%d", port);
+  rc = getaddrinfo(host, service, &hints, &res);
+  if (rc) {
+    *err = gai_strerror(rc);
+    return -1;
+  }
+
+  for (ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                ai->ai_protocol);
+    if (fd < 0) {
+      e = errno;
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ((!reuseport ||
+         setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == 0) &&
+        bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, backlog) == 0)
+      break;
+    e = errno;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd < 0) *err = strerror(e);
+  return fd;
+}
+
+static int lhttp_server_local_port(int fd) {
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+
+  if (getsockname(fd, (struct sockaddr *)&ss, &len)) return -1;
+  if (ss.ss_family == AF_INET6)
+    return ntohs(((struct sockaddr_in6 *)&ss)->sin6_port);
+  return ntohs(((struct sockaddr_in *)&ss)->sin_port);
+}
+
+/*****************************************************************************/
+/* Queue `len` bytes, of the buffer from `off` when `data` is NULL */
+static int lhttp_server_queue(lhttp_server_conn *c, const char *data,
+                              size_t off, size_t len, int ref) {
+  lhttp_server_seg *s;
+
+  if (len == 0) return 0;
+  c->pending += len;
+  /* consecutive bytes of the buffer make one entry */
+  if (data == NULL && c->nsegs > c->head) {
+    s = &c->segs[c->nsegs - 1];
+    if (s->data == NULL && s->off + s->len == off) {
+      s->len += len;
+      return 0;
+    }
+  }
+  if (c->nsegs == c->segs_size) {
+    int size = c->segs_size ? c->segs_size * 2 : 8;
+    s = realloc(c->segs, size * sizeof(*s));
+    if (s == NULL) {
+      c->pending -= len;
+      return -1;
+    }
+    c->segs = s;
+    c->segs_size = size;
+  }
+  s = &c->segs[c->nsegs++];
+  s->data = data;
+  s->off = off;
+  s->len = len;
+  s->ref = ref;
+  return 0;
+}
+
+/* Append and queue an answer of the server, closing the connection */
+static void lhttp_server_answer(lhttp_server_conn *c, const char *answer,
+                                size_t len) {
+  size_t off = c->out.len;
+
+  c->close_after = 1;
+  if (lhttp_wbuf_append(&c->out, answer, len) == LHTTP_W_OK &&
+      lhttp_server_queue(c, NULL, off, len, LUA_NOREF))
+    c->out.len = off;
+}
+
+/* Drop the output queued from entry `nsegs` on, and the buffer from `mark` */
+static void lhttp_server_unqueue(lua_State *L, lhttp_server_conn *c,
+                                 int nsegs, size_t last_len, size_t mark) {
+  while (c->nsegs > nsegs) {
+    lhttp_server_seg *s = &c->segs[--c->nsegs];
+
+    c->pending -= s->len;
+    if (s->data) luaL_unref(L, LUA_REGISTRYINDEX, s->ref);
+  }
+  if (nsegs > c->head) {
+    c->pending -= c->segs[nsegs - 1].len - last_len;
+    c->segs[nsegs - 1].len = last_len;
+  }
+  c->out.len = mark;
+}
+
+/* Send the queued output: 0 when all of it is sent, 1 when the socket is
+ * full, -1 on error */
+static int lhttp_server_flush(lua_State *L, lhttp_server_t *srv,
+                              lhttp_server_conn *c) {
+  while (c->head < c->nsegs) {
+    struct iovec iov[LHTTP_SERVER_IOV];
+    struct msghdr msg;
+    ssize_t sent;
+    int i, n = 0;
+
+    for (i = c->head; i < c->nsegs && n < LHTTP_SERVER_IOV; i++, n++) {
+      const lhttp_server_seg *s = &c->segs[i];
+      const char *p = s->data ? s->data : c->out.data + s->off;
+      size_t skip = i == c->head ? c->head_sent : 0;
+
+      iov[n].iov_base = (void *)(p + skip);
+      iov[n].iov_len = s->len - skip;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    /* sendmsg is writev with flags, a closed peer must not raise SIGPIPE */
+    do {
+      sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+
+    srv->stats.bytes_out += sent;
+    c->pending -= (size_t)sent;
+    while (sent > 0) {
+      lhttp_server_seg *s = &c->segs[c->head];
+      size_t left = s->len - c->head_sent;
+
+      if ((size_t)sent < left) {
+        c->head_sent += (size_t)sent;
+        break;
+      }
+      sent -= (ssize_t)left;
+      c->head_sent = 0;
+      if (s->data) luaL_unref(L, LUA_REGISTRYINDEX, s->ref);
+      c->head++;
+    }
+  }
+  c->head = c->nsegs = 0;
+  c->head_sent = 0;
+  c->out.len = 0;
+  return 0;
+}
+
+/* With `release` the parser goes back to the pool, not from __gc where the
+ * pool may already be collected */
+static void lhttp_server_close_conn(lua_State *L, lhttp_server_t *srv,
+                                    lhttp_server_conn *c, int release) {
+  int i;
+
+  srv->conns[c->fd] = NULL;
+  close(c->fd);
+  for (i = c->head; i < c->nsegs; i++)
+    if (c->segs[i].data) luaL_unref(L, LUA_REGISTRYINDEX, c->segs[i].ref);
+  free(c->segs);
+  lhttp_wbuf_free(&c->out);
+  if (release) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, srv->release_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, srv->pool_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, c->parser_ref);
+    lua_call(L, 2, 0);
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, c->parser_ref);
+  free(c);
+  srv->stats.active--;
+}
+
+/*****************************************************************************/
+/* Call the handler with the request at 3 and queue its response, under
+ * lua_pcall with the server and the connection at 1 and 2 */
+static int lhttp_server_respond(lua_State *L) {
+  lhttp_server_t *srv = lua_touserdata(L, 1);
+  lhttp_server_conn *c = lua_touserdata(L, 2);
+  size_t mark, blen = 0;
+  const char *body;
+  const char *method;
+  int head_only;
+
+  lua_settop(L, 3);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, srv->handler_ref);
+  lua_pushvalue(L, 3);
+  lua_call(L, 1, 3);
+  /* without a body the response would run to the close, an empty one gets
+   * Content-Length: 0 unless the handler framed it */
+  if (lua_isnil(L, 6)) {
+    lua_pushliteral(L, "");
+    lua_replace(L, 6);
+  }
+  lua_getfield(L, 3, "method");
+  method = lua_tostring(L, 7);
+  head_only = method && strcmp(method, "HEAD") == 0;
+
+  /* the head is written with the body left out, then the body is copied
+   * when small and referenced when large */
+  mark = c->out.len;
+  lhttp_writer_lua_response(L, &c->out, 4, 1);
+  if (lhttp_server_queue(c, NULL, mark, c->out.len - mark, LUA_NOREF))
+    return luaL_error(L, "not enough memory");
+  body = lua_tolstring(L, 6, &blen);
+  if (body && blen && !head_only) {
+    if (blen < LHTTP_SERVER_PIN) {
+      mark = c->out.len;
+      if (lhttp_wbuf_append(&c->out, body, blen) ||
+          lhttp_server_queue(c, NULL, mark, blen, LUA_NOREF))
+        return luaL_error(L, "not enough memory");
+    } else {
+      int ref;
+
+      lua_pushvalue(L, 6);
+      ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      if (lhttp_server_queue(c, body, 0, blen, ref)) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        return luaL_error(L, "not enough memory");
+      }
+    }
+  }
+
+  lua_getfield(L, 3, "should_keep_alive");
+  if (!lua_toboolean(L, -1)) c->close_after = 1;
+  return 0;
+}
+
+/* Answer the request at `req`, a handler error is given to onError and
+ * answered with a 500 */
+static void lhttp_server_dispatch(lua_State *L, lhttp_server_t *srv,
+                                  lhttp_server_conn *c, int req) {
+  int nsegs = c->nsegs;
+  size_t last_len = nsegs > c->head ? c->segs[nsegs - 1].len : 0;
+  size_t mark = c->out.len;
+
+  srv->stats.requests++;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, srv->respond_ref);
+  lua_pushlightuserdata(L, srv);
+  lua_pushlightuserdata(L, c);
+  lua_pushvalue(L, req);
+  if (lua_pcall(L, 3, 0, 0) == 0) return;
+
+  srv->stats.errors++;
+  lhttp_server_unqueue(L, c, nsegs, last_len, mark);
+  if (srv->error_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, srv->error_ref);
+    lua_insert(L, -2);
+    lua_pushvalue(L, req);
+    if (lua_pcall(L, 2, 0, 0) == 0) lua_pushnil(L);
+  }
+  lua_pop(L, 1);
+  lhttp_server_answer(c, LHTTP_SERVER_500, sizeof(LHTTP_SERVER_500) - 1);
+}
+
+/* Answer the completed messages of the table at `idx` */
+static void lhttp_server_messages(lua_State *L, lhttp_server_t *srv,
+                                  lhttp_server_conn *c, int idx) {
+  int i, n;
+
+  if (!lua_istable(L, idx)) return;
+  n = (int)lua_rawlen(L, idx);
+  for (i = 1; i <= n && !c->close_after; i++) {
+    lua_rawgeti(L, idx, i);
+    lhttp_server_dispatch(L, srv, c, lua_gettop(L));
+    lua_pop(L, 1);
+  }
+}
+
+/* Read until the socket is drained, edge-triggered readiness is only
+ * signaled again for new data. -1 when the socket failed */
+static int lhttp_server_read(lua_State *L, lhttp_server_t *srv,
+                              lhttp_server_conn *c) {
+  int top = lua_gettop(L), drained = 0;
+
+  while (!c->close_after) {
+    lua_Integer nread;
+    const char *status;
+
+    if (c->pending >= LHTTP_SERVER_HIGH_WATER) {
+      c->blocked = 1;
+      break;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, srv->read_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, c->parser_ref);
+    lua_pushinteger(L, c->fd);
+    /* requests kept back by max_messages_per_execute are parsed first */
+    lua_pushinteger(L, c->kept ? 0 : LHTTP_SERVER_READ);
+    lua_call(L, 3, 4);
+
+    if (lua_isnil(L, top + 1)) {
+      /* messages before a parse error are answered, then a 400 unless
+       * they closed the connection, llhttp rejects data after that */
+      if (lua_istable(L, top + 3)) {
+        lhttp_server_messages(L, srv, c, top + 3);
+        if (!c->close_after) {
+          srv->stats.errors++;
+          lhttp_server_answer(c, LHTTP_SERVER_400,
+                              sizeof(LHTTP_SERVER_400) - 1);
+        }
+        break;
+      }
+      lua_settop(L, top);
+      return -1;
+    }
+
+    nread = lua_tointeger(L, top + 1);
+    status = lua_tostring(L, top + 3);
+    srv->stats.bytes_in += nread;
+    lhttp_server_messages(L, srv, c, top + 4);
+    lua_settop(L, top);
+
+    /* a short read emptied the socket, but the end of a peer that shut
+     * down is only seen by reading on to EOF */
+    if (!c->kept) drained = nread < LHTTP_SERVER_READ && !c->hup;
+    if (strcmp(status, "EAGAIN") == 0) break;
+    /* the peer is done sending, or wants another protocol */
+    if (strcmp(status, "EOF") == 0 ||
+        strcmp(status, "HPE_PAUSED_UPGRADE") == 0) {
+      c->close_after = 1;
+      break;
+    }
+    c->kept = strcmp(status, "max_messages_per_execute") == 0;
+    if (drained && !c->kept) break;
+  }
+  lua_settop(L, top);
+  return 0;
+}
+
+static void lhttp_server_accept(lua_State *L, lhttp_server_t *srv) {
+  for (;;) {
+    struct epoll_event ev;
+    lhttp_server_conn *c;
+    int fd, one = 1;
+
+    fd = accept4(srv->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      /* out of descriptors leaves the backlog to the next connection */
+      if (errno != EAGAIN && errno != EWOULDBLOCK) srv->stats.errors++;
+      return;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (fd >= srv->nconns) {
+      int i, size = srv->nconns ? srv->nconns : 64;
+      lhttp_server_conn **conns;
+
+      while (size <= fd) size *= 2;
+      conns = realloc(srv->conns, size * sizeof(*conns));
+      if (conns == NULL) {
+        close(fd);
+        srv->stats.errors++;
+        continue;
+      }
+      for (i = srv->nconns; i < size; i++) conns[i] = NULL;
+      srv->conns = conns;
+      srv->nconns = size;
+    }
+    c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+      close(fd);
+      srv->stats.errors++;
+      continue;
+    }
+    c->fd = fd;
+    lhttp_wbuf_init(&c->out, NULL, 0);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, srv->acquire_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, srv->pool_ref);
+    lua_call(L, 1, 1);
+    c->parser_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    srv->conns[fd] = c;
+    srv->stats.accepted++;
+    srv->stats.active++;
+
+    /* the registration reports data already there */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+      srv->stats.errors++;
+      lhttp_server_close_conn(L, srv, c, 1);
+    }
+  }
+}
+
+static void lhttp_server_service(lua_State *L, lhttp_server_t *srv,
+                                 lhttp_server_conn *c, uint32_t events) {
+  int readable = (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) ||
+                 c->blocked;
+
+  if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) c->hup = 1;
+  /* responses of pipelined requests leave with one flush */
+  for (;;) {
+    int rc;
+
+    if (readable) {
+      c->blocked = 0;
+      if (lhttp_server_read(L, srv, c) < 0) {
+        lhttp_server_close_conn(L, srv, c, 1);
+        return;
+      }
+    }
+    rc = lhttp_server_flush(L, srv, c);
+    if (rc < 0 || (rc == 0 && c->close_after)) {
+      lhttp_server_close_conn(L, srv, c, 1);
+      return;
+    }
+    if (rc > 0 || !c->blocked) return;
+    readable = 1;
+  }
+}
+
+/* Handle the events of one epoll_wait, under lua_pcall */
+static int lhttp_server_events(lua_State *L) {
+  lhttp_server_t *srv = lua_touserdata(L, 1);
+  int i, n = (int)lua_tointeger(L, 2);
+
+  for (i = 0; i < n; i++) {
+    int fd = srv->events[i].data.fd;
+
+    if (fd == srv->lfd) {
+      lhttp_server_accept(L, srv);
+    } else if (fd < srv->nconns && srv->conns[fd]) {
+      lhttp_server_service(L, srv, srv->conns[fd], srv->events[i].events);
+    }
+  }
+  return 0;
+}
+
+/* Wait at most `timeout` ms and handle the events, the number of events or
+ * -1 with errno set */
+static int lhttp_server_poll(lua_State *L, lhttp_server_t *srv, int timeout) {
+  int n;
+
+  if (srv->stepping) return luaL_error(L, "server is running a handler");
+  n = epoll_wait(srv->epfd, srv->events, LHTTP_SERVER_EVENTS, timeout);
+  if (n < 0) return errno == EINTR ? 0 : -1;
+
+  srv->stepping = 1;
+  lua_pushcfunction(L, lhttp_server_events);
+  lua_pushlightuserdata(L, srv);
+  lua_pushinteger(L, n);
+  if (lua_pcall(L, 2, 0, 0)) {
+    srv->stepping = 0;
+    lua_error(L);
+  }
+  srv->stepping = 0;
+  return n;
+}
+
+/*****************************************************************************/
+static lhttp_server_t *lhttp_server_check(lua_State *L, int idx) {
+  lhttp_server_t *srv = luaL_checkudata(L, idx, LHTTP_SERVER);
+
+  luaL_argcheck(L, srv->epfd >= 0, idx, "server is closed");
+  return srv;
+}
+
+static void lhttp_server_release(lua_State *L, lhttp_server_t *srv,
+                                 int release) {
+  int i;
+
+  for (i = 0; i < srv->nconns; i++)
+    if (srv->conns[i]) lhttp_server_close_conn(L, srv, srv->conns[i], release);
+  free(srv->conns);
+  srv->conns = NULL;
+  srv->nconns = 0;
+  if (srv->lfd >= 0) close(srv->lfd);
+  if (srv->epfd >= 0) close(srv->epfd);
+  srv->lfd = srv->epfd = -1;
+  luaL_unref(L, LUA_REGISTRYINDEX, srv->handler_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, srv->error_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, srv->respond_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, srv->pool_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, srv->acquire_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, srv->release_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, srv->read_ref);
+  srv->handler_ref = srv->error_ref = srv->respond_ref = LUA_NOREF;
+  srv->pool_ref = srv->acquire_ref = srv->release_ref = LUA_NOREF;
+  srv->read_ref = LUA_NOREF;
+}
+
+static int lhttp_server_opt_int(lua_State *L, const char *key, int def,
+                                int min, int max) {
+  lua_Integer v;
+
+  lua_getfield(L, 1, key);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return def;
+  }
+  if (!lua_isnumber(L, -1))
+    luaL_error(L, "option '%s' must be a number", key);
+  v = lua_tointeger(L, -1);
+  if (v < min || v > max)
+    luaL_error(L, "option '%s' must be from %d to %d", key, min, max);
+  lua_pop(L, 1);
+  return (int)v;
+}
+
+/* The parser options a server passes on to its pool: the limits, profile
+ * and the lenient flags, the others would change what the server reads */
+static const char *const lhttp_server_parser_options[] = {
+    "max_url", "max_header_bytes", "max_headers", "max_body",
+    "max_messages_per_execute", "profile", NULL};
+
+static int lhttp_server_parser_option(lua_State *L, int idx) {
+  const char *key;
+  int i;
+
+  if (lua_type(L, idx) != LUA_TSTRING) return 0;
+  key = lua_tostring(L, idx);
+  if (strncmp(key, "lenient_", 8) == 0) return 1;
+  for (i = 0; lhttp_server_parser_options[i]; i++)
+    if (strcmp(key, lhttp_server_parser_options[i]) == 0) return 1;
+  return 0;
+}
+
+/* Ref of the field `name` of the value on top of the stack */
+static int lhttp_server_ref_field(lua_State *L, const char *name) {
+  lua_getfield(L, -1, name);
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/***
+ * Create a server
+ *
+ * Binds and listens at once. Requests are parsed by a pool of parsers of
+ * type `'request'` with `request = true`. Of the options given here, the
+ * limits `max_url`, `max_header_bytes`, `max_headers`, `max_body` and
+ * `max_messages_per_execute`, `profile` and the `lenient_*` flags go to the
+ * parsers, other parser options are ignored.
+ *
+ * The handler is called once per request with its request object and returns
+ * the status, the headers and the body of the response, as for
+ * `lhttp_writer.response`; bodies are not copied from 16KB on, and no body
+ * counts as an empty one, framed with `Content-Length: 0` unless the headers
+ * say otherwise. A request without keep-alive closes the connection after its
+ * response, pipelined requests are answered in order with one write. A
+ * handler error counts in the `errors` stat, goes to `onError` and answers
+ * 500, a parse error answers 400, and both close the connection. An upgrade
+ * request gets its response then the connection is closed.
+ *
+ * @function new
+ * @tparam table options
+ * @tparam function options.handler `handler(req)` returning status, headers
+ * and body
+ * @tparam[opt='127.0.0.1'] string options.host Address to listen on
+ * @tparam[opt=0] integer options.port Port, 0 for any free one
+ * @tparam[opt=511] integer options.backlog Listen backlog
+ * @tparam[opt=false] boolean options.reuseport Set `SO_REUSEPORT`
+ * @tparam[opt=256] integer options.pool_size Free parsers kept for new
+ * connections
+ * @tparam[opt] function options.onError `onError(err, req)` for handler
+ * errors
+ * @treturn[1] userdata Server object
+ * @treturn[2] nil When the address cannot be used
+ * @treturn[2] string Error message
+ * @usage
+ * local server = require('lhttp_server').new({
+ *   port = 8080,
+ *   handler = function(req)
+ *     return 200, { ['Content-Type'] = 'text/plain' }, 'hello ' .. req.path
+ *   end
+ * })
+ * server:run()
+ */
+static int lhttp_server_new(lua_State *L) {
+  lhttp_server_t *srv;
+  const char *host, *err = NULL;
+  int port, backlog, pool_size, reuseport;
+  struct epoll_event ev;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  lua_getfield(L, 1, "handler");
+  luaL_argcheck(L, lua_isfunction(L, 2), 1, "handler must be a function");
+  lua_getfield(L, 1, "onError");
+  luaL_argcheck(L, lua_isnil(L, 3) || lua_isfunction(L, 3), 1,
+                "onError must be a function");
+  lua_getfield(L, 1, "host");
+  host = lua_isnil(L, 4) ? "127.0.0.1" : lua_tostring(L, 4);
+  luaL_argcheck(L, host != NULL, 1, "host must be a string");
+  port = lhttp_server_opt_int(L, "port", 0, 0, 65535);
+  backlog = lhttp_server_opt_int(L, "backlog", 511, 1, 65535);
+  pool_size = lhttp_server_opt_int(L, "pool_size", 256, 0, 1 << 20);
+  lua_getfield(L, 1, "reuseport");
+  reuseport = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  srv = lua_newuserdata(L, sizeof(*srv));
+  memset(srv, 0, sizeof(*srv));
+  srv->lfd = srv->epfd = -1;
+  srv->handler_ref = srv->error_ref = srv->respond_ref = LUA_NOREF;
+  srv->pool_ref = srv->acquire_ref = srv->release_ref = LUA_NOREF;
+  srv->read_ref = LUA_NOREF;
+  luaL_getmetatable(L, LHTTP_SERVER);
+  lua_setmetatable(L, -2);
+
+  srv->lfd = lhttp_server_listen(host, port, backlog, reuseport, &err);
+  if (srv->lfd < 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+  }
+  srv->port = lhttp_server_local_port(srv->lfd);
+  srv->epfd = epoll_create1(EPOLL_CLOEXEC);
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.fd = srv->lfd;
+  if (srv->epfd < 0 || epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->lfd, &ev)) {
+    int e = errno;
+
+    lhttp_server_release(L, srv, 0);
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(e));
+    return 2;
+  }
+
+  lua_pushvalue(L, 2);
+  srv->handler_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (!lua_isnil(L, 3)) {
+    lua_pushvalue(L, 3);
+    srv->error_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_pushcfunction(L, lhttp_server_respond);
+  srv->respond_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  /* lhp.pool('request', nil, pool_size, options + { request = true }) */
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  lua_getfield(L, -1, "lhttp_parser");
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushcfunction(L, luaopen_lhttp_parser);
+    lua_pushliteral(L, "lhttp_parser");
+    lua_call(L, 1, 1);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, "lhttp_parser");
+  }
+  lua_getfield(L, -1, "pool");
+  lua_pushliteral(L, "request");
+  lua_pushnil(L);
+  lua_pushinteger(L, pool_size);
+  lua_newtable(L);
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    if (lhttp_server_parser_option(L, -2)) {
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_rawset(L, -4);
+    } else {
+      lua_pop(L, 1);
+    }
+  }
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, "request");
+  lua_call(L, 4, 1);
+  srv->acquire_ref = lhttp_server_ref_field(L, "acquire");
+  srv->release_ref = lhttp_server_ref_field(L, "release");
+
+  /* parser:read_fd, from a parser of the pool given back at once */
+  lua_rawgeti(L, LUA_REGISTRYINDEX, srv->acquire_ref);
+  lua_pushvalue(L, -2);
+  lua_call(L, 1, 1);
+  srv->read_ref = lhttp_server_ref_field(L, "read_fd");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, srv->release_ref);
+  lua_pushvalue(L, -3);
+  lua_pushvalue(L, -3);
+  lua_call(L, 2, 0);
+  lua_pop(L, 1);
+  srv->pool_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  lua_settop(L, 5);
+  return 1;
+}
+
+/***
+ * Port the server listens on, the chosen one when created with port 0
+ *
+ * @function server:port
+ * @treturn integer Port
+ */
+static int lhttp_server_port(lua_State *L) {
+  lua_pushinteger(L, lhttp_server_check(L, 1)->port);
+  return 1;
+}
+
+/***
+ * Descriptor of the epoll instance
+ *
+ * It is readable when `step` has events to handle, to drive the server from
+ * another event loop.
+ *
+ * @function server:fd
+ * @treturn integer Descriptor
+ */
+static int lhttp_server_fd(lua_State *L) {
+  lua_pushinteger(L, lhttp_server_check(L, 1)->epfd);
+  return 1;
+}
+
+/***
+ * Wait for events and handle them
+ *
+ * Handlers run inside this call, they may not call `step`, `run` or `close`.
+ *
+ * @function server:step
+ * @tparam[opt=-1] integer timeout Most milliseconds to wait, -1 for no limit
+ * @treturn[1] integer Number of events handled
+ * @treturn[2] nil On error
+ * @treturn[2] string Error message
+ * @treturn[2] integer errno
+ */
+static int lhttp_server_step(lua_State *L) {
+  lhttp_server_t *srv = lhttp_server_check(L, 1);
+  int n = lhttp_server_poll(L, srv, (int)luaL_optinteger(L, 2, -1));
+
+  if (n < 0) {
+    int e = errno;
+
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(e));
+    lua_pushinteger(L, e);
+    return 3;
+  }
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+/***
+ * Serve until `stop` is called
+ *
+ * @function server:run
+ * @treturn[1] boolean true once stopped
+ * @treturn[2] nil On error
+ * @treturn[2] string Error message
+ * @treturn[2] integer errno
+ */
+static int lhttp_server_run(lua_State *L) {
+  lhttp_server_t *srv = lhttp_server_check(L, 1);
+
+  srv->stopped = 0;
+  while (!srv->stopped) {
+    if (lhttp_server_poll(L, srv, -1) < 0) {
+      int e = errno;
+
+      lua_pushnil(L);
+      lua_pushstring(L, strerror(e));
+      lua_pushinteger(L, e);
+      return 3;
+    }
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/***
+ * Make `run` return after the events being handled, from a handler
+ *
+ * @function server:stop
+ */
+static int lhttp_server_stop(lua_State *L) {
+  lhttp_server_check(L, 1)->stopped = 1;
+  return 0;
+}
+
+/***
+ * Close the listening socket and every connection
+ *
+ * Pending output is dropped. Also done by the garbage collector.
+ *
+ * @function server:close
+ */
+static int lhttp_server_close(lua_State *L) {
+  lhttp_server_t *srv = luaL_checkudata(L, 1, LHTTP_SERVER);
+
+  if (srv->stepping) return luaL_error(L, "server is running a handler");
+  lhttp_server_release(L, srv, 1);
+  return 0;
+}
+
+static int lhttp_server_gc(lua_State *L) {
+  lhttp_server_release(L, luaL_checkudata(L, 1, LHTTP_SERVER), 0);
+  return 0;
+}
+
+/***
+ * Counters since the server was created
+ *
+ * @function server:stats
+ * @treturn table `accepted` and `active` connections, `requests`,
+ * `bytes_in`, `bytes_out`, and `errors`: handler errors, parse errors and
+ * failed accepts
+ */
+static int lhttp_server_stats_l(lua_State *L) {
+  const lhttp_server_t *srv = luaL_checkudata(L, 1, LHTTP_SERVER);
+
+  lua_createtable(L, 0, 6);
+  lua_pushinteger(L, srv->stats.accepted);
+  lua_setfield(L, -2, "accepted");
+  lua_pushinteger(L, srv->stats.active);
+  lua_setfield(L, -2, "active");
+  lua_pushinteger(L, srv->stats.requests);
+  lua_setfield(L, -2, "requests");
+  lua_pushinteger(L, srv->stats.bytes_in);
+  lua_setfield(L, -2, "bytes_in");
+  lua_pushinteger(L, srv->stats.bytes_out);
+  lua_setfield(L, -2, "bytes_out");
+  lua_pushinteger(L, srv->stats.errors);
+  lua_setfield(L, -2, "errors");
+  return 1;
+}
+
+/*****************************************************************************/
+/* Worker threads: each one runs its own lua_State, epoll instance and
+ * SO_REUSEPORT listening socket, the kernel spreads the connections */
+
+#define LHTTP_SERVER_GROUP "lhttp_server.group"
+
+enum { LHTTP_WORKER_STARTING, LHTTP_WORKER_RUNNING, LHTTP_WORKER_DONE };
+
+/* A server option of the main state, copied for the worker states */
+typedef struct {
+  char *key;
+  int type;               /* LUA_TSTRING, LUA_TNUMBER or LUA_TBOOLEAN */
+  char *str;
+  size_t len;
+  lua_Number num;
+} lhttp_server_opt;
+
+struct lhttp_server_group;
+
+typedef struct {
+  struct lhttp_server_group *group;
+  pthread_t thread;
+  int id;
+  int cpu;                /* -1 when not pinned */
+  int started;            /* the thread was created */
+  int state;              /* LHTTP_WORKER_*, under the group lock */
+  char error[256];
+  pthread_mutex_t lock;   /* guards stats */
+  lhttp_server_stats stats; /* copied from the server after each round */
+} lhttp_server_worker;
+
+typedef struct lhttp_server_group {
+  int nworkers;
+  int port;
+  int stop;
+  int stopfd;             /* eventfd, readable once stopping */
+  char *script;
+  char *path;
+  char *cpath;
+  lhttp_server_opt *opts;
+  int nopts;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  lhttp_server_worker *workers;
+} lhttp_server_group;
+
+/* A copy of `s`, of `len` bytes or up to its NUL when `len` is 0 */
+static char *lhttp_server_strdup(const char *s, size_t len) {
+  char *p;
+
+  if (len == 0) len = strlen(s);
+  p = malloc(len + 1);
+  if (p) {
+    memcpy(p, s, len);
+    p[len] = '\0';
+  }
+  return p;
+}
+
+/* package.path or package.cpath of the state, the package table at 4 */
+static const char *lhttp_server_package(lua_State *L, const char *field) {
+  const char *s = NULL;
+
+  if (lua_istable(L, 4)) {
+    lua_getfield(L, 4, field);
+    s = lua_tostring(L, -1);
+    lua_pop(L, 1);
+  }
+  return s ? s : "";
+}
+
+static void lhttp_server_push_opt(lua_State *L, const lhttp_server_opt *o) {
+  if (o->type == LUA_TSTRING)
+    lua_pushlstring(L, o->str, o->len);
+  else if (o->type == LUA_TNUMBER)
+    lua_pushnumber(L, o->num);
+  else
+    lua_pushboolean(L, o->len != 0);
+}
+
+/* Body of a worker thread, under lua_pcall in its own state */
+static int lhttp_server_worker_main(lua_State *L) {
+  lhttp_server_worker *w = lua_touserdata(L, 1);
+  lhttp_server_group *g = w->group;
+  lhttp_server_t *srv;
+  struct epoll_event ev;
+  int i;
+
+  lua_getglobal(L, "package");
+  lua_pushstring(L, g->path);
+  lua_setfield(L, -2, "path");
+  lua_pushstring(L, g->cpath);
+  lua_setfield(L, -2, "cpath");
+  /* the modules of this library, as loaded by the main state */
+  lua_getfield(L, -1, "loaded");
+  lua_pushcfunction(L, luaopen_lhttp_parser);
+  lua_call(L, 0, 1);
+  lua_setfield(L, -2, "lhttp_parser");
+  lua_pushcfunction(L, luaopen_lhttp_writer);
+  lua_call(L, 0, 1);
+  lua_setfield(L, -2, "lhttp_writer");
+  lua_pushcfunction(L, luaopen_lhttp_server);
+  lua_call(L, 0, 1);
+  lua_setfield(L, -2, "lhttp_server");
+  lua_settop(L, 1);
+
+  /* the script gets the worker number and returns the handler, or options */
+  if (luaL_loadfile(L, g->script)) return lua_error(L);
+  lua_pushinteger(L, w->id);
+  lua_call(L, 1, 1);
+  if (!lua_isfunction(L, 2) && !lua_istable(L, 2))
+    return luaL_error(L, "%s must return a handler or a table of options",
+                      g->script);
+
+  lua_pushcfunction(L, lhttp_server_new);
+  lua_createtable(L, 0, g->nopts + 3);
+  for (i = 0; i < g->nopts; i++) {
+    lhttp_server_push_opt(L, &g->opts[i]);
+    lua_setfield(L, -2, g->opts[i].key);
+  }
+  if (lua_isfunction(L, 2)) {
+    lua_pushvalue(L, 2);
+    lua_setfield(L, -2, "handler");
+  } else {
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_rawset(L, -4);
+    }
+  }
+  /* the first worker picks the port when it is 0 */
+  pthread_mutex_lock(&g->lock);
+  if (g->port) {
+    lua_pushinteger(L, g->port);
+    lua_setfield(L, -2, "port");
+  }
+  pthread_mutex_unlock(&g->lock);
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, "reuseport");
+  lua_call(L, 1, 2);
+  if (lua_isnil(L, -2)) return luaL_error(L, "%s", lua_tostring(L, -1));
+  lua_pop(L, 1);
+  srv = lua_touserdata(L, -1);
+
+  /* level-triggered, it wakes every wait once stopping */
+  ev.events = EPOLLIN;
+  ev.data.fd = g->stopfd;
+  if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, g->stopfd, &ev))
+    return luaL_error(L, "%s", strerror(errno));
+
+  pthread_mutex_lock(&g->lock);
+  g->port = srv->port;
+  w->state = LHTTP_WORKER_RUNNING;
+  pthread_cond_broadcast(&g->cond);
+  pthread_mutex_unlock(&g->lock);
+
+  while (!__atomic_load_n(&g->stop, __ATOMIC_ACQUIRE)) {
+    if (lhttp_server_poll(L, srv, -1) < 0)
+      return luaL_error(L, "%s", strerror(errno));
+    pthread_mutex_lock(&w->lock);
+    w->stats = srv->stats;
+    pthread_mutex_unlock(&w->lock);
+  }
+  lhttp_server_release(L, srv, 1);
+  return 0;
+}
+
+static void *lhttp_server_worker_thread(void *arg) {
+  lhttp_server_worker *w = arg;
+  lhttp_server_group *g = w->group;
+  lua_State *L = NULL;
+
+  if (w->cpu >= 0) {
+    cpu_set_t set;
+    int rc;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc)
+      snprintf(w->error, sizeof(w->error), "cannot pin to CPU %d: %s", w->cpu,
+               strerror(rc));
+  }
+  if (w->error[0] == '\0') {
+    L = luaL_newstate();
+    if (L == NULL) snprintf(w->error, sizeof(w->error), "not enough memory");
+  }
+  if (L) {
+    luaL_openlibs(L);
+    lua_pushcfunction(L, lhttp_server_worker_main);
+    lua_pushlightuserdata(L, w);
+    if (lua_pcall(L, 1, 0, 0))
+      snprintf(w->error, sizeof(w->error), "%s",
+               lua_isstring(L, -1) ? lua_tostring(L, -1) : "worker failed");
+    lua_close(L);
+  }
+
+  pthread_mutex_lock(&g->lock);
+  w->state = LHTTP_WORKER_DONE;
+  pthread_cond_broadcast(&g->cond);
+  pthread_mutex_unlock(&g->lock);
+  return NULL;
+}
+
+/* Stop and join the workers, then the first error or NULL */
+static const char *lhttp_server_group_stop(lhttp_server_group *g) {
+  const char *err = NULL;
+  uint64_t one = 1;
+  int i;
+
+  __atomic_store_n(&g->stop, 1, __ATOMIC_RELEASE);
+  if (write(g->stopfd, &one, sizeof(one)) < 0) {
+    /* never full, the workers only poll it */
+  }
+  for (i = 0; i < g->nworkers; i++) {
+    lhttp_server_worker *w = &g->workers[i];
+
+    if (w->started) {
+      pthread_join(w->thread, NULL);
+      w->started = 0;
+    }
+    if (err == NULL && w->error[0]) err = w->error;
+  }
+  return err;
+}
+
+static void lhttp_server_group_free(lhttp_server_group *g) {
+  int i;
+
+  lhttp_server_group_stop(g);
+  for (i = 0; i < g->nworkers; i++)
+    pthread_mutex_destroy(&g->workers[i].lock);
+  for (i = 0; i < g->nopts; i++) {
+    free(g->opts[i].key);
+    free(g->opts[i].str);
+  }
+  free(g->opts);
+  free(g->workers);
+  free(g->script);
+  free(g->path);
+  free(g->cpath);
+  close(g->stopfd);
+  pthread_cond_destroy(&g->cond);
+  pthread_mutex_destroy(&g->lock);
+  free(g);
+}
+
+static lhttp_server_group *lhttp_server_group_check(lua_State *L, int idx) {
+  lhttp_server_group **gp = luaL_checkudata(L, idx, LHTTP_SERVER_GROUP);
+
+  luaL_argcheck(L, *gp != NULL, idx, "workers are closed");
+  return *gp;
+}
+
+/* Copy the server options of the table at 1 for the workers */
+static void lhttp_server_group_opts(lua_State *L, lhttp_server_group *g) {
+  int n = 0;
+
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    n++;
+    lua_pop(L, 1);
+  }
+  g->opts = calloc((size_t)n + 1, sizeof(*g->opts));
+  if (g->opts == NULL) luaL_error(L, "not enough memory");
+
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    lhttp_server_opt *o = &g->opts[g->nopts];
+    int t = lua_type(L, -1);
+    const char *key;
+    size_t len;
+
+    if (lua_type(L, -2) != LUA_TSTRING ||
+        (t != LUA_TSTRING && t != LUA_TNUMBER && t != LUA_TBOOLEAN)) {
+      lua_pop(L, 1);
+      continue;
+    }
+    key = lua_tolstring(L, -2, &len);
+    if (strcmp(key, "script") == 0 || strcmp(key, "threads") == 0 ||
+        strcmp(key, "cpus") == 0) {
+      lua_pop(L, 1);
+      continue;
+    }
+    o->type = t;
+    o->key = lhttp_server_strdup(key, len);
+    if (t == LUA_TSTRING) {
+      key = lua_tolstring(L, -1, &o->len);
+      o->str = lhttp_server_strdup(key, o->len);
+    } else if (t == LUA_TNUMBER) {
+      o->num = lua_tonumber(L, -1);
+    } else {
+      o->len = (size_t)lua_toboolean(L, -1);
+    }
+    g->nopts++;
+    if (o->key == NULL || (t == LUA_TSTRING && o->str == NULL))
+      luaL_error(L, "not enough memory");
+    lua_pop(L, 1);
+  }
+}
+
+/* CPU of worker `i`: the cpus option is true for one CPU per worker in
+ * turn, or an array of CPU numbers used in turn */
+static int lhttp_server_group_cpu(lua_State *L, int idx, int i) {
+  long ncpu;
+  int n, cpu;
+
+  if (lua_isnil(L, idx) || (lua_isboolean(L, idx) && !lua_toboolean(L, idx)))
+    return -1;
+  if (lua_isboolean(L, idx)) {
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return ncpu > 0 ? i % (int)ncpu : 0;
+  }
+  luaL_argcheck(L, lua_istable(L, idx), 1,
+                "cpus must be a boolean or an array of CPU numbers");
+  n = (int)lua_rawlen(L, idx);
+  luaL_argcheck(L, n > 0, 1, "cpus must not be empty");
+  lua_rawgeti(L, idx, i % n + 1);
+  cpu = (int)lua_tointeger(L, -1);
+  luaL_argcheck(L, lua_isnumber(L, -1) && cpu >= 0 && cpu < CPU_SETSIZE, 1,
+                "cpus must hold CPU numbers");
+  lua_pop(L, 1);
+  return cpu;
+}
+
+/***
+ * Serve with worker threads
+ *
+ * Starts `threads` threads, each with its own Lua state, epoll instance and
+ * listening socket bound with `SO_REUSEPORT`, so the kernel spreads the
+ * connections over them and a request is handled by one thread from accept
+ * to response. Every worker runs `script`, given the worker number from 1,
+ * which returns the handler or a table of server options with the handler;
+ * the other server options of `new` are taken from here, copied when they
+ * are strings, numbers or booleans. Workers share nothing else, the script
+ * should only read shared resources.
+ *
+ * Workers start one after another, the first one picks the port when it is
+ * 0; an error of any of them stops the ones started.
+ *
+ * @function workers
+ * @tparam table options
+ * @tparam string options.script Path of the handler script
+ * @tparam[opt] integer options.threads Number of workers, the number of
+ * online CPUs by default
+ * @tparam[opt] boolean|table options.cpus Pin the workers: true for one CPU
+ * each in turn, or an array of CPU numbers used in turn
+ * @treturn[1] userdata Worker group
+ * @treturn[2] nil When a worker failed to start
+ * @treturn[2] string Error message
+ * @usage
+ * -- app.lua: return function(req) return 200, nil, 'hello' end
+ * local group = assert(require('lhttp_server').workers({
+ *   script = 'app.lua', port = 8080, threads = 4, cpus = true
+ * }))
+ * group:wait()
+ */
+static int lhttp_server_workers(lua_State *L) {
+  lhttp_server_group **gp, *g;
+  const char *script;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int i, nworkers;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  lua_getfield(L, 1, "script");
+  script = lua_tostring(L, 2);
+  luaL_argcheck(L, script != NULL, 1, "script must be a path");
+  nworkers = lhttp_server_opt_int(L, "threads", ncpu > 0 ? (int)ncpu : 1, 1,
+                                  1024);
+  lua_getfield(L, 1, "cpus");
+  for (i = 0; i < nworkers; i++) lhttp_server_group_cpu(L, 3, i);
+  lua_getglobal(L, "package");
+
+  gp = lua_newuserdata(L, sizeof(*gp));
+  *gp = NULL;
+  luaL_getmetatable(L, LHTTP_SERVER_GROUP);
+  lua_setmetatable(L, -2);
+
+  g = calloc(1, sizeof(*g));
+  if (g == NULL) return luaL_error(L, "not enough memory");
+  g->stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (g->stopfd < 0) {
+    free(g);
+    return luaL_error(L, "eventfd: %s", strerror(errno));
+  }
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->cond, NULL);
+  *gp = g;
+
+  /* workers find modules where this state does */
+  g->script = lhttp_server_strdup(script, 0);
+  g->path = lhttp_server_strdup(lhttp_server_package(L, "path"), 0);
+  g->cpath = lhttp_server_strdup(lhttp_server_package(L, "cpath"), 0);
+  g->workers = calloc((size_t)nworkers, sizeof(*g->workers));
+  if (!g->script || !g->path || !g->cpath || !g->workers)
+    return luaL_error(L, "not enough memory");
+  g->nworkers = nworkers;
+  for (i = 0; i < nworkers; i++) {
+    g->workers[i].group = g;
+    g->workers[i].id = i + 1;
+    g->workers[i].cpu = lhttp_server_group_cpu(L, 3, i);
+    pthread_mutex_init(&g->workers[i].lock, NULL);
+  }
+  lhttp_server_group_opts(L, g);
+  g->port = lhttp_server_opt_int(L, "port", 0, 0, 65535);
+
+  for (i = 0; i < nworkers; i++) {
+    lhttp_server_worker *w = &g->workers[i];
+    int rc = pthread_create(&w->thread, NULL, lhttp_server_worker_thread, w);
+
+    if (rc) {
+      snprintf(w->error, sizeof(w->error), "pthread_create: %s",
+               strerror(rc));
+    } else {
+      w->started = 1;
+      pthread_mutex_lock(&g->lock);
+      while (w->state == LHTTP_WORKER_STARTING)
+        pthread_cond_wait(&g->cond, &g->lock);
+      pthread_mutex_unlock(&g->lock);
+    }
+    if (w->error[0]) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "worker %d: %s", w->id, w->error);
+      lhttp_server_group_free(g);
+      *gp = NULL;
+      return 2;
+    }
+  }
+  lua_settop(L, 5);
+  return 1;
+}
+
+/***
+ * Port the workers listen on
+ *
+ * @function group:port
+ * @treturn integer Port
+ */
+static int lhttp_server_group_port(lua_State *L) {
+  lua_pushinteger(L, lhttp_server_group_check(L, 1)->port);
+  return 1;
+}
+
+/***
+ * Counters of each worker
+ *
+ * Updated by a worker after each round of events.
+ *
+ * @function group:stats
+ * @treturn table One table per worker with the fields of `server:stats`,
+ * `worker`, its number, `cpu`, -1 when not pinned, `running`, and `error`
+ * when it failed
+ */
+static int lhttp_server_group_stats(lua_State *L) {
+  lhttp_server_group *g = lhttp_server_group_check(L, 1);
+  int i;
+
+  lua_createtable(L, g->nworkers, 0);
+  for (i = 0; i < g->nworkers; i++) {
+    lhttp_server_worker *w = &g->workers[i];
+    lhttp_server_stats stats;
+    int state;
+
+    pthread_mutex_lock(&w->lock);
+    stats = w->stats;
+    pthread_mutex_unlock(&w->lock);
+    pthread_mutex_lock(&g->lock);
+    state = w->state;
+    pthread_mutex_unlock(&g->lock);
+
+    lua_createtable(L, 0, 10);
+    lua_pushinteger(L, w->id);
+    lua_setfield(L, -2, "worker");
+    lua_pushinteger(L, w->cpu);
+    lua_setfield(L, -2, "cpu");
+    lua_pushboolean(L, state == LHTTP_WORKER_RUNNING);
+    lua_setfield(L, -2, "running");
+    if (state == LHTTP_WORKER_DONE && w->error[0]) {
+      lua_pushstring(L, w->error);
+      lua_setfield(L, -2, "error");
+    }
+    lua_pushinteger(L, stats.accepted);
+    lua_setfield(L, -2, "accepted");
+    lua_pushinteger(L, stats.active);
+    lua_setfield(L, -2, "active");
+    lua_pushinteger(L, stats.requests);
+    lua_setfield(L, -2, "requests");
+    lua_pushinteger(L, stats.bytes_in);
+    lua_setfield(L, -2, "bytes_in");
+    lua_pushinteger(L, stats.bytes_out);
+    lua_setfield(L, -2, "bytes_out");
+    lua_pushinteger(L, stats.errors);
+    lua_setfield(L, -2, "errors");
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+/***
+ * Wait until every worker has exited
+ *
+ * Workers only exit on `stop` from another thread or on an error, so this
+ * serves until then.
+ *
+ * @function group:wait
+ * @treturn[1] boolean true
+ * @treturn[2] nil When a worker failed
+ * @treturn[2] string Its error
+ */
+static int lhttp_server_group_wait(lua_State *L) {
+  lhttp_server_group *g = lhttp_server_group_check(L, 1);
+  int i;
+
+  for (i = 0; i < g->nworkers; i++) {
+    lhttp_server_worker *w = &g->workers[i];
+
+    if (w->started) {
+      pthread_join(w->thread, NULL);
+      w->started = 0;
+    }
+    if (w->error[0]) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "worker %d: %s", w->id, w->error);
+      return 2;
+    }
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/***
+ * Stop the workers
+ *
+ * Every worker closes its connections after the round of events it is
+ * handling, then its thread is joined. Also done by the garbage collector.
+ *
+ * @function group:stop
+ * @treturn[1] boolean true
+ * @treturn[2] nil When a worker failed
+ * @treturn[2] string Its error
+ */
+static int lhttp_server_group_stop_l(lua_State *L) {
+  lhttp_server_group **gp = luaL_checkudata(L, 1, LHTTP_SERVER_GROUP);
+  const char *err;
+
+  if (*gp == NULL) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  err = lhttp_server_group_stop(*gp);
+  if (err) {
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+  }
+  lhttp_server_group_free(*gp);
+  *gp = NULL;
+  if (err) return 2;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int lhttp_server_group_gc(lua_State *L) {
+  lhttp_server_group **gp = luaL_checkudata(L, 1, LHTTP_SERVER_GROUP);
+
+  if (*gp) lhttp_server_group_free(*gp);
+  *gp = NULL;
+  return 0;
+}
+
+static const luaL_Reg lhttp_server_m[] = {
+    {"port", lhttp_server_port},
+    {"fd", lhttp_server_fd},
+    {"step", lhttp_server_step},
+    {"run", lhttp_server_run},
+    {"stop", lhttp_server_stop},
+    {"close", lhttp_server_close},
+    {"stats", lhttp_server_stats_l},
+
+    {NULL, NULL}};
+
+static const luaL_Reg lhttp_server_group_m[] = {
+    {"port", lhttp_server_group_port},
+    {"stats", lhttp_server_group_stats},
+    {"wait", lhttp_server_group_wait},
+    {"stop", lhttp_server_group_stop_l},
+
+    {NULL, NULL}};
+
+static const luaL_Reg lhttp_server_f[] = {
+    {"new", lhttp_server_new},
+    {"workers", lhttp_server_workers},
+
+    {NULL, NULL}};
+
+LUALIB_API int luaopen_lhttp_server(lua_State *L) {
+  luaL_newmetatable(L, LHTTP_SERVER);
+  lua_pushcfunction(L, lhttp_server_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_newtable(L);
+  luaL_setfuncs(L, lhttp_server_m, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LHTTP_SERVER_GROUP);
+  lua_pushcfunction(L, lhttp_server_group_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_newtable(L);
+  luaL_setfuncs(L, lhttp_server_group_m, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newlib(L, lhttp_server_f);
+  return 1;
+}
+
+#else
+
+LUALIB_API int luaopen_lhttp_server(lua_State *L) {
+  return luaL_error(L, "lhttp_server needs Linux epoll");
+}
+
+#endif
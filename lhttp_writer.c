@@ -0,0 +1,1054 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/***
+ * HTTP/1.1 message writer
+ *
+ * Serializes status or request lines and headers in C, with the status lines
+ * of every code llhttp knows precomputed and the `Date` header formatted at
+ * most once per second. The C side is declared in lhttp_writer.h.
+ *
+ * @module lhttp_writer
+ * @license Apache License 2.0
+ * @copyright 2012 The Luvit Authors
+ */
+
+#include "lhttp_parser.h"
+#include "lhttp_writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if LUA_VERSION_NUM < 502
+#ifndef lua_rawlen
+#define lua_rawlen lua_objlen
+#endif
+#ifndef luaL_newlib
+#define luaL_newlib(L, l) (lua_newtable(L), luaL_register(L, NULL, l))
+#endif
+#ifndef luaL_setfuncs
+#define luaL_setfuncs(L, l, n) (assert(n == 0), luaL_register(L, NULL, l))
+#endif
+#endif
+
+#define LHTTP_WRITER_BUFFER "lhttp_writer.buffer"
+#define LHTTP_WRITER_BODY "lhttp_writer.body"
+
+/* Reason phrases of the codes in llhttp's HTTP_STATUS_MAP */
+#define LHTTP_WRITER_STATUS_MAP(XX)                                           \
+  XX(100, "Continue")                                                         \
+  XX(101, "Switching Protocols")                                              \
+  XX(102, "Processing")                                                       \
+  XX(103, "Early Hints")                                                      \
+  XX(110, "Response Is Stale")                                                \
+  XX(111, "Revalidation Failed")                                              \
+  XX(112, "Disconnected Operation")                                           \
+  XX(113, "Heuristic Expiration")                                             \
+  XX(199, "Miscellaneous Warning")                                            \
+  XX(200, "OK")                                                               \
+  XX(201, "Created")                                                          \
+  XX(202, "Accepted")                                                         \
+  XX(203, "Non-Authoritative Information")                                    \
+  XX(204, "No Content")                                                       \
+  XX(205, "Reset Content")                                                    \
+  XX(206, "Partial Content")                                                  \
+  XX(207, "Multi-Status")                                                     \
+  XX(208, "Already Reported")                                                 \
+  XX(214, "Transformation Applied")                                           \
+  XX(226, "IM Used")                                                          \
+  XX(299, "Miscellaneous Persistent Warning")                                 \
+  XX(300, "Multiple Choices")                                                 \
+  XX(301, "Moved Permanently")                                                \
+  XX(302, "Found")                                                            \
+  XX(303, "See Other")                                                        \
+  XX(304, "Not Modified")                                                     \
+  XX(305, "Use Proxy")                                                        \
+  XX(306, "Switch Proxy")                                                     \
+  XX(307, "Temporary Redirect")                                               \
+  XX(308, "Permanent Redirect")                                               \
+  XX(400, "Bad Request")                                                      \
+  XX(401, "Unauthorized")                                                     \
+  XX(402, "Payment Required")                                                 \
+  XX(403, "Forbidden")                                                        \
+  XX(404, "Not Found")                                                        \
+  XX(405, "Method Not Allowed")                                               \
+  XX(406, "Not Acceptable")                                                   \
+  XX(407, "Proxy Authentication Required")                                    \
+  XX(408, "Request Timeout")                                                  \
+  XX(409, "Conflict")                                                         \
+  XX(410, "Gone")                                                             \
+  XX(411, "Length Required")                                                  \
+  XX(412, "Precondition Failed")                                              \
+  XX(413, "Payload Too Large")                                                \
+  XX(414, "URI Too Long")                                                     \
+  XX(415, "Unsupported Media Type")                                           \
+  XX(416, "Range Not Satisfiable")                                            \
+  XX(417, "Expectation Failed")                                               \
+  XX(418, "I'm a Teapot")                                                     \
+  XX(419, "Page Expired")                                                     \
+  XX(420, "Enhance Your Calm")                                                \
+  XX(421, "Misdirected Request")                                              \
+  XX(422, "Unprocessable Entity")                                             \
+  XX(423, "Locked")                                                           \
+  XX(424, "Failed Dependency")                                                \
+  XX(425, "Too Early")                                                        \
+  XX(426, "Upgrade Required")                                                 \
+  XX(428, "Precondition Required")                                            \
+  XX(429, "Too Many Requests")                                                \
+  XX(430, "Request Header Fields Too Large")                                  \
+  XX(431, "Request Header Fields Too Large")                                  \
+  XX(440, "Login Timeout")                                                    \
+  XX(444, "No Response")                                                      \
+  XX(449, "Retry With")                                                       \
+  XX(450, "Blocked By Parental Control")                                      \
+  XX(451, "Unavailable For Legal Reasons")                                    \
+  XX(460, "Client Closed Load Balanced Request")                              \
+  XX(463, "Invalid X-Forwarded-For")                                          \
+  XX(494, "Request Header Too Large")                                         \
+  XX(495, "SSL Certificate Error")                                            \
+  XX(496, "SSL Certificate Required")                                         \
+  XX(497, "HTTP Request Sent to HTTPS Port")                                  \
+  XX(498, "Invalid Token")                                                    \
+  XX(499, "Client Closed Request")                                            \
+  XX(500, "Internal Server Error")                                            \
+  XX(501, "Not Implemented")                                                  \
+  XX(502, "Bad Gateway")                                                      \
+  XX(503, "Service Unavailable")                                              \
+  XX(504, "Gateway Timeout")                                                  \
+  XX(505, "HTTP Version Not Supported")                                       \
+  XX(506, "Variant Also Negotiates")                                          \
+  XX(507, "Insufficient Storage")                                             \
+  XX(508, "Loop Detected")                                                    \
+  XX(509, "Bandwidth Limit Exceeded")                                         \
+  XX(510, "Not Extended")                                                     \
+  XX(511, "Network Authentication Required")                                  \
+  XX(520, "Web Server Unknown Error")                                         \
+  XX(521, "Web Server Is Down")                                               \
+  XX(522, "Connection Timeout")                                               \
+  XX(523, "Origin Is Unreachable")                                            \
+  XX(524, "Timeout Occurred")                                                 \
+  XX(525, "SSL Handshake Failed")                                             \
+  XX(526, "Invalid SSL Certificate")                                          \
+  XX(527, "Railgun Error")                                                    \
+  XX(529, "Site Is Overloaded")                                               \
+  XX(530, "Site Is Frozen")                                                   \
+  XX(561, "Identity Provider Authentication Error")                           \
+  XX(598, "Network Read Timeout")                                             \
+  XX(599, "Network Connect Timeout")
+
+/*****************************************************************************/
+void lhttp_wbuf_init(lhttp_wbuf *b, char *data, size_t size) {
+  b->data = data;
+  b->len = 0;
+  b->size = data ? size : 0;
+  b->fixed = data != NULL;
+}
+
+void lhttp_wbuf_free(lhttp_wbuf *b) {
+  if (!b->fixed) free(b->data);
+  b->data = NULL;
+  b->len = b->size = 0;
+}
+
+/* Make room for `extra` more bytes, so a write either fits whole or
+ * leaves the buffer untouched */
+static int lhttp_wbuf_reserve(lhttp_wbuf *b, size_t extra) {
+  size_t size;
+  char *data;
+
+  if (b->size - b->len >= extra) return LHTTP_W_OK;
+  if (b->fixed || extra > SIZE_MAX / 2 - b->len) return LHTTP_W_FULL;
+
+  size = b->size ? b->size : 256;
+  while (size - b->len < extra) size *= 2;
+  data = realloc(b->data, size);
+  if (data == NULL) return LHTTP_W_FULL;
+  b->data = data;
+  b->size = size;
+  return LHTTP_W_OK;
+}
+
+int lhttp_wbuf_append(lhttp_wbuf *b, const char *s, size_t len) {
+  if (lhttp_wbuf_reserve(b, len)) return LHTTP_W_FULL;
+  if (len) memcpy(b->data + b->len, s, len);
+  b->len += len;
+  return LHTTP_W_OK;
+}
+
+/*****************************************************************************/
+const char *lhttp_writer_status_line(int status, size_t *len) {
+#define XX(num, phrase)                                                       \
+  case num:                                                                   \
+    *len = sizeof("HTTP/1.1 " #num " " phrase "\r\n") - 1;                    \
+    return "HTTP/1.1 " #num " " phrase "\r\n";
+  switch (status) {
+    LHTTP_WRITER_STATUS_MAP(XX)
+  default:
+    return NULL;
+  }
+#undef XX
+}
+
+static char *lhttp_writer_put2(char *p, int n) {
+  *p++ = (char)('0' + n / 10);
+  *p++ = (char)('0' + n % 10);
+  return p;
+}
+
+const char *lhttp_writer_date_line(size_t *len) {
+  static const char days[] = "SunMonTueWedThuFriSat";
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  static __thread char line[sizeof("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n")];
+  static __thread time_t cached;
+  time_t now = time(NULL);
+
+  if (now != cached || line[0] == '\0') {
+    struct tm tm;
+    char *p = line;
+
+    gmtime_r(&now, &tm);
+    memcpy(p, "Date: ", 6);
+    memcpy(p + 6, days + 3 * tm.tm_wday, 3);
+    p += 9;
+    *p++ = ',';
+    *p++ = ' ';
+    p = lhttp_writer_put2(p, tm.tm_mday);
+    *p++ = ' ';
+    memcpy(p, months + 3 * tm.tm_mon, 3);
+    p += 3;
+    *p++ = ' ';
+    p = lhttp_writer_put2(p, (tm.tm_year + 1900) / 100 % 100);
+    p = lhttp_writer_put2(p, (tm.tm_year + 1900) % 100);
+    *p++ = ' ';
+    p = lhttp_writer_put2(p, tm.tm_hour);
+    *p++ = ':';
+    p = lhttp_writer_put2(p, tm.tm_min);
+    *p++ = ':';
+    p = lhttp_writer_put2(p, tm.tm_sec);
+    memcpy(p, " GMT\r\n", 7);
+    cached = now;
+  }
+  *len = sizeof(line) - 1;
+  return line;
+}
+
+/* tchar of RFC 9110 */
+static int lhttp_writer_is_token(const char *s, size_t len) {
+  size_t i;
+
+  if (len == 0) return 0;
+  for (i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)s[i];
+
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9'))
+      continue;
+    if (c == 0 || strchr("!#$%&'*+-.^_`|~", c) == NULL) return 0;
+  }
+  return 1;
+}
+
+/* Whether `s` has none of the bytes in `bad`, NUL included */
+static int lhttp_writer_is_clean(const char *s, size_t len, const char *bad) {
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    if (s[i] == '\0' || strchr(bad, s[i]) != NULL) return 0;
+  return 1;
+}
+
+int lhttp_writer_status(lhttp_wbuf *b, int status) {
+  size_t len;
+  const char *line = lhttp_writer_status_line(status, &len);
+  char generic[] = "HTTP/1.1 000 \r\n";
+
+  if (line) return lhttp_wbuf_append(b, line, len);
+  if (status < 100 || status > 999) return LHTTP_W_INVALID;
+  generic[9] = (char)('0' + status / 100);
+  generic[10] = (char)('0' + status / 10 % 10);
+  generic[11] = (char)('0' + status % 10);
+  return lhttp_wbuf_append(b, generic, sizeof(generic) - 1);
+}
+
+int lhttp_writer_request_line(lhttp_wbuf *b, const char *method, size_t mlen,
+                              const char *target, size_t tlen) {
+  char *p;
+
+  if (!lhttp_writer_is_token(method, mlen) || tlen == 0 ||
+      !lhttp_writer_is_clean(target, tlen, " \r\n"))
+    return LHTTP_W_INVALID;
+  if (lhttp_wbuf_reserve(b, mlen + tlen + sizeof("  HTTP/1.1\r\n") - 1))
+    return LHTTP_W_FULL;
+
+  p = b->data + b->len;
+  memcpy(p, method, mlen);
+  p += mlen;
+  *p++ = ' ';
+  memcpy(p, target, tlen);
+  p += tlen;
+  memcpy(p, " HTTP/1.1\r\n", 11);
+  b->len = p + 11 - b->data;
+  return LHTTP_W_OK;
+}
+
+int lhttp_writer_header(lhttp_wbuf *b, const char *name, size_t nlen,
+                        const char *value, size_t vlen) {
+  char *p;
+
+  if (!lhttp_writer_is_token(name, nlen) ||
+      !lhttp_writer_is_clean(value, vlen, "\r\n"))
+    return LHTTP_W_INVALID;
+  if (lhttp_wbuf_reserve(b, nlen + vlen + 4)) return LHTTP_W_FULL;
+
+  p = b->data + b->len;
+  memcpy(p, name, nlen);
+  p += nlen;
+  *p++ = ':';
+  *p++ = ' ';
+  if (vlen) memcpy(p, value, vlen);
+  p += vlen;
+  *p++ = '\r';
+  *p++ = '\n';
+  b->len = p - b->data;
+  return LHTTP_W_OK;
+}
+
+int lhttp_writer_date(lhttp_wbuf *b) {
+  size_t len;
+  const char *line = lhttp_writer_date_line(&len);
+
+  return lhttp_wbuf_append(b, line, len);
+}
+
+int lhttp_writer_content_length(lhttp_wbuf *b, uint64_t length) {
+  char digits[20];
+  int n = sizeof(digits);
+
+  do {
+    digits[--n] = (char)('0' + length % 10);
+    length /= 10;
+  } while (length);
+  return lhttp_writer_header(b, "Content-Length", 14, digits + n,
+                             sizeof(digits) - n);
+}
+
+int lhttp_writer_end_head(lhttp_wbuf *b) {
+  return lhttp_wbuf_append(b, "\r\n", 2);
+}
+
+int lhttp_writer_iov(const lhttp_wbuf *head, const char *body, size_t len,
+                     struct iovec iov[2]) {
+  iov[0].iov_base = head->data;
+  iov[0].iov_len = head->len;
+  if (len == 0) return 1;
+  iov[1].iov_base = (void *)body;
+  iov[1].iov_len = len;
+  return 2;
+}
+
+/*****************************************************************************/
+void lhttp_body_init_chunked(lhttp_body_writer *w) {
+  memset(w, 0, sizeof(*w));
+  w->chunked = 1;
+}
+
+void lhttp_body_init_length(lhttp_body_writer *w, uint64_t length) {
+  memset(w, 0, sizeof(*w));
+  w->remaining = length;
+}
+
+static void lhttp_body_iov(struct iovec *iov, const char *data, size_t len) {
+  iov->iov_base = (void *)data;
+  iov->iov_len = len;
+}
+
+int lhttp_body_write(lhttp_body_writer *w, const char *data, size_t len,
+                     struct iovec iov[3]) {
+  static const char hex[] = "0123456789abcdef";
+  char *p = w->line + sizeof(w->line);
+  size_t n = len;
+
+  if (w->ended || (!w->chunked && len > w->remaining)) return LHTTP_W_INVALID;
+  /* an empty chunk would end the body */
+  if (len == 0) return 0;
+  if (!w->chunked) {
+    w->remaining -= len;
+    lhttp_body_iov(&iov[0], data, len);
+    return 1;
+  }
+
+  /* the size line is written backwards from the end of `line` */
+  *--p = '\n';
+  *--p = '\r';
+  do {
+    *--p = hex[n & 0xf];
+    n >>= 4;
+  } while (n);
+  lhttp_body_iov(&iov[0], p, w->line + sizeof(w->line) - p);
+  lhttp_body_iov(&iov[1], data, len);
+  lhttp_body_iov(&iov[2], "\r\n", 2);
+  return 3;
+}
+
+int lhttp_body_end(lhttp_body_writer *w, const lhttp_wbuf *trailers,
+                   struct iovec iov[3]) {
+  int n = 0;
+
+  if (w->ended || (!w->chunked && w->remaining)) return LHTTP_W_INVALID;
+  w->ended = 1;
+  if (!w->chunked) return 0;
+
+  lhttp_body_iov(&iov[n++], "0\r\n", 3);
+  if (trailers && trailers->len)
+    lhttp_body_iov(&iov[n++], trailers->data, trailers->len);
+  lhttp_body_iov(&iov[n++], "\r\n", 2);
+  return n;
+}
+
+/*****************************************************************************/
+/* Headers given by the caller that are otherwise added */
+#define LHTTP_W_SEEN_DATE   0x01
+#define LHTTP_W_SEEN_LENGTH 0x02  /* Content-Length or Transfer-Encoding */
+
+static int lhttp_writer_name_is(const char *name, size_t len,
+                                const char *lower, size_t llen) {
+  size_t i;
+
+  if (len != llen) return 0;
+  for (i = 0; i < len; i++) {
+    char c = name[i];
+    if (c >= 'A' && c <= 'Z') c |= 0x20;
+    if (c != lower[i]) return 0;
+  }
+  return 1;
+}
+
+/* Undo the partial message and raise the error of a write */
+static void lhttp_writer_fail(lua_State *L, lhttp_wbuf *b, size_t mark,
+                              int err, const char *what) {
+  b->len = mark;
+  if (err == LHTTP_W_FULL) luaL_error(L, "not enough memory");
+  luaL_error(L, "invalid %s", what);
+}
+
+static void lhttp_writer_lua_value(lua_State *L, lhttp_wbuf *b, size_t mark,
+                                   const char *name, size_t nlen, int idx) {
+  int t = lua_type(L, idx);
+  const char *value;
+  size_t vlen;
+  int err;
+
+  /* false leaves the header out, and stops it from being added */
+  if (t == LUA_TBOOLEAN && !lua_toboolean(L, idx)) return;
+  if (t != LUA_TSTRING && t != LUA_TNUMBER) {
+    b->len = mark;
+    luaL_error(L, "header '%s' must be a string, a number, an array or false",
+               name);
+  }
+  value = lua_tolstring(L, idx, &vlen);
+  err = lhttp_writer_header(b, name, nlen, value, vlen);
+  if (err) lhttp_writer_fail(L, b, mark, err, "header");
+}
+
+/* Write the headers of the table at `idx`, name = value or name = array of
+ * values, and return the LHTTP_W_SEEN_* bits */
+static unsigned lhttp_writer_lua_headers(lua_State *L, lhttp_wbuf *b,
+                                         size_t mark, int idx) {
+  unsigned seen = 0;
+
+  if (lua_isnoneornil(L, idx)) return 0;
+  luaL_checktype(L, idx, LUA_TTABLE);
+
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    const char *name;
+    size_t nlen;
+
+    if (lua_type(L, -2) != LUA_TSTRING) {
+      b->len = mark;
+      luaL_error(L, "header names must be strings");
+    }
+    name = lua_tolstring(L, -2, &nlen);
+    if (lhttp_writer_name_is(name, nlen, "date", 4))
+      seen |= LHTTP_W_SEEN_DATE;
+    else if (lhttp_writer_name_is(name, nlen, "content-length", 14) ||
+             lhttp_writer_name_is(name, nlen, "transfer-encoding", 17))
+      seen |= LHTTP_W_SEEN_LENGTH;
+
+    if (lua_istable(L, -1)) {
+      int i, n = (int)lua_rawlen(L, -1);
+
+      for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, -1, i);
+        lhttp_writer_lua_value(L, b, mark, name, nlen, lua_gettop(L));
+        lua_pop(L, 1);
+      }
+    } else {
+      lhttp_writer_lua_value(L, b, mark, name, nlen, lua_gettop(L));
+    }
+    lua_pop(L, 1);
+  }
+  return seen;
+}
+
+/* Responses that never have a body, RFC 9110 6.4.1 */
+static int lhttp_writer_has_body(int status) {
+  return status >= 200 && status != 204 && status != 304;
+}
+
+/* Write the response of the arguments from `idx`: status, headers, body.
+ * With `head_only` the body is only counted in Content-Length */
+void lhttp_writer_lua_response(lua_State *L, lhttp_wbuf *b, int idx,
+                               int head_only) {
+  size_t mark = b->len, blen = 0;
+  int status = (int)luaL_checkinteger(L, idx);
+  const char *body = luaL_optlstring(L, idx + 2, NULL, &blen);
+  unsigned seen;
+  int err;
+
+  /* the peer would read those bytes as the next response */
+  if (blen && !lhttp_writer_has_body(status))
+    luaL_error(L, "a %d response has no body", status);
+  err = lhttp_writer_status(b, status);
+  if (err) lhttp_writer_fail(L, b, mark, err, "status");
+  seen = lhttp_writer_lua_headers(L, b, mark, idx + 1);
+  if (!(seen & LHTTP_W_SEEN_DATE) && (err = lhttp_writer_date(b)))
+    lhttp_writer_fail(L, b, mark, err, "date");
+  if (body && !(seen & LHTTP_W_SEEN_LENGTH) && lhttp_writer_has_body(status) &&
+      (err = lhttp_writer_content_length(b, blen)))
+    lhttp_writer_fail(L, b, mark, err, "content length");
+  if ((err = lhttp_writer_end_head(b)))
+    lhttp_writer_fail(L, b, mark, err, "head");
+  if (body && !head_only && (err = lhttp_wbuf_append(b, body, blen)))
+    lhttp_writer_fail(L, b, mark, err, "body");
+}
+
+/* Same for a request: method, target, headers, body */
+static void lhttp_writer_lua_request(lua_State *L, lhttp_wbuf *b, int idx,
+                                     int head_only) {
+  size_t mark = b->len, mlen, tlen, blen = 0;
+  const char *method = luaL_checklstring(L, idx, &mlen);
+  const char *target = luaL_checklstring(L, idx + 1, &tlen);
+  const char *body = luaL_optlstring(L, idx + 3, NULL, &blen);
+  unsigned seen;
+  int err;
+
+  err = lhttp_writer_request_line(b, method, mlen, target, tlen);
+  if (err) lhttp_writer_fail(L, b, mark, err, "request line");
+  seen = lhttp_writer_lua_headers(L, b, mark, idx + 2);
+  if (body && !(seen & LHTTP_W_SEEN_LENGTH) &&
+      (err = lhttp_writer_content_length(b, blen)))
+    lhttp_writer_fail(L, b, mark, err, "content length");
+  if ((err = lhttp_writer_end_head(b)))
+    lhttp_writer_fail(L, b, mark, err, "head");
+  if (body && !head_only && (err = lhttp_wbuf_append(b, body, blen)))
+    lhttp_writer_fail(L, b, mark, err, "body");
+}
+
+/*****************************************************************************/
+static lhttp_wbuf *lhttp_writer_check(lua_State *L, int idx) {
+  return luaL_checkudata(L, idx, LHTTP_WRITER_BUFFER);
+}
+
+/***
+ * Create a buffer to write messages into
+ *
+ * The buffer grows as needed and keeps its memory across `reset`, so one
+ * buffer per connection serializes every response without new allocations.
+ *
+ * @function buffer
+ * @tparam[opt] integer size Initial capacity in bytes
+ * @treturn userdata New buffer object
+ * @usage
+ * local buf = lhttp_writer.buffer(4096)
+ * buf:response(200, { ['Content-Type'] = 'text/plain' }, 'hello')
+ * sock:write(buf:tostring())
+ * buf:reset()
+ */
+static int lhttp_writer_buffer(lua_State *L) {
+  lua_Integer size = luaL_optinteger(L, 1, 0);
+  lhttp_wbuf *b = lua_newuserdata(L, sizeof(*b));
+
+  luaL_argcheck(L, size >= 0, 1, "must not be negative");
+  lhttp_wbuf_init(b, NULL, 0);
+  luaL_getmetatable(L, LHTTP_WRITER_BUFFER);
+  lua_setmetatable(L, -2);
+  if (size > 0 && lhttp_wbuf_reserve(b, (size_t)size))
+    luaL_error(L, "not enough memory");
+  return 1;
+}
+
+/***
+ * Append a response
+ *
+ * Writes the status line, the headers, a `Date` header and, when a body is
+ * given, a `Content-Length` header then the body. Headers set by the caller
+ * are not added again, `false` as value leaves a header out. 1xx, 204 and
+ * 304 responses take no body, a non-empty one raises an error.
+ *
+ * @function buffer:response
+ * @tparam integer status Status code, from 100 to 999
+ * @tparam[opt] table headers Maps each name to a value or to an array of
+ *   values for a repeated header, in the order of `pairs`
+ * @tparam[opt] string body Body of the response
+ * @treturn userdata The buffer
+ */
+static int lhttp_writer_buffer_response(lua_State *L) {
+  lhttp_wbuf *b = lhttp_writer_check(L, 1);
+
+  lhttp_writer_lua_response(L, b, 2, 0);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/***
+ * Append a request
+ *
+ * Writes the request line and the headers, then a `Content-Length` header
+ * and the body when a body is given.
+ *
+ * @function buffer:request
+ * @tparam string method Method, such as `'GET'`
+ * @tparam string target Request target, such as `'/index.html'`
+ * @tparam[opt] table headers As for `response`
+ * @tparam[opt] string body Body of the request
+ * @treturn userdata The buffer
+ */
+static int lhttp_writer_buffer_request(lua_State *L) {
+  lhttp_wbuf *b = lhttp_writer_check(L, 1);
+
+  lhttp_writer_lua_request(L, b, 2, 0);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/***
+ * Append raw bytes
+ *
+ * @function buffer:write
+ * @tparam string ... Strings appended as they are
+ * @treturn userdata The buffer
+ */
+static int lhttp_writer_buffer_write(lua_State *L) {
+  lhttp_wbuf *b = lhttp_writer_check(L, 1);
+  int i, n = lua_gettop(L);
+
+  for (i = 2; i <= n; i++) {
+    size_t len;
+    const char *s = luaL_checklstring(L, i, &len);
+
+    if (lhttp_wbuf_append(b, s, len)) luaL_error(L, "not enough memory");
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+/***
+ * Get the content of the buffer as a string
+ *
+ * @function buffer:tostring
+ * @treturn string Bytes written since the last `reset`
+ */
+static int lhttp_writer_buffer_tostring(lua_State *L) {
+  lhttp_wbuf *b = lhttp_writer_check(L, 1);
+
+  lua_pushlstring(L, b->data ? b->data : "", b->len);
+  return 1;
+}
+
+/***
+ * Get the content of the buffer without copying it
+ *
+ * The pointer is valid until the next write into the buffer, LuaJIT FFI
+ * can cast it to `const char *`.
+ *
+ * @function buffer:pointer
+ * @treturn lightuserdata First byte of the buffer
+ * @treturn integer Number of bytes written
+ */
+static int lhttp_writer_buffer_pointer(lua_State *L) {
+  lhttp_wbuf *b = lhttp_writer_check(L, 1);
+
+  lua_pushlightuserdata(L, b->data);
+  lua_pushinteger(L, (lua_Integer)b->len);
+  return 2;
+}
+
+/***
+ * Empty the buffer, keeping its memory
+ *
+ * @function buffer:reset
+ * @treturn userdata The buffer
+ */
+static int lhttp_writer_buffer_reset(lua_State *L) {
+  lhttp_wbuf *b = lhttp_writer_check(L, 1);
+
+  b->len = 0;
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int lhttp_writer_buffer_len(lua_State *L) {
+  lhttp_wbuf *b = lhttp_writer_check(L, 1);
+
+  lua_pushinteger(L, (lua_Integer)b->len);
+  return 1;
+}
+
+static int lhttp_writer_buffer_gc(lua_State *L) {
+  lhttp_wbuf_free(lhttp_writer_check(L, 1));
+  return 0;
+}
+
+/***
+ * Get the status line of a status code
+ *
+ * @function status_line
+ * @tparam integer status Status code
+ * @treturn string|nil `"HTTP/1.1 404 Not Found\r\n"`, nil for a code llhttp
+ *   does not know
+ */
+static int lhttp_writer_status_line_l(lua_State *L) {
+  size_t len;
+  const char *line =
+      lhttp_writer_status_line((int)luaL_checkinteger(L, 1), &len);
+
+  if (line == NULL) return 0;
+  lua_pushlstring(L, line, len);
+  return 1;
+}
+
+/***
+ * Get the current date in the format of the `Date` header
+ *
+ * @function date
+ * @treturn string Such as `"Sun, 06 Nov 1994 08:49:37 GMT"`, formatted at
+ *   most once per second
+ */
+static int lhttp_writer_date_l(lua_State *L) {
+  size_t len;
+  const char *line = lhttp_writer_date_line(&len);
+
+  /* without "Date: " and CRLF */
+  lua_pushlstring(L, line + 6, len - 8);
+  return 1;
+}
+
+/***
+ * Serialize a response
+ *
+ * Same as `buffer:response` into a buffer kept by the module, the result
+ * comes as one string.
+ *
+ * @function response
+ * @tparam integer status Status code
+ * @tparam[opt] table headers Response headers
+ * @tparam[opt] string body Response body
+ * @treturn string The response
+ * @usage
+ * local w = require('lhttp_writer')
+ * sock:write(w.response(200, { ['Content-Type'] = 'text/plain' }, 'hello'))
+ */
+static int lhttp_writer_response(lua_State *L) {
+  lhttp_wbuf *b = lua_touserdata(L, lua_upvalueindex(1));
+
+  b->len = 0;
+  lhttp_writer_lua_response(L, b, 1, 0);
+  lua_pushlstring(L, b->data, b->len);
+  return 1;
+}
+
+/***
+ * Serialize a response as a list of strings
+ *
+ * The head is serialized in C and the body is not concatenated to it, hand
+ * the list to a vectored write such as luv's `uv.write(stream, list)`.
+ *
+ * @function responsev
+ * @tparam integer status Status code
+ * @tparam[opt] table headers Response headers
+ * @tparam[opt] string body Response body
+ * @treturn table `{ head, body }`, or `{ head }` without a body
+ */
+static int lhttp_writer_responsev(lua_State *L) {
+  lhttp_wbuf *b = lua_touserdata(L, lua_upvalueindex(1));
+
+  b->len = 0;
+  lhttp_writer_lua_response(L, b, 1, 1);
+  lua_createtable(L, 2, 0);
+  lua_pushlstring(L, b->data, b->len);
+  lua_rawseti(L, -2, 1);
+  if (!lua_isnoneornil(L, 3)) {
+    lua_pushvalue(L, 3);
+    lua_rawseti(L, -2, 2);
+  }
+  return 1;
+}
+
+/***
+ * Serialize a request
+ *
+ * Same as `buffer:request` into a buffer kept by the module.
+ *
+ * @function request
+ * @tparam string method Request method
+ * @tparam string target Request target
+ * @tparam[opt] table headers Request headers
+ * @tparam[opt] string body Request body
+ * @treturn string The request
+ */
+static int lhttp_writer_request(lua_State *L) {
+  lhttp_wbuf *b = lua_touserdata(L, lua_upvalueindex(1));
+
+  b->len = 0;
+  lhttp_writer_lua_request(L, b, 1, 0);
+  lua_pushlstring(L, b->data, b->len);
+  return 1;
+}
+
+/*****************************************************************************/
+static lhttp_body_writer *lhttp_writer_body_check(lua_State *L, int idx) {
+  return luaL_checkudata(L, idx, LHTTP_WRITER_BODY);
+}
+
+static int lhttp_writer_body_new(lua_State *L, int chunked, uint64_t length) {
+  lhttp_body_writer *w = lua_newuserdata(L, sizeof(*w));
+
+  if (chunked)
+    lhttp_body_init_chunked(w);
+  else
+    lhttp_body_init_length(w, length);
+  luaL_getmetatable(L, LHTTP_WRITER_BODY);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+/***
+ * Create a body writer for chunked transfer-encoding
+ *
+ * Goes with a head that has `['Transfer-Encoding'] = 'chunked'`.
+ *
+ * @function chunked
+ * @treturn userdata New body writer
+ * @usage
+ * local body = lhttp_writer.chunked()
+ * uv.write(sock, w.responsev(200, { ['Transfer-Encoding'] = 'chunked' }))
+ * uv.write(sock, body:write(data))
+ * uv.write(sock, body:finish())
+ */
+static int lhttp_writer_chunked(lua_State *L) {
+  return lhttp_writer_body_new(L, 1, 0);
+}
+
+/***
+ * Create a body writer that counts down a Content-Length
+ *
+ * Writes pass the payload through and raise an error once they go past
+ * `length`, `finish` raises one if the body is shorter.
+ *
+ * @function body
+ * @tparam integer length The declared Content-Length
+ * @treturn userdata New body writer
+ */
+static int lhttp_writer_body(lua_State *L) {
+  lua_Integer length = luaL_checkinteger(L, 1);
+
+  luaL_argcheck(L, length >= 0, 1, "must not be negative");
+  return lhttp_writer_body_new(L, 0, (uint64_t)length);
+}
+
+/* Raise `fmt` with the bytes a counted body is off by, as its `%s` */
+static int lhttp_writer_body_error(lua_State *L, const char *fmt,
+                                   uint64_t bytes) {
+  char digits[24];
+
+  snprintf(digits, sizeof(digits), "%llu", (unsigned long long)bytes);
+  return luaL_error(L, fmt, digits);
+}
+
+/* The list at `idx`, or a new one, on top of the stack */
+static void lhttp_writer_list(lua_State *L, int idx) {
+  if (lua_isnoneornil(L, idx)) {
+    lua_createtable(L, 3, 0);
+  } else {
+    luaL_checktype(L, idx, LUA_TTABLE);
+    lua_pushvalue(L, idx);
+  }
+}
+
+static void lhttp_writer_list_add(lua_State *L, const char *s, size_t len) {
+  lua_pushlstring(L, s, len);
+  lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+}
+
+/***
+ * Frame a piece of the body
+ *
+ * A chunk adds its size line, the payload string itself and CRLF to the
+ * list, a counted body adds the payload. The payload is not copied, the list
+ * goes to a vectored write such as luv's `uv.write(stream, list)`. An empty
+ * payload adds nothing.
+ *
+ * @function body:write
+ * @tparam string data Payload
+ * @tparam[opt] table list List to append to, to send several pieces at once
+ * @treturn table The list
+ */
+static int lhttp_writer_body_write(lua_State *L) {
+  lhttp_body_writer *w = lhttp_writer_body_check(L, 1);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  struct iovec iov[3];
+  int n = lhttp_body_write(w, data, len, iov);
+
+  if (n < 0) {
+    if (w->ended) return luaL_error(L, "body already finished");
+    return lhttp_writer_body_error(
+        L, "body longer than its Content-Length, %s bytes left", w->remaining);
+  }
+  lhttp_writer_list(L, 3);
+  if (n == 3) lhttp_writer_list_add(L, iov[0].iov_base, iov[0].iov_len);
+  if (n > 0) {
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+  }
+  if (n == 3) lhttp_writer_list_add(L, "\r\n", 2);
+  return 1;
+}
+
+/***
+ * End the body
+ *
+ * A chunked body gets its last chunk and the trailers, as one string added
+ * to the list. A counted body adds nothing, but raises an error when it is
+ * shorter than declared.
+ *
+ * @function body:finish
+ * @tparam[opt] table trailers Trailer headers of a chunked body, as the
+ *   headers of `response`
+ * @tparam[opt] table list List to append to
+ * @treturn table The list
+ */
+static int lhttp_writer_body_finish(lua_State *L) {
+  lhttp_body_writer *w = lhttp_writer_body_check(L, 1);
+  lhttp_wbuf *trailers = NULL;
+  struct iovec iov[3];
+  luaL_Buffer b;
+  int i, n;
+
+  if (w->chunked && !lua_isnoneornil(L, 2)) {
+    lua_pushcfunction(L, lhttp_writer_buffer);
+    lua_call(L, 0, 1);
+    trailers = lua_touserdata(L, -1);
+    lhttp_writer_lua_headers(L, trailers, 0, 2);
+  }
+  n = lhttp_body_end(w, trailers, iov);
+  if (n < 0) {
+    if (w->ended) return luaL_error(L, "body already finished");
+    return lhttp_writer_body_error(
+        L, "body shorter than its Content-Length, %s bytes missing",
+        w->remaining);
+  }
+
+  lhttp_writer_list(L, 3);
+  if (n == 0) return 1;
+  luaL_buffinit(L, &b);
+  for (i = 0; i < n; i++) luaL_addlstring(&b, iov[i].iov_base, iov[i].iov_len);
+  luaL_pushresult(&b);
+  lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+  return 1;
+}
+
+/***
+ * Bytes still due by a counted body
+ *
+ * @function body:remaining
+ * @treturn integer|nil Bytes left to write, nil for a chunked body
+ */
+static int lhttp_writer_body_remaining(lua_State *L) {
+  lhttp_body_writer *w = lhttp_writer_body_check(L, 1);
+
+  if (w->chunked) return 0;
+  lua_pushinteger(L, (lua_Integer)w->remaining);
+  return 1;
+}
+
+static const luaL_Reg lhttp_writer_body_m[] = {
+    {"write", lhttp_writer_body_write},
+    {"finish", lhttp_writer_body_finish},
+    {"remaining", lhttp_writer_body_remaining},
+
+    {NULL, NULL}};
+
+static const luaL_Reg lhttp_writer_buffer_m[] = {
+    {"response", lhttp_writer_buffer_response},
+    {"request", lhttp_writer_buffer_request},
+    {"write", lhttp_writer_buffer_write},
+    {"tostring", lhttp_writer_buffer_tostring},
+    {"pointer", lhttp_writer_buffer_pointer},
+    {"reset", lhttp_writer_buffer_reset},
+
+    {NULL, NULL}};
+
+static const luaL_Reg lhttp_writer_f[] = {
+    {"buffer", lhttp_writer_buffer},
+    {"status_line", lhttp_writer_status_line_l},
+    {"date", lhttp_writer_date_l},
+    {"chunked", lhttp_writer_chunked},
+    {"body", lhttp_writer_body},
+
+    {NULL, NULL}};
+
+/* Functions sharing the module buffer, their upvalue */
+static const luaL_Reg lhttp_writer_shared_f[] = {
+    {"response", lhttp_writer_response},
+    {"responsev", lhttp_writer_responsev},
+    {"request", lhttp_writer_request},
+
+    {NULL, NULL}};
+
+LUALIB_API int luaopen_lhttp_writer(lua_State *L) {
+  const luaL_Reg *f;
+
+  luaL_newmetatable(L, LHTTP_WRITER_BUFFER);
+  lua_pushcfunction(L, lhttp_writer_buffer_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pushcfunction(L, lhttp_writer_buffer_len);
+  lua_setfield(L, -2, "__len");
+  lua_newtable(L);
+  luaL_setfuncs(L, lhttp_writer_buffer_m, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LHTTP_WRITER_BODY);
+  lua_newtable(L);
+  luaL_setfuncs(L, lhttp_writer_body_m, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newlib(L, lhttp_writer_f);
+  lua_pushcfunction(L, lhttp_writer_buffer);
+  lua_call(L, 0, 1);
+  for (f = lhttp_writer_shared_f; f->name; f++) {
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, f->func, 1);
+    lua_setfield(L, -3, f->name);
+  }
+  lua_pop(L, 1);
+  return 1;
+}
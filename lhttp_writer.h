@@ -0,0 +1,127 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/* HTTP/1.1 message writer, the serializing half next to the parser.
+ *
+ * A message head is written into an lhttp_wbuf, either a fixed buffer given
+ * by the caller or a growable one. Writes return LHTTP_W_OK, LHTTP_W_FULL
+ * when a fixed buffer is too small or memory runs out, LHTTP_W_INVALID for a
+ * status, method, target or header that would break the framing. A failed
+ * write leaves the buffer as it was.
+ *
+ *   lhttp_wbuf b;
+ *   lhttp_wbuf_init(&b, NULL, 0);
+ *   lhttp_writer_status(&b, 200);
+ *   lhttp_writer_date(&b);
+ *   lhttp_writer_header(&b, "Content-Type", 12, "text/plain", 10);
+ *   lhttp_writer_content_length(&b, body_len);
+ *   lhttp_writer_end_head(&b);
+ *   writev(fd, iov, lhttp_writer_iov(&b, body, body_len, iov));
+ */
+
+#ifndef LHTTP_WRITER_H
+#define LHTTP_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+enum { LHTTP_W_OK = 0, LHTTP_W_FULL = -1, LHTTP_W_INVALID = -2 };
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t size;
+  int fixed;              /* data belongs to the caller and does not grow */
+} lhttp_wbuf;
+
+/* A NULL `data` makes a growable buffer, release it with lhttp_wbuf_free */
+void lhttp_wbuf_init(lhttp_wbuf *b, char *data, size_t size);
+void lhttp_wbuf_free(lhttp_wbuf *b);
+int lhttp_wbuf_append(lhttp_wbuf *b, const char *s, size_t len);
+
+/* "HTTP/1.1 200 OK\r\n" for the codes llhttp knows, NULL for others */
+const char *lhttp_writer_status_line(int status, size_t *len);
+
+/* "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n", formatted at most once per
+ * second and per thread */
+const char *lhttp_writer_date_line(size_t *len);
+
+/* Start line, a status from 100 to 999 or a request line */
+int lhttp_writer_status(lhttp_wbuf *b, int status);
+int lhttp_writer_request_line(lhttp_wbuf *b, const char *method, size_t mlen,
+                              const char *target, size_t tlen);
+
+/* Header lines, the name must be a token and the value hold no CR, LF or
+ * NUL */
+int lhttp_writer_header(lhttp_wbuf *b, const char *name, size_t nlen,
+                        const char *value, size_t vlen);
+int lhttp_writer_date(lhttp_wbuf *b);
+int lhttp_writer_content_length(lhttp_wbuf *b, uint64_t length);
+
+/* The empty line closing the head */
+int lhttp_writer_end_head(lhttp_wbuf *b);
+
+/* Fill `iov` with the head then the body, which is referenced and not
+ * copied, and return the number of entries used */
+int lhttp_writer_iov(const lhttp_wbuf *head, const char *body, size_t len,
+                     struct iovec iov[2]);
+
+/* Body framing, chunked or counted down from a Content-Length.
+ *
+ * Each write fills iovec entries that reference the payload, only the chunk
+ * size line is stored in the writer, valid until its next call:
+ *
+ *   lhttp_body_writer bw;
+ *   struct iovec iov[3];
+ *   lhttp_body_init_chunked(&bw);
+ *   writev(fd, iov, lhttp_body_write(&bw, data, len, iov));
+ *   writev(fd, iov, lhttp_body_end(&bw, NULL, iov));
+ *
+ * The calls return the number of entries, 0 for an empty write, or
+ * LHTTP_W_INVALID for a write past the declared length, a counted body
+ * ended short or any call after the end.
+ */
+typedef struct {
+  int chunked;
+  int ended;
+  uint64_t remaining;     /* bytes still due with a Content-Length */
+  char line[20];          /* size line of the last chunk */
+} lhttp_body_writer;
+
+void lhttp_body_init_chunked(lhttp_body_writer *w);
+void lhttp_body_init_length(lhttp_body_writer *w, uint64_t length);
+
+/* A chunk takes 3 entries (size line, payload, CRLF), a counted write 1 */
+int lhttp_body_write(lhttp_body_writer *w, const char *data, size_t len,
+                     struct iovec iov[3]);
+
+/* The last chunk, then the header lines of `trailers` if not NULL, then the
+ * empty line: up to 3 entries. A counted body must be complete, 0 entries */
+int lhttp_body_end(lhttp_body_writer *w, const lhttp_wbuf *trailers,
+                   struct iovec iov[3]);
+
+/* For the other Lua modules of the library, include lua.h first */
+#ifdef LUA_VERSION_NUM
+/* Append the response of the Lua arguments from `idx` (status, headers,
+ * body) as buffer:response does, raising Lua errors. With `head_only` the
+ * body is counted in Content-Length but left to the caller */
+void lhttp_writer_lua_response(lua_State *L, lhttp_wbuf *b, int idx,
+                               int head_only);
+#endif
+
+#endif /* LHTTP_WRITER_H */
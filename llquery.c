@@ -1,4 +1,5 @@
 #include "llquery.h"
+#include "lhttp_probes.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -298,11 +299,12 @@ enum llquery_error llquery_parse(const char *query,
   return llquery_parse_ex(query, query_len, q, NULL, 0);
 }
 
-enum llquery_error llquery_parse_ex(const char *query,
-                                    size_t query_len,
-                                    struct llquery *q,
-                                    char *decode_buf,
-                                    size_t decode_buf_size) {
+/* Body of llquery_parse_ex(), which wraps it with the probes */
+static enum llquery_error llquery_parse_impl(const char *query,
+                                             size_t query_len,
+                                             struct llquery *q,
+                                             char *decode_buf,
+                                             size_t decode_buf_size) {
   if (!query || !q || !q->_reserved) {
     return LQE_NULL_INPUT;
   }
@@ -500,6 +502,19 @@ enum llquery_error llquery_parse_ex(const char *query,
   return LQE_OK;
 }
 
+enum llquery_error llquery_parse_ex(const char *query,
+                                    size_t query_len,
+                                    struct llquery *q,
+                                    char *decode_buf,
+                                    size_t decode_buf_size) {
+  enum llquery_error rc;
+
+  LHTTP_PROBE2(query_parse_entry, query, query_len);
+  rc = llquery_parse_impl(query, query_len, q, decode_buf, decode_buf_size);
+  LHTTP_PROBE1(query_parse_return, (int)rc);
+  return rc;
+}
+
 void llquery_free(struct llquery *q) {
   if (!q || !q->_reserved) {
     return;
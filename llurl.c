@@ -20,6 +20,7 @@
  */
 
 #include "llurl.h"
+#include "lhttp_probes.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -706,11 +707,10 @@ static inline int validate_host_percent_encoding(const char *buf, size_t off, si
  * MAIN URL PARSING FUNCTION
  * ============================================================================ */
 
-/* Parse a URL; return nonzero on failure */
-/* 线程安全说明：本函数无全局状态，结构体独立，适用于多线程环境。 */
-int http_parser_parse_url(const char *buf, size_t buflen,
-                          int is_connect,
-                          struct http_parser_url *u) {
+/* Body of http_parser_parse_url(), which wraps it with the probes */
+static int llurl_parse_url(const char *buf, size_t buflen,
+                           int is_connect,
+                           struct http_parser_url *u) {
   enum state state;
   enum http_parser_url_fields field = UF_MAX;
   size_t field_start = 0;
@@ -1206,3 +1206,16 @@ start_parsing:
 
   return 0; /* Success */
 }
+
+/* Parse a URL; return nonzero on failure */
+/* 线程安全说明：本函数无全局状态，结构体独立，适用于多线程环境。 */
+int http_parser_parse_url(const char *buf, size_t buflen,
+                          int is_connect,
+                          struct http_parser_url *u) {
+  int rc;
+
+  LHTTP_PROBE2(parse_url_entry, buf, buflen);
+  rc = llurl_parse_url(buf, buflen, is_connect, u);
+  LHTTP_PROBE1(parse_url_return, rc);
+  return rc;
+}
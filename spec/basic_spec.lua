@@ -277,6 +277,610 @@ Connection: close
     assert(#body == 10, "#body==10")
   end)
 
+  it("lhttp_parser collect_headers", function()
+    local infos = {}
+    local parser = lhp.new('request', {
+      onHeadersComplete = function(info) infos[#infos + 1] = info end
+    }, { collect_headers = true })
+
+    local parts = {
+      "GET / HTTP/1.1\r\nHo", "st: loca", "lhost\r\nEmpty:\r\n",
+      "Accept: a\r\nAccept: b\r\nAccept: c\r\n\r\n",
+      "GET /2 HTTP/1.1\r\nX-Id: 2\r\n\r\n"
+    }
+    for _, part in ipairs(parts) do
+      assert(parser:execute(part) == #part)
+    end
+
+    assert(#infos == 2)
+    local headers = infos[1].headers
+    assert.same({ "Host", "Empty", "Accept" }, { headers[1], headers[2], headers[3] })
+    assert(#headers == 3)
+    assert(headers.Host == "localhost")
+    assert(headers.Empty == "")
+    assert.same({ "a", "b", "c" }, headers.Accept)
+    assert.same({ "X-Id", ["X-Id"] = "2" }, infos[2].headers)
+  end)
+
+  it("lhttp_parser collect", function()
+    local parser = lhp.new('request', nil, { collect = true })
+
+    local nparsed, err, msgs = parser:execute(
+      "POST /a?b=1 HTTP/1.1\r\nHost: x\r\nContent-Length: 10\r\n\r\n01234")
+    assert(err == "HPE_OK")
+    assert(#msgs == 0)
+
+    local tail = "56789GET /b HTTP/1.1\r\nHost: y\r\n\r\n" ..
+                 "PUT /c HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n" ..
+                 "3\r\nabc\r\n0\r\nX-Sum: 1\r\n\r\n"
+    nparsed, err, msgs = parser:execute(tail)
+    assert(nparsed == #tail)
+    assert(err == "HPE_OK")
+    assert(#msgs == 3)
+
+    assert(msgs[1].method == "POST")
+    assert(msgs[1].url == "/a?b=1")
+    assert(msgs[1].body == "0123456789")
+    assert(msgs[1].headers.Host == "x")
+    assert(msgs[1].http_major == 1 and msgs[1].http_minor == 1)
+    assert(msgs[1].should_keep_alive == true)
+
+    assert(msgs[2].method == "GET")
+    assert(msgs[2].url == "/b")
+    assert(msgs[2].body == "")
+    assert.same({ "Host", Host = "y" }, msgs[2].headers)
+
+    assert(msgs[3].body == "abc")
+    assert(msgs[3].headers["Transfer-Encoding"] == "chunked")
+    assert(msgs[3].trailers["X-Sum"] == "1")
+
+    local response = lhp.new('response', nil, { collect = true })
+    response:execute("HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nbody")
+    local n, status, done = response:finish()
+    assert(n == 0 and status == "HPE_OK")
+    assert(done[1].status_code == 200)
+    assert(done[1].status_text == "OK")
+    assert(done[1].body == "body")
+  end)
+
+  it("lhttp_parser body_view", function()
+    local views = {}
+    local parser = lhp.new('request', {
+      onHeadersComplete = function() end,
+      onBody = function(ptr, len, data, i)
+        assert(type(ptr) == 'userdata')
+        views[#views + 1] = data:sub(i, i + len - 1)
+      end
+    }, { body_view = true })
+
+    local head = "POST / HTTP/1.1\r\nContent-Length: 11\r\n\r\nhello"
+    assert(parser:execute(head) == #head)
+    assert(parser:execute("xx world", 3) == 6)
+    assert.same({ "hello", " world" }, views)
+  end)
+
+  it("lhttp_parser header_ids", function()
+    local fields = {}
+    local parser = lhp.new('request', {
+      onHeaderField = function(name, id) fields[#fields + 1] = { name, id } end,
+      onHeadersComplete = function() end
+    }, { header_ids = true })
+
+    local head = "GET / HTTP/1.1\r\nHOST: x\r\nX-Custom: 1\r\nContent-Le"
+    assert(parser:execute(head) == #head)
+    local tail = "ngth: 0\r\nuser-agent: t\r\n\r\n"
+    assert(parser:execute(tail) == #tail)
+
+    assert.same({ "host", lhp.HEADERS.host }, fields[1])
+    assert.same({ "x-custom" }, fields[2])
+    -- a name split over two calls comes in fragments, without ID
+    assert.same({ "content-le" }, fields[3])
+    assert.same({ "ngth" }, fields[4])
+    assert.same({ "user-agent", lhp.HEADERS["user-agent"] }, fields[5])
+    assert(lhp.HEADERS[lhp.HEADERS.host] == "host")
+
+    local collect = lhp.new('request', nil, { collect = true, header_ids = true })
+    local _, _, msgs = collect:execute("GET / HTTP/1.1\r\nHost: a\r\nX-A: b\r\n\r\n")
+    assert.same({ "host", "x-a", host = "a", ["x-a"] = "b" }, msgs[1].headers)
+
+    -- every known name, and names sharing a length and first character
+    local names, ids = {}, {}
+    for name, id in pairs(lhp.HEADERS) do
+      if type(name) == "string" then names[#names + 1] = name; ids[name:upper()] = id end
+    end
+    for _, name in ipairs({ "content-lengtx", "if-matcx", "accept-rangez" }) do
+      names[#names + 1] = name; ids[name:upper()] = false
+    end
+    assert(#names > 50)
+    fields = {}
+    head = "GET / HTTP/1.1\r\n"
+    for _, name in ipairs(names) do head = head .. name:upper() .. ": 1\r\n" end
+    head = head:gsub("CONTENT%-LENGTH: 1", "CONTENT-LENGTH: 0")
+    head = head:gsub("TRANSFER%-ENCODING: 1\r\n", "")
+    parser = lhp.new('request', {
+      onHeaderField = function(name, id) fields[name:upper()] = id or false end,
+      onHeadersComplete = function() end
+    }, { header_ids = true })
+    head = head .. "\r\n"
+    assert(parser:execute(head) == #head)
+    ids["TRANSFER-ENCODING"] = nil
+    assert.same(ids, fields)
+
+    -- a bad callback table raises before the registry slots are taken
+    local function slots()
+      local n = 0
+      for _ in pairs(debug.getregistry()) do n = n + 1 end
+      return n
+    end
+    collectgarbage()
+    local before = slots()
+    for _ = 1, 100 do
+      assert(not pcall(lhp.new, 'request', 1, { header_ids = true, info = 'reuse' }))
+    end
+    collectgarbage()
+    assert(slots() < before + 10)
+  end)
+
+  it("lhttp_parser info modes", function()
+    local data = "GET /a HTTP/1.1\r\nHost: x\r\n\r\n" ..
+                 "POST /b HTTP/1.0\r\nContent-Length: 0\r\n\r\n"
+
+    local args = {}
+    local parser = lhp.new('request', {
+      onHeadersComplete = function(...) args[#args + 1] = { ... } end
+    }, { info = 'args' })
+    assert(parser:execute(data) == #data)
+    assert.same({ "GET", 1, 1, 0, true, false }, args[1])
+    assert(args[2][1] == "POST" and args[2][3] == 0 and args[2][5] == false)
+    assert(bit.band(args[2][4], lhp.F_CONTENT_LENGTH) ~= 0)
+
+    local infos = {}
+    parser = lhp.new('request', {
+      onHeadersComplete = function(info)
+        infos[#infos + 1] = info
+        assert(info.method and info.http_major == 1)
+        info.seen = (info.seen or 0) + 1
+      end
+    }, { info = 'reuse' })
+    assert(parser:execute(data) == #data)
+    assert(#infos == 2 and infos[1] == infos[2])
+    assert(infos[2].method == "POST" and infos[2].seen == 2)
+    assert(infos[2].CONTENT_LENGTH == true)
+
+    assert.has_error(function()
+      lhp.new('request', {}, { info = 'tuple' })
+    end)
+  end)
+
+  it("lhttp_parser limits", function()
+    local function run(options, ...)
+      local parser = lhp.new('request', { onHeadersComplete = function() end }, options)
+      local nparsed, err
+      for _, data in ipairs({ ... }) do
+        nparsed, err = parser:execute(data)
+        if not nparsed then break end
+      end
+      local _, _, reason = parser:http_errno()
+      return nparsed, err, reason
+    end
+
+    local req = "POST /0123456789 HTTP/1.1\r\nHost: x\r\nA: 1\r\nContent-Length: 4\r\n\r\nbody"
+    assert(run({ max_url = 11, max_headers = 3, max_header_bytes = 22, max_body = 4 }, req) == #req)
+
+    assert.same({ nil, "HPE_USER", "max_url" }, { run({ max_url = 10 }, "GET /0123", "456789 ") })
+    assert.same({ nil, "HPE_USER", "max_headers" }, { run({ max_headers = 2 }, req) })
+    assert.same({ nil, "HPE_USER", "max_header_bytes" }, { run({ max_header_bytes = 21 }, req) })
+    assert.same({ nil, "HPE_USER", "max_body" }, { run({ max_body = 3 }, req) })
+
+    local chunked = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n"
+    assert.same({ nil, "HPE_USER", "max_body" }, { run({ max_body = 5 }, chunked, chunked:sub(-8)) })
+
+    -- counters start over with every message
+    assert(run({ max_headers = 1 }, "GET / HTTP/1.1\r\nA: 1\r\n\r\nGET / HTTP/1.1\r\nB: 2\r\n\r\n") == 48)
+
+    assert.has_error(function() lhp.new('request', {}, { max_body = -1 }) end)
+  end)
+
+  it("lhttp_parser lenient flags", function()
+    local req = "GET / HTTP/5.5\r\n\r\n"
+    local cb = { onHeadersComplete = function() end }
+
+    local parser = lhp.new('request', cb)
+    assert.same({ nil, "HPE_INVALID_VERSION" }, { parser:execute(req) })
+
+    parser = lhp.new('request', cb, { lenient_version = true })
+    assert(parser:execute(req) == #req)
+    parser:reset()
+    assert(parser:execute(req) == #req)
+
+    assert(parser:configure({ lenient_version = false }) == parser)
+    assert.same({ nil, "HPE_INVALID_VERSION" }, { parser:execute(req) })
+
+    parser = lhp.new('request', cb)
+    parser:configure({ lenient_version = true, max_url = 1 })
+    assert(parser:execute(req) == #req)
+    assert.same({ nil, "HPE_USER" }, { parser:execute("GET /a HTTP/1.1\r\n\r\n") })
+  end)
+
+  it("lhttp_parser execute range", function()
+    local parser = lhp.new('request', { onHeadersComplete = function() end })
+    local req = "GET / HTTP/1.1\r\n\r\n"
+    assert.same({ 0, "HPE_OK" }, { parser:execute(req, 1, 0) })
+    assert.same({ 3, "HPE_OK" }, { parser:execute(req, 1, 3) })
+    assert.has_error(function() parser:execute(req, 5, 3) end)
+    assert.same({ #req - 3, "HPE_OK" }, { parser:execute(req, 4) })
+  end)
+
+  it("lhttp_parser yieldable", function()
+    local events = {}
+    local parser = lhp.new('request', {
+      onUrl = function(url) events[#events + 1] = url end,
+      onHeadersComplete = function()
+        events[#events + 1] = coroutine.yield('headers')
+      end,
+      onBody = function(chunk)
+        events[#events + 1] = chunk
+        coroutine.yield('body')
+      end,
+      onMessageComplete = function() events[#events + 1] = 'done' end
+    }, { yieldable = true })
+
+    local req = "POST /y HTTP/1.1\r\nContent-Length: 4\r\n\r\nab"
+    local co = coroutine.wrap(function(data) return parser:execute(data) end)
+    assert(co(req) == 'headers')
+    assert(co('resumed') == 'body')
+    assert.same({ #req, "HPE_OK" }, { co() })
+
+    co = coroutine.wrap(function(data, i) return parser:execute(data, i) end)
+    assert(co("xxcd", 3) == 'body')
+    assert.same({ 2, "HPE_OK" }, { co() })
+    assert.same({ "/y", "resumed", "ab", "cd", "done" }, events)
+
+    -- return values of onHeadersComplete are honoured: 1 skips the body
+    local done = false
+    local response = lhp.new('response', {
+      onHeadersComplete = function() coroutine.yield() return 1 end,
+      onMessageComplete = function() done = true end
+    }, { yieldable = true })
+    local head = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n"
+    co = coroutine.wrap(function() return response:execute(head) end)
+    co()
+    assert.same({ #head, "HPE_OK" }, { co() })
+    assert(done)
+
+    -- messages completed by finish
+    done = false
+    response = lhp.new('response', {
+      onHeadersComplete = function() end,
+      onMessageComplete = function() done = coroutine.yield('complete') end
+    }, { yieldable = true })
+    assert(response:execute("HTTP/1.1 200 OK\r\n\r\nbody") == 23)
+    co = coroutine.wrap(function() return response:finish() end)
+    assert(co() == 'complete')
+    assert(co(true) == 0)
+    assert(done == true)
+
+    -- errors end the execute
+    parser = lhp.new('request', {
+      onUrl = function() error('boom') end,
+      onHeadersComplete = function() end
+    }, { yieldable = true })
+    assert.same({ nil, "HPE_USER" }, { parser:execute("GET / HTTP/1.1\r\n\r\n") })
+
+    assert.has_error(function()
+      lhp.new('request', nil, { yieldable = true, collect = true })
+    end)
+  end)
+
+  it("lhttp_parser max_messages_per_execute", function()
+    local n = 0
+    local cb = {
+      onHeadersComplete = function() end,
+      onMessageComplete = function() n = n + 1 end
+    }
+    local req = "GET /a HTTP/1.1\r\n\r\n"
+    local data = req:rep(5)
+
+    local parser = lhp.new('request', cb, { max_messages_per_execute = 2 })
+    assert.same({ 2 * #req, "max_messages_per_execute" }, { parser:execute(data) })
+    assert(n == 2)
+    assert.same({ 2 * #req, "max_messages_per_execute" }, { parser:execute(data, 2 * #req + 1) })
+    assert.same({ #req, "HPE_OK" }, { parser:execute(data, 4 * #req + 1) })
+    assert(n == 5)
+    -- stopping at the end of the data is a plain success
+    assert.same({ 2 * #req, "HPE_OK" }, { parser:execute(req:rep(2)) })
+
+    for _, onMessageComplete in ipairs({ cb.onMessageComplete, false }) do
+      parser = lhp.new('request', {
+        onHeadersComplete = function() coroutine.yield() end,
+        onMessageComplete = onMessageComplete or nil
+      }, { yieldable = true, max_messages_per_execute = 1 })
+      local co = coroutine.wrap(function() return parser:execute(data) end)
+      co()
+      assert.same({ #req, "max_messages_per_execute" }, { co() })
+    end
+  end)
+
+  it("lhttp_parser executev", function()
+    local url, body
+    local cb = {
+      onUrl = function(value) url = (url or '') .. value end,
+      onHeadersComplete = function() end,
+      onBody = function(chunk) body = (body or '') .. (chunk or '') end
+    }
+    local chunks = { "POST /a", "b HTTP/1.1\r\nContent-", "Length: 4\r\n\r\nbo", "", "dy" }
+    local total = #table.concat(chunks)
+
+    local parser = lhp.new('request', cb)
+    assert.same({ total, "HPE_OK", 6 }, { parser:executev(chunks) })
+    assert.same({ "/ab", "body" }, { url, body })
+
+    parser = lhp.new('request', cb)
+    assert.same({ nil, "HPE_INVALID_HEADER_TOKEN", 2 },
+                { parser:executev({ "GET / HTTP/1.1\r\n", "Host : x\r\n\r\n" }) })
+    assert.has_error(function() parser:executev({ "GET", 1 }) end)
+
+    local req = "GET /a HTTP/1.1\r\n\r\n"
+    for _, yieldable in ipairs({ false, true }) do
+      parser = lhp.new('request', { onHeadersComplete = function() end },
+                       { max_messages_per_execute = 2, yieldable = yieldable })
+      assert.same({ 2 * #req, "max_messages_per_execute", 2 },
+                  { parser:executev({ req, req .. req, req }) })
+      assert.same({ 2 * #req, "max_messages_per_execute", 3 },
+                  { parser:executev({ req, req, req }) })
+      assert.same({ 2 * #req, "HPE_OK", 3 }, { parser:executev({ req, req }) })
+    end
+
+    parser = lhp.new('request', cb, { yieldable = true })
+    url, body = nil, nil
+    local co = coroutine.wrap(function() return parser:executev(chunks) end)
+    assert.same({ total, "HPE_OK", 6 }, { co() })
+    assert.same({ "/ab", "body" }, { url, body })
+  end)
+
+  it("lhttp_parser pool", function()
+    local urls = {}
+    local pool = lhp.pool('request', {
+      onUrl = function(url) urls[#urls + 1] = url end,
+      onHeadersComplete = function() end
+    }, 1, { max_url = 8 })
+
+    local p1, p2 = pool:acquire(), pool:acquire()
+    assert(p1 ~= p2)
+    assert(p1:execute("GET /1 HTTP/1.1\r\n\r\n") == 19)
+    assert.same({ nil, "HPE_USER" }, { p2:execute("GET /0123456789 HTTP/1.1\r\n\r\n") })
+
+    -- released parsers come back reset, the pool keeps at most size of them
+    pool:release(p2)
+    pool:release(p1)
+    assert(pool:acquire() == p2)
+    assert(p2:execute("GET /2 HTTP/1.1\r\n\r\n") == 19)
+    assert.same({ "/1", "/2" }, urls)
+    assert(pool:acquire() ~= p1)
+
+    -- configure() lasts until the release, then the pool options are back
+    local p3 = pool:acquire()
+    p3:configure({ max_url = 0, lenient_version = true, max_headers = 1 })
+    assert(p3:execute("GET /0123456789 HTTP/5.5\r\n") == 26)
+    pool:release(p3)
+    assert(pool:acquire() == p3)
+    assert.same({ nil, "HPE_USER" }, { p3:execute("GET /0123456789 HTTP/1.1\r\n\r\n") })
+    pool:release(p3)
+    assert(pool:acquire() == p3)
+    assert.same({ nil, "HPE_INVALID_VERSION" }, { p3:execute("GET / HTTP/5.5\r\n\r\n") })
+    pool:release(p3)
+    assert(pool:acquire() == p3)
+    assert(p3:execute("GET / HTTP/1.1\r\nA: 1\r\nB: 2\r\n\r\n") == 30)
+
+    assert.has_error(function() pool:release(lhp.new('request', {})) end)
+    pool:release(p2)
+    assert.has_error(function() pool:release(p2) end)
+    assert.has_error(function() lhp.pool('bad', {}, 1) end)
+  end)
+
+  it("lhttp_parser handlers", function()
+    local handlers = lhp.handlers({
+      onUrl = function(conn, url) conn.url = (conn.url or '') .. url end,
+      onHeadersComplete = function(conn, method) conn.method = method end,
+      onMessageComplete = function(conn) conn.done = true end
+    })
+    local a, b = {}, {}
+    local pa = lhp.new('request', handlers, a)
+    local pb = lhp.new('request', handlers, b, { info = 'args' })
+    assert(pa:execute("GET /a HTTP/1.1\r\n\r\n") == 19)
+    assert(pb:execute("POST /b") == 7)
+    assert(pb:execute(" HTTP/1.1\r\nContent-Length: 0\r\n\r\n") == 32)
+    assert.same({ url = "/a", done = true }, { url = a.url, done = a.done })
+    assert.same({ "/b", "POST", true }, { b.url, b.method, b.done })
+    assert(type(a.method) == 'table')
+
+    local pool = lhp.pool('request', handlers, 1)
+    local c = {}
+    local p = pool:acquire(c)
+    assert(p:execute("GET /c HTTP/1.1\r\n\r\n") == 19)
+    assert(c.url == "/c" and c.done)
+    pool:release(p)
+    local d = {}
+    assert(pool:acquire(d) == p)
+    assert(p:execute("GET /d HTTP/1.1\r\n\r\n") == 19)
+    assert(d.url == "/d" and c.url == "/c")
+
+    assert.has_error(function() lhp.handlers() end)
+  end)
+
+  it("lhttp_parser stats", function()
+    local cb = {
+      onUrl = function() end,
+      onHeadersComplete = function() end,
+      onBody = function() end
+    }
+    local req = "POST /a HTTP/1.1\r\nHost: x\r\nContent-Length: 2\r\n\r\nab"
+    local parser = lhp.new('request', cb)
+    assert(parser:execute(req .. req) == 2 * #req)
+    assert.same({ nil, "HPE_INVALID_METHOD" }, { parser:execute("!") })
+
+    local stats = parser:stats()
+    assert.same({ 2 * #req, 2 }, { stats.bytes, stats.messages })
+    assert.same({ onUrl = 2, onHeadersComplete = 2, onBody = 2 }, stats.callbacks)
+    assert.same({ HPE_INVALID_METHOD = 1 }, stats.errors)
+    assert(stats.callback_ns == nil)
+
+    parser = lhp.new('request', cb, { profile = true })
+    assert(parser:execute(req) == #req)
+    stats = parser:stats()
+    assert(stats.max_header_block == #"Host" + #"x" + #"Content-Length" + #"2")
+    assert(stats.callback_ns >= 0 and stats.execute_ns >= 0)
+  end)
+
+  it("lhttp_parser metrics", function()
+    local function get(t, k) return t and t[k] or 0 end
+    local before = lhp.metrics()
+
+    local cb = { onHeadersComplete = function() end }
+    local req = lhp.new('request', cb, { profile = true })
+    assert(req:execute("GET / HTTP/1.1\r\nHost: x\r\n\r\n") == 27)
+    assert(req:execute("!") == nil)
+    local res = lhp.new('response', cb)
+    assert(res:execute("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n") == 45)
+
+    local after = lhp.metrics()
+    assert(after.parsers_created - before.parsers_created == 2)
+    assert(get(after.requests, 'GET') - get(before.requests, 'GET') == 1)
+    assert(get(after.responses, '4xx') - get(before.responses, '4xx') == 1)
+    assert(get(after.errors, 'HPE_INVALID_METHOD') - get(before.errors, 'HPE_INVALID_METHOD') == 1)
+    assert(after.header_block_bytes.count - before.header_block_bytes.count == 1)
+    assert(after.parse_ns.count - before.parse_ns.count == 1)
+    assert(get(after.header_block_bytes.buckets, 8) >= 1)
+
+    local text = lhp.metrics('prometheus')
+    assert(text:find('lhttp_parser_requests_total{method="GET"} %d+\n'))
+    assert(text:find('lhttp_parser_responses_total{class="4xx"} %d+\n'))
+    assert(text:find('lhttp_parser_parse_nanoseconds_bucket{le="+Inf"} ', 1, true))
+    for _, name in ipairs({ 'header_block_bytes', 'parse_nanoseconds' }) do
+      assert(text:find('\nlhttp_parser_' .. name .. '_sum %d+\n'), name)
+      assert(text:find('\nlhttp_parser_' .. name .. '_count %d+\n'), name)
+    end
+    assert(text:sub(-1) == '\n')
+    assert(text:find('# TYPE lhttp_parser_parsers_alive gauge\n', 1, true))
+    assert.has_error(function() lhp.metrics('xml') end)
+  end)
+
+  it("lhttp_parser parse_url", function()
+    local urls = {}
+    local parser = lhp.new('request', {
+      onUrl = function(...) urls[#urls + 1] = { ... } end,
+      onHeadersComplete = function() end
+    }, { parse_url = true })
+
+    local data = "GET /a/b?x=1&y=2#top HTTP/1.1\r\n\r\n" ..
+                 "GET http://h:8080/c HTTP/1.1\r\n\r\n" ..
+                 "CONNECT h:443 HTTP/1.1\r\n\r\n"
+    assert(parser:execute(data) == #data)
+    assert.same({ "/a/b?x=1&y=2#top", "/a/b", "x=1&y=2", "top" }, urls[1])
+    assert.same({ "http://h:8080/c", "/c" }, urls[2])
+    assert.same({ "h:443" }, urls[3])
+
+    -- a URL split over execute calls is delivered once, whole
+    parser:reset()
+    assert(parser:execute("GET /sp") == 7)
+    assert(#urls == 3)
+    assert(parser:execute("lit?q HTTP/1.1\r\n\r\n") == 18)
+    assert.same({ "/split?q", "/split", "q" }, urls[4])
+  end)
+
+  it("lhttp_parser request objects", function()
+    local parser = lhp.new('request', nil, { request = true })
+    local data = "POST /a/b?id=7&name=J%C3%BCrgen+K&flag#top HTTP/1.1\r\n" ..
+                 "Host: example.com\r\nCookie: a=1\r\ncookie: b=2\r\n" ..
+                 "Transfer-Encoding: chunked\r\n\r\n" ..
+                 "5\r\nhello\r\n0\r\nX-Sum: 1\r\n\r\n"
+    local nparsed, err, reqs = parser:execute(data)
+    assert(nparsed == #data and err == "HPE_OK" and #reqs == 1)
+
+    local req = reqs[1]
+    assert(type(req) == 'userdata')
+    assert(req.method == "POST" and req.url == "/a/b?id=7&name=J%C3%BCrgen+K&flag#top")
+    assert(req.path == "/a/b" and req.fragment == "top")
+    assert(req.querystring == "id=7&name=J%C3%BCrgen+K&flag")
+    assert(req:query('id') == "7" and req:query('name') == "J\195\188rgen K")
+    assert(req:query('flag') == "" and req:query('none') == nil)
+    assert(req.headers['host'] == "example.com" and req.headers.HOST == "example.com")
+    assert(req.headers.cookie == "a=1" and #req.headers == 4)
+    assert.same({ "a=1", "b=2" }, { req:header('Cookie') })
+    assert(req.trailers['x-sum'] == "1" and #req.trailers == 1)
+    assert(req.body == "hello" and req.http_minor == 1)
+    assert(req.should_keep_alive == true and req.upgrade == false)
+    assert(req.status_code == nil and req.unknown == nil and req.host == nil)
+
+    -- objects stay valid after the parser moved on
+    local _, _, abs = parser:execute("GET http://h:81/x HTTP/1.1\r\n\r\n")
+    local _, _, more = parser:execute("GET / HTTP/1.1\r\n\r\n")
+    assert(req.headers.host == "example.com" and req.body == "hello")
+    assert(abs[1].host == "h" and abs[1].port == 81 and abs[1].path == "/x")
+    assert(more[1].url == "/" and more[1].trailers == nil)
+
+    local res = lhp.new('response', nil, { request = true })
+    local _, _, msgs = res:execute("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n")
+    assert(msgs[1].status_code == 404 and msgs[1].status_text == "Not Found")
+    assert(msgs[1].method == nil and msgs[1].path == nil)
+  end)
+
+  it("lhttp_parser read_fd", function()
+    local has_ffi, ffi = pcall(require, 'ffi')
+    if not has_ffi or ffi.os ~= 'Linux' then return end
+    pcall(ffi.cdef, [[
+      int pipe(int fd[2]);
+      long write(int fd, const void *buf, unsigned long count);
+      int close(int fd);
+      int fcntl(int fd, int cmd, ...);
+    ]])
+    local fds = ffi.new('int[2]')
+    assert(ffi.C.pipe(fds) == 0)
+    local rd, wr = fds[0], fds[1]
+    ffi.C.fcntl(rd, 4 --[[F_SETFL]], ffi.new('int', 2048 --[[O_NONBLOCK]]))
+    local function send(s) assert(ffi.C.write(wr, s, #s) == #s) end
+
+    local urls, bodies = {}, {}
+    local parser = lhp.new('request', {
+      onUrl = function(url) urls[#urls + 1] = url end,
+      onBody = function(body) bodies[#bodies + 1] = body end,
+      onHeadersComplete = function() end
+    }, { max_messages_per_execute = 1 })
+
+    assert.same({ 0, 0, "EAGAIN" }, { parser:read_fd(rd) })
+    local req = "POST /a HTTP/1.1\r\nContent-Length: 2\r\n\r\nhi"
+    send(req .. "GET /b HTTP/1.1\r\n\r\n")
+    local nread, nparsed, status = parser:read_fd(rd, 16)
+    assert(nread == 16 and nparsed == 16 and status == "HPE_OK")
+    nread, nparsed, status = parser:read_fd(rd)
+    -- the second request is kept back by max_messages_per_execute
+    assert(nread == #req + 19 - 16 and nparsed == #req - 16)
+    assert(status == "max_messages_per_execute")
+    assert.same({ "/a" }, urls)
+    assert.same({ "hi" }, bodies)
+    assert.same({ 0, 19, "HPE_OK" }, { parser:read_fd(rd, 0) })
+    assert.same({ "/a", "/b" }, urls)
+
+    -- bytes after an upgrade are kept for the caller
+    parser:configure({ max_messages_per_execute = 0 })
+    send("GET /ws HTTP/1.1\r\nConnection: upgrade\r\nUpgrade: x\r\n\r\nFRAME")
+    nread, nparsed, status = parser:read_fd(rd)
+    assert(status == "HPE_PAUSED_UPGRADE" and nread - nparsed == 5)
+    -- a paused parser keeps reading without parsing
+    send("MORE")
+    assert.same({ 4, 0, "HPE_PAUSED_UPGRADE" }, { parser:read_fd(rd) })
+    send(string.rep("x", 300))
+    assert.same({ 300, 0, "HPE_PAUSED_UPGRADE" }, { parser:read_fd(rd) })
+    assert(parser:buffered() == "FRAMEMORE" .. string.rep("x", 300))
+    assert(parser:buffered() == "")
+
+    ffi.C.close(wr)
+    parser:reset()
+    assert.same({ 0, 0, "EOF" }, { parser:read_fd(rd) })
+    ffi.C.close(rd)
+    assert(parser:read_fd(rd) == nil)
+  end)
+
   it("lhttp_parser nil body", function()
     local cbs = {}
     local body_count = 0
@@ -0,0 +1,101 @@
+local has_ffi, ffi = pcall(require, 'ffi')
+
+describe('lhttp_parser ffi interface', function()
+  if not has_ffi then
+    pending('needs LuaJIT ffi')
+    return
+  end
+
+  local f = assert(io.open('lhttp_ffi.h'))
+  ffi.cdef(f:read('*a'))
+  f:close()
+  require('lhttp_parser')
+  local C = ffi.load(package.searchpath('lhttp_parser', package.cpath))
+
+  local REQ = 'POST /post?a=1 HTTP/1.1\r\n' ..
+              'Host: localhost\r\n' ..
+              'Transfer-Encoding: chunked\r\n' ..
+              '\r\n' ..
+              '5\r\nhello\r\n' ..
+              '0\r\n\r\n'
+
+  local function run(data, max)
+    local p = ffi.gc(C.lhttp_ffi_new(C.LHTTP_FFI_REQUEST), C.lhttp_ffi_free)
+    local events = ffi.new('lhttp_event[?]', max)
+    local nevents, nparsed = ffi.new('int[1]'), ffi.new('size_t[1]')
+    local ptr = ffi.cast('const char*', data)
+    local off, out, calls = 0, {}, 0
+    local ret
+    repeat
+      calls = calls + 1
+      ret = C.lhttp_ffi_execute(p, ptr + off, #data - off, events, max,
+                                nevents, nparsed)
+      for i = 0, nevents[0] - 1 do
+        local ev = events[i]
+        out[#out + 1] = {
+          kind = ev.kind,
+          length = ev.length,
+          -- the length of a chunk header is the chunk size, not a span
+          value = ev.kind ~= C.LHTTP_EV_CHUNK_HEADER and
+                  ffi.string(ptr + off + ev.offset, ev.length) or nil
+        }
+      end
+      off = off + tonumber(nparsed[0])
+    until ret ~= C.LHTTP_FFI_EVENTS_FULL
+    return p, ret, out, off, calls
+  end
+
+  it('records events of a request', function()
+    local p, ret, out, off, calls = run(REQ, 64)
+    assert.equal(0, ret)
+    assert.equal(#REQ, off)
+    assert.equal(1, calls)
+
+    assert.equal(C.LHTTP_EV_MESSAGE_BEGIN, out[1].kind)
+    assert.equal(C.LHTTP_EV_URL, out[2].kind)
+    assert.equal('/post?a=1', out[2].value)
+    assert.equal(C.LHTTP_EV_HEADER_FIELD, out[3].kind)
+    assert.equal('Host', out[3].value)
+    assert.equal(C.LHTTP_EV_HEADER_VALUE, out[4].kind)
+    assert.equal('localhost', out[4].value)
+    assert.equal(C.LHTTP_EV_HEADERS_COMPLETE, out[7].kind)
+    assert.equal(C.LHTTP_EV_CHUNK_HEADER, out[8].kind)
+    assert.equal(5, out[8].length)
+    assert.equal(C.LHTTP_EV_BODY, out[9].kind)
+    assert.equal('hello', out[9].value)
+    assert.equal(C.LHTTP_EV_MESSAGE_COMPLETE, out[#out].kind)
+
+    assert.equal('POST', ffi.string(C.lhttp_ffi_method_name(C.lhttp_ffi_method(p))))
+    assert.equal(1, C.lhttp_ffi_http_major(p))
+    assert.equal(1, C.lhttp_ffi_http_minor(p))
+    assert.equal(1, C.lhttp_ffi_should_keep_alive(p))
+  end)
+
+  it('continues after the event array is full', function()
+    local _, ret, full = run(REQ, 64)
+    assert.equal(0, ret)
+
+    local _, ret2, out, off, calls = run(REQ, 2)
+    assert.equal(0, ret2)
+    assert.equal(#REQ, off)
+    assert.is_true(calls > 1)
+    assert.same(full, out)
+
+    -- the array fills at the end of the body, message complete is still due
+    local req = 'POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello'
+    local _, ret3, out3 = run(req, 6)
+    assert.equal(0, ret3)
+    assert.equal(C.LHTTP_EV_BODY, out3[6].kind)
+    assert.equal(C.LHTTP_EV_MESSAGE_COMPLETE, out3[7].kind)
+  end)
+
+  it('reports errors', function()
+    local p, ret = run('GET / HTTP/1.1\r\nHost : x\r\n\r\n', 16)
+    assert.equal(C.lhttp_ffi_errno(p), ret)
+    assert.equal('HPE_INVALID_HEADER_TOKEN', ffi.string(C.lhttp_ffi_errno_name(ret)))
+    assert.is_not_nil(C.lhttp_ffi_error_reason(p))
+
+    C.lhttp_ffi_reset(p)
+    assert.equal(0, C.lhttp_ffi_errno(p))
+  end)
+end)
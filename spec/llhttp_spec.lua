@@ -150,6 +150,33 @@ describe('lhttp_parser llhttp', function()
     assert(type(test_parser.http_errno) == "function", "http_errno should be a function")
   end)
 
+  it("llhttp Callbacks are resolved when the parser is created", function ()
+    local urls = {}
+    local cbs = { onHeadersComplete = function() end }
+    local parser = lhp.new('request', cbs)
+    cbs.onUrl = function(url) urls[#urls + 1] = url end
+    local request = "GET /late HTTP/1.1\r\nHost: example.com\r\n\r\n"
+    local bytes, err = parser:execute(request)
+    assert(bytes == #request)
+    assert(err == "HPE_OK")
+    assert(#urls == 0, "callbacks added after new() must be ignored")
+  end)
+
+  it("llhttp Parser with only completion callbacks", function ()
+    local infos, completed = {}, 0
+    local parser = lhp.new('request', {
+      onHeadersComplete = function(info) infos[#infos + 1] = info end,
+      onMessageComplete = function() completed = completed + 1 end
+    })
+    local request = "POST /upload?id=1 HTTP/1.1\r\nHost: example.com\r\n" ..
+                    "Content-Length: 5\r\n\r\nhello"
+    local bytes, err = parser:execute(request .. request)
+    assert(bytes == 2 * #request)
+    assert(err == "HPE_OK")
+    assert(completed == 2)
+    assert(infos[2].method == "POST")
+  end)
+
   it("llhttp Response parser functionality", function ()
     local response_parser = lhp.new('response', {
       onStatus = function(code, text) end,
@@ -0,0 +1,304 @@
+local has_ffi, ffi = pcall(require, 'ffi')
+
+describe('lhttp_server', function()
+  if not has_ffi or ffi.os ~= 'Linux' then
+    pending('needs LuaJIT ffi on Linux')
+    return
+  end
+
+  for _, decl in ipairs({
+    'int socket(int domain, int type, int protocol);',
+    'int connect(int fd, const void *addr, unsigned int len);',
+    'long send(int fd, const void *buf, unsigned long len, int flags);',
+    'long recv(int fd, void *buf, unsigned long len, int flags);',
+    'int close(int fd);',
+    'int shutdown(int fd, int how);',
+    'struct lhttp_spec_sockaddr_in { uint16_t family; uint16_t port;' ..
+    ' uint32_t addr; uint8_t zero[8]; };',
+  }) do
+    pcall(ffi.cdef, decl)
+  end
+  local C = ffi.C
+  local bit = require('bit')
+  local lhttp_server = require('lhttp_server')
+
+  local function connect(port)
+    local fd = C.socket(2 --[[AF_INET]], 1 --[[SOCK_STREAM]], 0)
+    local sa = ffi.new('struct lhttp_spec_sockaddr_in')
+    sa.family = 2
+    sa.port = bit.bor(bit.rshift(port, 8), bit.lshift(bit.band(port, 0xff), 8))
+    sa.addr = ffi.abi('le') and 0x0100007f or 0x7f000001
+    assert(C.connect(fd, sa, ffi.sizeof(sa)) == 0)
+    return fd
+  end
+
+  local buf = ffi.new('char[65536]')
+
+  -- send `data`, then step the server until `done(received)` or the peer
+  -- closes, the second result tells which
+  local function exchange(server, fd, data, done)
+    if data then assert(C.send(fd, data, #data, 0) == #data) end
+    local got = {}
+    for _ = 1, 500 do
+      server:step(10)
+      while true do
+        local n = tonumber(C.recv(fd, buf, 65536, 0x40 --[[MSG_DONTWAIT]]))
+        if n == 0 then return table.concat(got), 'closed' end
+        if n < 0 then break end
+        got[#got + 1] = ffi.string(buf, n)
+      end
+      if done and done(table.concat(got)) then return table.concat(got) end
+    end
+    return table.concat(got), 'timeout'
+  end
+
+  local function responses(n)
+    return function(data)
+      local _, count = data:gsub('HTTP/1%.1 ', '')
+      return count >= n
+    end
+  end
+
+  local function echo(req)
+    return 200, { ['Content-Type'] = 'text/plain' }, req.method .. ' ' .. req.url
+  end
+
+  it('answers requests on a kept-alive connection', function()
+    local server = assert(lhttp_server.new({ handler = echo }))
+    assert(server:port() > 0)
+    local fd = connect(server:port())
+
+    local data = exchange(server, fd, 'GET /a?x=1 HTTP/1.1\r\nHost: t\r\n\r\n', responses(1))
+    assert(data:match('^HTTP/1%.1 200 OK\r\n'), data)
+    assert(data:match('\r\nContent%-Length: 10\r\n'), data)
+    assert(data:match('\r\n\r\nGET /a%?x=1$'), data)
+
+    data = exchange(server, fd, 'POST /b HTTP/1.1\r\nContent-Length: 2\r\n\r\nhi', responses(1))
+    assert(data:match('\r\n\r\nPOST /b$'), data)
+
+    local stats = server:stats()
+    assert(stats.accepted == 1 and stats.active == 1 and stats.requests == 2)
+    assert(stats.bytes_in > 0 and stats.bytes_out > 0 and stats.errors == 0)
+    C.close(fd)
+    server:close()
+  end)
+
+  it('answers pipelined requests in order', function()
+    local server = assert(lhttp_server.new({ handler = echo }))
+    local fd = connect(server:port())
+    local req = 'GET /1 HTTP/1.1\r\n\r\nGET /2 HTTP/1.1\r\n\r\nGET /3 HTTP/1.1\r\n\r\n'
+    local data = exchange(server, fd, req, responses(3))
+    local paths = {}
+    for path in data:gmatch('\r\n\r\nGET (/%d)') do paths[#paths + 1] = path end
+    assert.same({ '/1', '/2', '/3' }, paths)
+    C.close(fd)
+    server:close()
+  end)
+
+  it('parses requests kept back by max_messages_per_execute', function()
+    local server = assert(lhttp_server.new({ handler = echo, max_messages_per_execute = 1 }))
+    local fd = connect(server:port())
+    local req = 'GET /1 HTTP/1.1\r\n\r\nGET /2 HTTP/1.1\r\n\r\nGET /3 HTTP/1.1\r\n\r\n'
+    local data, state = exchange(server, fd, req, responses(3))
+    assert(state == nil, state)
+    assert(data:match('GET /1.*GET /2.*GET /3$'), data)
+    C.close(fd)
+    server:close()
+  end)
+
+  it('closes when the peer shuts down after its request', function()
+    local server = assert(lhttp_server.new({ handler = echo }))
+    local fd = connect(server:port())
+    local req = 'GET /last HTTP/1.1\r\n\r\n'
+    assert(C.send(fd, req, #req, 0) == #req)
+    C.shutdown(fd, 1 --[[SHUT_WR]])
+    local data, state = exchange(server, fd)
+    assert(state == 'closed', state)
+    assert(data:match('GET /last$'), data)
+    assert(server:stats().active == 0)
+    C.close(fd)
+    server:close()
+  end)
+
+  it('leaves the body out for HEAD and closes without keep-alive', function()
+    local server = assert(lhttp_server.new({ handler = echo }))
+    local fd = connect(server:port())
+    local data, state = exchange(server, fd,
+      'HEAD /h HTTP/1.1\r\nConnection: close\r\n\r\nGET /never HTTP/1.1\r\n\r\n')
+    assert(state == 'closed', state)
+    assert(data:match('\r\nContent%-Length: 7\r\n\r\n$'), data)
+    assert(server:stats().requests == 1 and server:stats().active == 0)
+    C.close(fd)
+    server:close()
+  end)
+
+  it('sends large bodies whole', function()
+    local body = string.rep('0123456789', 50000)
+    local server = assert(lhttp_server.new({
+      handler = function() return 200, nil, body end
+    }))
+    local fd = connect(server:port())
+    local data = exchange(server, fd, 'GET / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\n\r\n',
+      function(d) return #d >= 2 * #body + 100 and responses(2)(d) end)
+    local a, b = data:match('\r\n\r\n(%d+)HTTP/1%.1 .-\r\n\r\n(%d+)$')
+    assert(a == body and b == body)
+    C.close(fd)
+    server:close()
+  end)
+
+  it('answers 500 to handler errors and 400 to parse errors', function()
+    local errors = {}
+    local server = assert(lhttp_server.new({
+      handler = function(req)
+        if req.path == '/fail' then error('boom') end
+        return 204
+      end,
+      onError = function(err, req) errors[#errors + 1] = req.path .. ' ' .. err end
+    }))
+
+    local fd = connect(server:port())
+    local data, state = exchange(server, fd, 'GET /ok HTTP/1.1\r\n\r\nGET /fail HTTP/1.1\r\n\r\n')
+    assert(state == 'closed', state)
+    assert(data:match('^HTTP/1%.1 204 No Content\r\n'), data)
+    assert(data:match('HTTP/1%.1 500 Internal Server Error\r\n.*Connection: close'), data)
+    assert(#errors == 1 and errors[1]:match('^/fail .*boom'), errors[1])
+    C.close(fd)
+
+    fd = connect(server:port())
+    data, state = exchange(server, fd, 'GET / HTTP/1.1\r\nHost : x\r\n\r\n')
+    assert(state == 'closed', state)
+    assert(data:match('^HTTP/1%.1 400 Bad Request\r\n'), data)
+    assert(server:stats().errors == 2 and server:stats().requests == 2)
+    C.close(fd)
+    server:close()
+  end)
+
+  it('frames a response the handler gave no body', function()
+    local server = assert(lhttp_server.new({
+      handler = function(req)
+        if req.path == '/framed' then return 200, { ['Content-Length'] = '0' } end
+        return 200
+      end
+    }))
+    local fd = connect(server:port())
+    local data, state = exchange(server, fd,
+      'GET /a HTTP/1.1\r\n\r\nGET /framed HTTP/1.1\r\n\r\n', responses(2))
+    assert(state == nil, state)
+    local _, lengths = data:gsub('\r\nContent%-Length: 0\r\n', '')
+    assert(lengths == 2 and data:match('\r\n\r\nHTTP/1%.1 200 OK\r\n.-\r\n\r\n$'), data)
+    assert(server:stats().active == 1)
+    C.close(fd)
+    server:close()
+  end)
+
+  it('passes the parser limits on and ignores other parser options', function()
+    local server = assert(lhttp_server.new({
+      handler = echo, max_header_bytes = 64, yieldable = true, collect = false
+    }))
+    local fd = connect(server:port())
+    local data = exchange(server, fd, 'GET /ok HTTP/1.1\r\n\r\n', responses(1))
+    assert(data:match('\r\n\r\nGET /ok$'), data)
+    local state
+    data, state = exchange(server, fd,
+      'GET / HTTP/1.1\r\nX-Long: ' .. string.rep('x', 100) .. '\r\n\r\n')
+    assert(state == 'closed', state)
+    assert(data:match('^HTTP/1%.1 400 Bad Request\r\n'), data)
+    C.close(fd)
+    server:close()
+  end)
+
+  it('answers 500 to a body on a status without one', function()
+    local server = assert(lhttp_server.new({
+      handler = function() return 304, nil, 'stale' end
+    }))
+    local fd = connect(server:port())
+    local data, state = exchange(server, fd, 'GET / HTTP/1.1\r\n\r\n')
+    assert(state == 'closed', state)
+    assert(data:match('^HTTP/1%.1 500 ') and not data:find('stale'), data)
+    C.close(fd)
+    server:close()
+  end)
+
+  it('reports an address in use', function()
+    local server = assert(lhttp_server.new({ handler = echo }))
+    local other, err = lhttp_server.new({ handler = echo, port = server:port() })
+    assert(other == nil and type(err) == 'string')
+    assert.has_error(function() lhttp_server.new({}) end)
+    server:close()
+    assert.has_error(function() server:step(0) end)
+  end)
+
+  it('serves the bundled load generator', function()
+    local f = io.open('./lhttp_load')
+    if not f then return end
+    f:close()
+
+    local server = assert(lhttp_server.new({
+      handler = function() return 200, nil, 'ok' end
+    }))
+    local out = os.tmpname()
+    os.execute(string.format('(./lhttp_load -P %d -c 8 -n 2000 -p 4 >%s 2>&1; echo $? >>%s) &',
+                             server:port(), out, out))
+    local report
+    for _ = 1, 1000 do
+      server:step(10)
+      f = io.open(out)
+      report = f:read('*a')
+      f:close()
+      if report:match('\n%d+\n$') then break end
+    end
+    os.remove(out)
+    assert(report:match('^requests: 2000, failed: 0,') and report:match('\n0\n$'), report)
+    assert(server:stats().requests == 2000)
+    server:close()
+  end)
+
+  it('runs worker threads', function()
+    local script = os.tmpname()
+    local f = assert(io.open(script, 'w'))
+    f:write("local id = ...\n",
+            "return { handler = function(req) return 200, nil, 'worker ' .. id end }\n")
+    f:close()
+
+    local group = assert(lhttp_server.workers({
+      script = script, threads = 2, cpus = true, max_header_bytes = 4096
+    }))
+    local fd = connect(group:port())
+    local req = 'GET / HTTP/1.1\r\nConnection: close\r\n\r\n'
+    assert(C.send(fd, req, #req, 0) == #req)
+    -- the workers run on their own, only wait for them a bounded time
+    local got, closed = {}, false
+    for _ = 1, 500 do
+      local n = tonumber(C.recv(fd, buf, 65536, 0x40 --[[MSG_DONTWAIT]]))
+      if n == 0 then closed = true; break end
+      if n > 0 then got[#got + 1] = ffi.string(buf, n) else os.execute('sleep 0.01') end
+    end
+    C.close(fd)
+    assert(closed, 'timeout')
+    assert(table.concat(got):match('\r\n\r\nworker [12]$'), table.concat(got))
+
+    local has_load = io.open('./lhttp_load')
+    if has_load then
+      has_load:close()
+      local rc = os.execute(string.format('./lhttp_load -P %d -c 16 -n 4000 -p 4 >/dev/null',
+                                          group:port()))
+      assert(rc == 0 or rc == true)
+    end
+    -- a worker publishes its counters after the round of events
+    local stats, requests
+    for _ = 1, 100 do
+      stats, requests = group:stats(), 0
+      for _, s in ipairs(stats) do requests = requests + s.requests end
+      if requests == (has_load and 4001 or 1) then break end
+      os.execute('sleep 0.01')
+    end
+    assert(#stats == 2 and requests == (has_load and 4001 or 1), requests)
+    assert(stats[1].worker == 1 and stats[1].running and stats[2].cpu >= 0)
+    assert.same({ true }, { group:stop() })
+    assert.has_error(function() group:stats() end)
+
+    local bad, err = lhttp_server.workers({ script = script .. '.missing', threads = 2 })
+    assert(bad == nil and err:match('^worker 1: '), err)
+    os.remove(script)
+  end)
+end)
@@ -0,0 +1,111 @@
+describe('lhttp_writer', function()
+  local w = require('lhttp_writer')
+  local lhp = require('lhttp_parser')
+
+  -- parse a serialized message back
+  local function parse(kind, data)
+    local parser = lhp.new(kind, nil, { collect = true })
+    local nparsed, err, msgs = parser:execute(data)
+    assert(nparsed == #data and err == "HPE_OK", err)
+    return msgs[1]
+  end
+
+  it("precomputes status lines", function()
+    assert(w.status_line(200) == "HTTP/1.1 200 OK\r\n")
+    assert(w.status_line(404) == "HTTP/1.1 404 Not Found\r\n")
+    assert(w.status_line(599) == "HTTP/1.1 599 Network Connect Timeout\r\n")
+    assert(w.status_line(299) ~= nil and w.status_line(600) == nil)
+  end)
+
+  it("formats the date", function()
+    local date = w.date()
+    assert(date:match("^%a%a%a, %d%d %a%a%a %d%d%d%d %d%d:%d%d:%d%d GMT$"), date)
+  end)
+
+  it("serializes a response", function()
+    local data = w.response(200, { ['Content-Type'] = 'text/plain' }, 'hello')
+    assert(data:sub(1, 17) == "HTTP/1.1 200 OK\r\n")
+    local msg = parse('response', data)
+    assert(msg.status_code == 200 and msg.body == "hello")
+    assert(msg.headers['Content-Type'] == "text/plain")
+    assert(msg.headers['Content-Length'] == "5" and msg.headers.Date)
+
+    msg = parse('response', w.response(204, { Date = false, ['Set-Cookie'] = { 'a=1', 'b=2' } }))
+    assert(msg.status_code == 204 and msg.headers.Date == nil)
+    assert.same({ 'a=1', 'b=2' }, msg.headers['Set-Cookie'])
+    assert(msg.headers['Content-Length'] == nil)
+
+    assert(w.response(799):sub(1, 15) == "HTTP/1.1 799 \r\n")
+    local v = w.responsev(200, { ['content-length'] = 3 }, 'abc')
+    assert(#v == 2 and v[2] == 'abc' and not v[1]:find('Content-Length'))
+    assert(v[1]:sub(-4) == "\r\n\r\n")
+  end)
+
+  it("serializes a request", function()
+    local msg = parse('request', w.request('POST', '/x?a=1', { Host = 'h' }, 'body'))
+    assert(msg.method == "POST" and msg.url == "/x?a=1" and msg.body == "body")
+    assert(msg.headers.Host == "h" and msg.headers['Content-Length'] == "4")
+    assert(w.request('GET', '/') == "GET / HTTP/1.1\r\n\r\n")
+  end)
+
+  it("rejects what would break the framing", function()
+    assert.has_error(function() w.response(200, { ['X-A'] = 'a\r\nX-B: b' }) end)
+    assert.has_error(function() w.response(200, { ['X A'] = 'a' }) end)
+    assert.has_error(function() w.response(200, { ['X-A'] = {} , [1] = 'x' }) end)
+    assert.has_error(function() w.response(42) end)
+    -- no body after a status without one, an empty body is fine
+    assert.has_error(function() w.response(204, nil, 'x') end)
+    assert.has_error(function() w.responsev(304, nil, 'x') end)
+    assert.has_error(function() w.buffer():response(101, nil, 'x') end)
+    assert(not w.response(204, nil, ''):find('Content%-Length'))
+    assert.has_error(function() w.request('GET', '/a b') end)
+  end)
+
+  it("frames a chunked body", function()
+    local body = w.chunked()
+    local payload = string.rep('x', 300)
+    local list = body:write(payload)
+    assert.same({ "12c\r\n", payload, "\r\n" }, list)
+    assert(#body:write('', list) == 3)
+    body:write('yz', list)
+    body:finish({ ['X-Sum'] = '1' }, list)
+    assert(list[#list] == "0\r\nX-Sum: 1\r\n\r\n")
+    assert(body:remaining() == nil)
+    assert.has_error(function() body:write('more') end)
+
+    local head = w.response(200, { ['Transfer-Encoding'] = 'chunked', Date = false })
+    local msg = parse('response', head .. table.concat(list))
+    assert(msg.body == payload .. 'yz' and msg.trailers['X-Sum'] == "1")
+    assert(w.chunked():finish()[1] == "0\r\n\r\n")
+  end)
+
+  it("counts down a content length", function()
+    local body = w.body(5)
+    assert.same({ "hel" }, body:write("hel"))
+    assert(body:remaining() == 2)
+    local ok, err = pcall(body.write, body, "lo!")
+    assert(not ok and err:match("Content%-Length, 2 bytes left$"), err)
+    ok, err = pcall(body.finish, body)
+    assert(not ok and err:match("Content%-Length, 2 bytes missing$"), err)
+    assert.has_error(function() w.body(-1) end)
+    body:write("lo")
+    assert.same({}, body:finish())
+    assert.has_error(function() body:finish() end)
+  end)
+
+  it("writes into a reusable buffer", function()
+    local buf = w.buffer(64)
+    buf:response(200, { Date = false }, 'a'):write('tail')
+    assert(buf:tostring() == "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\natail")
+    local ptr, len = buf:pointer()
+    assert(type(ptr) == 'userdata' and len == #buf)
+
+    -- a failed write leaves the buffer as it was
+    local before = buf:tostring()
+    assert.has_error(function() buf:response(200, { ['X-A'] = 'a\n' }) end)
+    assert(buf:tostring() == before)
+
+    buf:reset():request('GET', '/')
+    assert(buf:tostring() == "GET / HTTP/1.1\r\n\r\n")
+  end)
+end)